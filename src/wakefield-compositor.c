@@ -27,6 +27,10 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <errno.h>
@@ -38,19 +42,41 @@
 #include "wakefield-compositor.h"
 #include "wakefield-private.h"
 #include "xdg-shell-server-protocol.h"
+#include "relative-pointer-unstable-v1-server-protocol.h"
+#include "input-timestamps-unstable-v1-server-protocol.h"
+#include "pointer-gestures-unstable-v1-server-protocol.h"
 
 #include <linux/input-event-codes.h>
+#include <linux/sockios.h>
 #include <xkbcommon/xkbcommon.h>
 
 #if defined(GDK_WINDOWING_X11)
 #include <xkbcommon/xkbcommon-x11.h>
 #include <gdk/gdkx.h>
 #include <X11/Xlib-xcb.h>
+#include <X11/extensions/XInput2.h>
 #endif
 
 typedef struct _WakefieldPointer
 {
+  WakefieldCompositor *compositor;
   struct wl_list resource_list;
+  struct wl_list relative_resource_list;
+  struct wl_list timestamps_resource_list;
+  struct wl_list swipe_resource_list;
+  struct wl_list pinch_resource_list;
+  struct wl_list hold_resource_list;
+
+  /* Where the touchpad gestures in progress began */
+  struct wl_resource *swipe_surface;
+  struct wl_resource *pinch_surface;
+
+  /* Set once XI2 raw motion feeds the relative pointers, otherwise relative
+     motion is derived from the root coordinates of the motion events */
+  gboolean raw_motion;
+  gboolean has_last_root;
+  double last_root_x;
+  double last_root_y;
 
   guint32 serial;
   guint32 button_count;
@@ -77,15 +103,16 @@ typedef struct _WakefieldPointer
   guint32 grab_time;
 } WakefieldPointer;
 
-typedef struct _WakefieldKeyboard
+/* Compiled once per process, and shared by every compositor */
+typedef struct _WakefieldKeymap
 {
-  struct wl_list resource_list;
-  struct wl_resource *focus;
-  struct xkb_context *context;
-  struct xkb_keymap *keymap;
-  int keymap_fd;
-  gsize keymap_size;
-  gboolean has_x11_xkb;
+  char *string;
+  /* Including the terminating nul */
+  gsize size;
+  /* Sealed memfd with the string, -1 if the system can't seal */
+  int fd;
+  guint hash;
+
   xkb_mod_index_t shift_mod;
   xkb_mod_index_t caps_mod;
   xkb_mod_index_t ctrl_mod;
@@ -97,6 +124,24 @@ typedef struct _WakefieldKeyboard
   xkb_led_index_t num_led;
   xkb_led_index_t caps_led;
   xkb_led_index_t scroll_led;
+} WakefieldKeymap;
+
+typedef struct _WakefieldKeyboard
+{
+  WakefieldCompositor *compositor;
+  struct wl_list resource_list;
+  struct wl_list timestamps_resource_list;
+  struct wl_resource *focus;
+  /* NULL until the shared keymap is compiled */
+  const WakefieldKeymap *keymap;
+
+  GSettings *settings;
+  /* Characters per second, 0 disables repeat */
+  gint32 repeat_rate;
+  /* Milliseconds */
+  gint32 repeat_delay;
+  /* Bit per hardware keycode, to tell autorepeat apart from real presses */
+  guint32 pressed_keys[256 / 32];
 
   guint32 mods_depressed;
   guint32 mods_latched;
@@ -104,15 +149,42 @@ typedef struct _WakefieldKeyboard
   guint32 group;
 } WakefieldKeyboard;
 
+typedef struct _WakefieldTouchPoint
+{
+  struct wl_resource *surface;
+  int32_t id;
+} WakefieldTouchPoint;
+
+typedef struct _WakefieldTouch
+{
+  WakefieldCompositor *compositor;
+  struct wl_list resource_list;
+  struct wl_list timestamps_resource_list;
+
+  /* GdkEventSequence -> WakefieldTouchPoint, for the touches in progress */
+  GHashTable *points;
+  int32_t next_id;
+
+  /* Sends the wl_touch.frame once GDK has no more events queued */
+  guint frame_source_id;
+} WakefieldTouch;
+
 typedef struct _WakefieldOutput
 {
   struct wl_list resource_list;
+
+  /* Binds may happen in the dispatch thread, so these come from GTK
+     as the widget gets allocated */
+  int width, height;
+  int scale;
 } WakefieldOutput;
 
 typedef struct _WakefieldSeat
 {
   WakefieldPointer pointer;
   WakefieldKeyboard keyboard;
+  WakefieldTouch touch;
+  gboolean has_touch;
 } WakefieldSeat;
 
 typedef struct _WakefieldRegion
@@ -121,27 +193,198 @@ typedef struct _WakefieldRegion
   cairo_region_t *region;
 } WakefieldRegion;
 
+typedef struct _WakefieldClient
+{
+  WakefieldCompositor *compositor;
+  struct wl_client *client;
+  struct wl_listener destroy_listener;
+  struct wl_list link;
+
+  /* Dispatch accounting, to find out who is hogging the loop */
+  guint64 n_requests;
+  guint n_iteration_requests;
+  guint64 n_over_budget;
+
+  /* Set while the client isn't reading its socket fast enough, we then
+     hold back frame callbacks and only keep the latest pointer motion */
+  gboolean congested;
+  gboolean has_pending_motion;
+  guint32 pending_motion_time;
+  double pending_motion_x;
+  double pending_motion_y;
+
+  /* Liveness, through xdg_wm_base pings. Unresponsive clients get no
+     frame callbacks or configures until they answer */
+  uint32_t ping_serial;
+  guint ping_timeout_id;
+  gboolean unresponsive;
+
+  /* When the oldest event still sitting in our buffers was queued */
+  gint64 unflushed_since;
+
+  /* What was passed to wakefield_compositor_create_client_fd() */
+  gpointer user_data;
+
+  /* The most recently bound of each, so that event delivery doesn't have
+     to search the resource lists of every connected client */
+  struct wl_resource *resources[WAKEFIELD_N_CLIENT_RESOURCES];
+
+  /* Gets every pointer motion, even when we coalesce them */
+  gboolean motion_history;
+
+  /* Was sent touch events that still need a wl_touch.frame */
+  gboolean touch_frame_pending;
+} WakefieldClient;
+
+/* The wl_display and what drives it, shared by all the compositors
+   created with wakefield_compositor_new_shared(). Each client belongs
+   to one of them, and the globals route their binds accordingly. */
+typedef struct _WakefieldDisplay
+{
+  int ref_count;
+  struct wl_display *wl_display;
+  GSource *wayland_source;
+
+  /* Only set while protocol dispatch runs on its own thread, the display
+     lock then serializes all the libwayland access between both threads */
+  GThread *dispatch_thread;
+  GMainContext *dispatch_context;
+  GMainLoop *dispatch_loop;
+  GRecMutex display_lock;
+
+  struct wl_list clients;
+  struct wl_listener client_created_listener;
+
+  /* Clients connecting through a socket belong to the first one */
+  GList *compositors;
+
+  /* Limits to a single dispatch iteration, 0 means unlimited */
+  guint dispatch_budget_us;
+  guint client_request_budget;
+
+  /* Bytes queued in a client socket before it counts as congested */
+  gsize congestion_threshold;
+
+  /* Pings only go out while some client has bound xdg_wm_base */
+  guint n_shell_resources;
+  guint ping_interval_id;
+
+  int dispatch_priority;
+
+  /* Counts requests against the client budget, and timestamps events
+     when latency stats are on. Not installed when neither is needed. */
+  struct wl_protocol_logger *protocol_logger;
+
+  /* Time from queueing input events to flushing them to the client,
+     either right away by the input handlers or by the next prepare.
+     Only kept with WAKEFIELD_LATENCY_STATS set in the environment. */
+  gboolean latency_stats;
+  guint64 n_input_flushes;
+  gint64 input_flush_latency_us;
+  guint64 n_deferred_flushes;
+  gint64 deferred_flush_latency_us;
+} WakefieldDisplay;
+
 typedef struct _WakefieldCompositorPrivate
 {
   GdkWindow *event_window;
-  GSource *wayland_source;
+  GSource *handoff_source;
+  WakefieldDisplay *display;
   struct wl_display *wl_display;
 
   struct wl_list surfaces;
   struct wl_list xdg_surfaces;
   struct wl_list xdg_popups;
+
+  /* Toplevel configures not sent because nothing the client cares about
+     changed */
+  guint64 n_suppressed_configures;
+
+  WakefieldMotionMode motion_mode;
+  /* Latest motion not sent yet in WAKEFIELD_MOTION_COALESCE mode */
+  struct wl_resource *pending_motion_surface;
+  guint32 pending_motion_time;
+  double pending_motion_x;
+  double pending_motion_y;
+  guint motion_tick_id;
+
+  /* GdkWindow -> xdg_surface resource, for routing GDK events */
+  GHashTable *surface_windows;
+  /* Mapped wl_surface resources, bottom to top, in the order their
+     windows got stacked */
+  GQueue mapped_surfaces;
   struct wl_list shell_resources;
   WakefieldSeat seat;
   WakefieldOutput output;
   WakefieldDataDevice *data_device;
+  WakefieldPrimarySelection *primary_selection;
+  WakefieldPointerConstraints *pointer_constraints;
 } WakefieldCompositorPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (WakefieldCompositor, wakefield_compositor, GTK_TYPE_WIDGET);
 
-#define wl_resource_for_each_reverse(resource, list)                   \
-	for (resource = 0, resource = wl_resource_from_link((list)->prev);	\
-	     wl_resource_get_link(resource) != (list);				\
-	     resource = wl_resource_from_link(wl_resource_get_link(resource)->prev))
+enum {
+  CLIENT_CONGESTED,
+  CLIENT_UNRESPONSIVE,
+
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
+static WakefieldClient *wakefield_client_from_wl_client (struct wl_client *client);
+static void wakefield_compositor_flush_input (WakefieldCompositor *compositor,
+                                              struct wl_client    *client);
+static void keyboard_send_keymap (struct wl_resource    *keyboard_resource,
+                                  const WakefieldKeymap *keymap);
+static void keyboard_send_repeat_info (struct wl_resource *keyboard_resource,
+                                       WakefieldKeyboard  *keyboard);
+
+typedef WakefieldDisplay WakefieldDisplayLocker;
+static WakefieldDisplayLocker *
+wakefield_display_lock (WakefieldDisplay *display)
+{
+  if (display->dispatch_context == NULL)
+    return NULL;
+
+  g_rec_mutex_lock (&display->display_lock);
+  return display;
+}
+
+static WakefieldDisplayLocker *
+wakefield_display_locker (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return wakefield_display_lock (priv->display);
+}
+
+static void
+wakefield_display_unlocker (WakefieldDisplayLocker *display)
+{
+  g_rec_mutex_unlock (&display->display_lock);
+
+  /* Events we queued need to be flushed by the dispatch thread */
+  if (display->dispatch_context != NULL)
+    g_main_context_wakeup (display->dispatch_context);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (WakefieldDisplayLocker, wakefield_display_unlocker);
+
+/* For main thread code outside this file. Hand the result back to
+   wakefield_compositor_unlock(), it knows whether the lock was taken
+   even if threaded dispatch got toggled in between. */
+WakefieldCompositorLock *
+wakefield_compositor_lock (WakefieldCompositor *compositor)
+{
+  return wakefield_display_locker (compositor);
+}
+
+void
+wakefield_compositor_unlock (WakefieldCompositorLock *locked)
+{
+  if (locked != NULL)
+    wakefield_display_unlocker (locked);
+}
 
 static void
 unset_cursor_surface (WakefieldPointer *pointer,
@@ -151,6 +394,7 @@ static void
 wakefield_compositor_realize (GtkWidget *widget)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   GtkAllocation allocation;
   GdkWindow *window;
@@ -193,6 +437,7 @@ static void
 wakefield_compositor_unrealize (GtkWidget *widget)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource;
 
@@ -201,6 +446,14 @@ wakefield_compositor_unrealize (GtkWidget *widget)
       wakefield_xdg_surface_unrealize (xdg_surface_resource);
     }
 
+  /* No frame clock anymore */
+  if (priv->motion_tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (widget, priv->motion_tick_id);
+      priv->motion_tick_id = 0;
+    }
+  wakefield_compositor_flush_motion (compositor);
+
   if (priv->event_window != NULL)
     {
       gtk_widget_unregister_window (widget, priv->event_window);
@@ -235,58 +488,59 @@ wakefield_compositor_unmap (GtkWidget *widget)
 }
 
 static void
-refresh_output (WakefieldCompositor *compositor,
-                struct wl_resource *output)
+refresh_output (WakefieldOutput    *output,
+                struct wl_resource *resource)
 {
-  GtkAllocation allocation;
-
-  gtk_widget_get_allocation (GTK_WIDGET (compositor), &allocation);
-
-  wl_output_send_scale (output, gtk_widget_get_scale_factor (GTK_WIDGET (compositor)));
-  wl_output_send_mode (output,
+  wl_output_send_scale (resource, output->scale);
+  wl_output_send_mode (resource,
                        WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
-                       allocation.width,
-                       allocation.height,
+                       output->width,
+                       output->height,
                        60 * 1000);
-  wl_output_send_done (output);
+  wl_output_send_done (resource);
 }
 
-static gboolean
-send_xdg_toplevel_configure (WakefieldCompositor *compositor,
-                             struct wl_resource  *xdg_surface)
+/* The xdg_toplevel states, as a mask of 1 << state */
+static uint32_t
+get_xdg_toplevel_states (WakefieldCompositor *compositor)
 {
-  GtkAllocation allocation;
-  struct wl_resource *xdg_toplevel;
-  struct wl_array states;
-  uint32_t *s;
+  uint32_t states = 1 << XDG_TOPLEVEL_STATE_MAXIMIZED;
 
-  xdg_toplevel = wakefield_xdg_surface_get_xdg_toplevel (xdg_surface);
+  if ((gtk_widget_get_state_flags (GTK_WIDGET (compositor)) & GTK_STATE_FLAG_BACKDROP) == 0)
+    states |= 1 << XDG_TOPLEVEL_STATE_ACTIVATED;
 
-  if (!xdg_toplevel)
-    return FALSE;
+  return states;
+}
 
-  gtk_widget_get_allocation (GTK_WIDGET (compositor), &allocation);
+static void
+send_xdg_toplevel_configure (struct wl_resource *xdg_toplevel,
+                             int32_t             width,
+                             int32_t             height,
+                             uint32_t            state_mask)
+{
+  struct wl_array states;
+  uint32_t *s;
+  int i;
 
   if (wl_resource_get_version (xdg_toplevel) >=
       XDG_TOPLEVEL_CONFIGURE_BOUNDS_SINCE_VERSION)
     {
-      xdg_toplevel_send_configure_bounds (xdg_toplevel,
-                                          allocation.width, allocation.height);
+      xdg_toplevel_send_configure_bounds (xdg_toplevel, width, height);
     }
 
   wl_array_init(&states);
-  s = wl_array_add(&states, sizeof *s);
-  *s = XDG_TOPLEVEL_STATE_MAXIMIZED;
-  if ((gtk_widget_get_state_flags (GTK_WIDGET (compositor)) & GTK_STATE_FLAG_BACKDROP) == 0)
+  for (i = 0; i < 32; i++)
     {
-      s = wl_array_add(&states, sizeof *s);
-      *s = XDG_TOPLEVEL_STATE_ACTIVATED;
+      if (state_mask & (1 << i))
+        {
+          s = wl_array_add(&states, sizeof *s);
+          *s = i;
+        }
     }
-  xdg_toplevel_send_configure (xdg_toplevel, allocation.width, allocation.height,
-                               &states);
+  xdg_toplevel_send_configure (xdg_toplevel, width, height, &states);
   wl_array_release(&states);
 
-  return TRUE;
+  wakefield_xdg_toplevel_set_configured (xdg_toplevel, width, height, state_mask);
 }
 
 static gboolean
@@ -308,6 +562,8 @@ send_xdg_popup_configure (WakefieldCompositor *compositor,
   return TRUE;
 }
 
+#define SUPPRESSED_CONFIGURES_REPORT_INTERVAL 64
+
 static void
 send_xdg_configure_request (WakefieldCompositor *compositor,
                             struct wl_resource  *xdg_surface)
@@ -315,27 +571,65 @@ send_xdg_configure_request (WakefieldCompositor *compositor,
   WakefieldCompositorPrivate *priv =
     wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *surface_resource;
+  struct wl_resource *xdg_toplevel;
+  GtkAllocation allocation;
+  uint32_t states;
+  uint32_t serial;
 
   surface_resource = wakefield_xdg_surface_get_surface_resource (xdg_surface);
 
+  /* It will get the current state once it answers pings again */
+  if (wakefield_compositor_client_is_unresponsive (compositor,
+                                                   wl_resource_get_client (xdg_surface)))
+    return;
+
   switch (wakefield_surface_get_role (surface_resource))
     {
       case WAKEFIELD_SURFACE_ROLE_NONE:
         return;
       case WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR:
+      case WAKEFIELD_SURFACE_ROLE_DND_ICON:
         break;
       case WAKEFIELD_SURFACE_ROLE_XDG_TOPLEVEL:
-        if (!send_xdg_toplevel_configure (compositor, xdg_surface))
+        xdg_toplevel = wakefield_xdg_surface_get_xdg_toplevel (xdg_surface);
+        if (!xdg_toplevel)
           return;
-        break;
+
+        gtk_widget_get_allocation (GTK_WIDGET (compositor), &allocation);
+        states = get_xdg_toplevel_states (compositor);
+
+        /* Prelight, focus and such don't change anything for the client,
+           and a configure makes it relayout */
+        if (wakefield_xdg_toplevel_is_configured (xdg_toplevel, allocation.width,
+                                                  allocation.height, states))
+          {
+            priv->n_suppressed_configures++;
+            if (priv->n_suppressed_configures % SUPPRESSED_CONFIGURES_REPORT_INTERVAL == 0)
+              g_debug ("Suppressed %" G_GUINT64_FORMAT " unchanged toplevel configures",
+                       priv->n_suppressed_configures);
+            return;
+          }
+
+        /* Resizing would otherwise have the client render every
+           intermediate size, it gets the latest one after the ack */
+        if (wakefield_xdg_surface_configure_throttled (xdg_surface))
+          return;
+
+        send_xdg_toplevel_configure (xdg_toplevel, allocation.width, allocation.height, states);
+
+        serial = wl_display_next_serial (priv->wl_display);
+        xdg_surface_send_configure (xdg_surface, serial);
+        wakefield_xdg_surface_configure_sent (xdg_surface, serial, TRUE);
+        return;
       case WAKEFIELD_SURFACE_ROLE_XDG_POPUP:
         if (!send_xdg_popup_configure (compositor, xdg_surface))
           return;
         break;
     }
 
-  xdg_surface_send_configure (xdg_surface,
-                              wl_display_next_serial (priv->wl_display));
+  serial = wl_display_next_serial (priv->wl_display);
+  xdg_surface_send_configure (xdg_surface, serial);
+  wakefield_xdg_surface_configure_sent (xdg_surface, serial, FALSE);
 }
 
 static void
@@ -343,6 +637,7 @@ wakefield_compositor_size_allocate (GtkWidget *widget,
                                     GtkAllocation *allocation)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource, *output;
 
@@ -355,9 +650,13 @@ wakefield_compositor_size_allocate (GtkWidget *widget,
                             allocation->width,
                             allocation->height);
 
+  priv->output.width = allocation->width;
+  priv->output.height = allocation->height;
+  priv->output.scale = gtk_widget_get_scale_factor (widget);
+
   wl_resource_for_each (output, &priv->output.resource_list)
     {
-      refresh_output (compositor, output);
+      refresh_output (&priv->output, output);
     }
 
   wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
@@ -371,6 +670,7 @@ wakefield_compositor_state_flags_changed (GtkWidget        *widget,
                                           GtkStateFlags     old_state)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource;
 
@@ -387,9 +687,28 @@ wakefield_compositor_draw (GtkWidget *widget,
                            cairo_t   *cr)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource;
 
+  /* A lone opaque toplevel covering everything needs no compositing,
+     any popup or second window brings back the general path */
+  if (!wl_list_empty (&priv->xdg_surfaces) &&
+      priv->xdg_surfaces.next == priv->xdg_surfaces.prev)
+    {
+      struct wl_resource *surface_resource;
+      GtkAllocation allocation;
+
+      xdg_surface_resource = wl_resource_from_link (priv->xdg_surfaces.next);
+      surface_resource = wakefield_xdg_surface_get_surface_resource (xdg_surface_resource);
+      gtk_widget_get_allocation (widget, &allocation);
+
+      if (surface_resource &&
+          wakefield_surface_draw_opaque (surface_resource, cr,
+                                         allocation.width, allocation.height))
+        return TRUE;
+    }
+
   wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
     {
       struct wl_resource *surface_resource = wakefield_xdg_surface_get_surface_resource (xdg_surface_resource);
@@ -406,7 +725,8 @@ wakefield_compositor_get_pointer_for_client (WakefieldCompositor *compositor,
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  return wl_resource_find_for_client (&priv->seat.pointer.resource_list, client);
+  return wakefield_client_lookup_resource (client, WAKEFIELD_CLIENT_POINTER,
+                                           &priv->seat.pointer.resource_list);
 }
 
 static struct wl_resource *
@@ -415,7 +735,96 @@ wakefield_compositor_get_keyboard_for_client (WakefieldCompositor *compositor,
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  return wl_resource_find_for_client (&priv->seat.keyboard.resource_list, client);
+  return wakefield_client_lookup_resource (client, WAKEFIELD_CLIENT_KEYBOARD,
+                                           &priv->seat.keyboard.resource_list);
+}
+
+static struct wl_resource *
+wakefield_compositor_get_touch_for_client (WakefieldCompositor *compositor,
+                                           struct wl_client *client)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return wakefield_client_lookup_resource (client, WAKEFIELD_CLIENT_TOUCH,
+                                           &priv->seat.touch.resource_list);
+}
+
+/* GDK only has 32 bit millisecond event times, which on X11 come from
+   the monotonic clock. Extend them to 64 bits; the sub-millisecond part
+   isn't known, and guessing it from when we handle the event would make
+   timestamps go backwards */
+static guint64
+event_time_to_ns (guint32 time)
+{
+  guint64 now_ms = g_get_monotonic_time () / 1000;
+  guint64 ms;
+
+  ms = (now_ms & ~(guint64) G_MAXUINT32) | time;
+  if (ms > now_ms && ms > G_MAXUINT32)
+    ms -= (guint64) G_MAXUINT32 + 1;
+
+  return ms * 1000000;
+}
+
+/* Precedes the events of @input_resource carrying @time */
+static void
+send_input_timestamps (struct wl_list     *timestamps_resource_list,
+                       struct wl_resource *input_resource,
+                       guint32             time)
+{
+  struct wl_client *client = wl_resource_get_client (input_resource);
+  struct wl_resource *resource;
+  guint64 time_ns = 0, tv_sec;
+
+  wl_resource_for_each (resource, timestamps_resource_list)
+    {
+      if (wl_resource_get_client (resource) != client)
+        continue;
+
+      if (time_ns == 0)
+        time_ns = event_time_to_ns (time);
+
+      tv_sec = time_ns / 1000000000;
+      zwp_input_timestamps_v1_send_timestamp (resource,
+                                              tv_sec >> 32,
+                                              tv_sec & 0xffffffff,
+                                              time_ns % 1000000000);
+    }
+}
+
+static void
+pointer_send_timestamps (struct wl_resource *pointer_resource,
+                         guint32             time)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+
+  send_input_timestamps (&pointer->timestamps_resource_list, pointer_resource, time);
+}
+
+static void
+touch_send_timestamps (struct wl_resource *touch_resource,
+                       guint32             time)
+{
+  WakefieldTouch *touch = wl_resource_get_user_data (touch_resource);
+
+  send_input_timestamps (&touch->timestamps_resource_list, touch_resource, time);
+}
+
+static void
+keyboard_send_timestamps (struct wl_resource *keyboard_resource,
+                          guint32             time)
+{
+  WakefieldKeyboard *keyboard = wl_resource_get_user_data (keyboard_resource);
+
+  send_input_timestamps (&keyboard->timestamps_resource_list, keyboard_resource, time);
+}
+
+/* Ends a group of pointer events that belong together */
+static void
+pointer_send_frame (struct wl_resource *pointer_resource)
+{
+  if (wl_resource_get_version (pointer_resource) >= WL_POINTER_FRAME_SINCE_VERSION)
+    wl_pointer_send_frame (pointer_resource);
 }
 
 static void
@@ -430,10 +839,13 @@ send_enter (WakefieldCompositor *compositor, struct wl_resource  *surface, doubl
 
   pointer->serial = wl_display_next_serial (priv->wl_display);
   if (pointer_resource)
-    wl_pointer_send_enter (pointer_resource, pointer->serial,
-                           surface,
-                           wl_fixed_from_double (x),
-                           wl_fixed_from_double (y));
+    {
+      wl_pointer_send_enter (pointer_resource, pointer->serial,
+                             surface,
+                             wl_fixed_from_double (x),
+                             wl_fixed_from_double (y));
+      pointer_send_frame (pointer_resource);
+    }
 }
 
 static void
@@ -448,7 +860,10 @@ send_leave (WakefieldCompositor *compositor, struct wl_resource  *surface)
 
   pointer->serial = wl_display_next_serial (priv->wl_display);
   if (pointer_resource)
-    wl_pointer_send_leave (pointer_resource, pointer->serial, surface);
+    {
+      wl_pointer_send_leave (pointer_resource, pointer->serial, surface);
+      pointer_send_frame (pointer_resource);
+    }
 
   if (pointer->cursor_surface)
     unset_cursor_surface (pointer, pointer->cursor_surface);
@@ -470,6 +885,15 @@ convert_gdk_button_to_linux_input (int gdk_button)
    }
 }
 
+static void
+ungrab_device (WakefieldCompositor *compositor,
+               gpointer             user_data)
+{
+  GdkDevice *device = user_data;
+
+  gdk_device_ungrab (device, GDK_CURRENT_TIME);
+}
+
 static void
 wakefield_compositor_clear_grab (WakefieldCompositor *compositor)
 {
@@ -477,7 +901,9 @@ wakefield_compositor_clear_grab (WakefieldCompositor *compositor)
   WakefieldPointer *pointer = &priv->seat.pointer;
 
   if (pointer->grab_popup_surface)
-    gdk_device_ungrab (pointer->grab_device, GDK_CURRENT_TIME);
+    wakefield_compositor_run_in_main (compositor, ungrab_device,
+                                      g_object_ref (pointer->grab_device),
+                                      g_object_unref);
   else
     {
       /* During a passive grab we may have not sent a leave event, send it now */
@@ -568,10 +994,14 @@ wakefield_compositor_send_button (WakefieldCompositor *compositor,
       ensure_surface_entered (compositor, surface, event->x, event->y);
       pointer_resource = wakefield_compositor_get_pointer_for_client (compositor, wl_resource_get_client (surface));
       if (pointer_resource)
-        wl_pointer_send_button (pointer_resource, pointer->serial,
-                                event->time,
-                                button,
-                                (event->type == GDK_BUTTON_PRESS ? 1 : 0));
+        {
+          pointer_send_timestamps (pointer_resource, event->time);
+          wl_pointer_send_button (pointer_resource, pointer->serial,
+                                  event->time,
+                                  button,
+                                  (event->type == GDK_BUTTON_PRESS ? 1 : 0));
+          pointer_send_frame (pointer_resource);
+        }
     }
 
 
@@ -597,12 +1027,67 @@ wakefield_compositor_send_button (WakefieldCompositor *compositor,
     }
 }
 
+static enum wl_pointer_axis_source
+get_axis_source (GdkEventScroll *event)
+{
+  GdkDevice *device;
+
+  /* Discrete steps only come from wheels */
+  if (event->direction != GDK_SCROLL_SMOOTH)
+    return WL_POINTER_AXIS_SOURCE_WHEEL;
+
+  device = gdk_event_get_source_device ((GdkEvent *) event);
+  if (device == NULL)
+    return WL_POINTER_AXIS_SOURCE_WHEEL;
+
+  switch (gdk_device_get_source (device))
+    {
+    case GDK_SOURCE_TOUCHPAD:
+    case GDK_SOURCE_TOUCHSCREEN:
+      return WL_POINTER_AXIS_SOURCE_FINGER;
+    case GDK_SOURCE_TRACKPOINT:
+      return WL_POINTER_AXIS_SOURCE_CONTINUOUS;
+    default:
+      return WL_POINTER_AXIS_SOURCE_WHEEL;
+    }
+}
+
+/* @steps is in wheel clicks, which GDK also uses for smooth deltas */
+static void
+send_axis (struct wl_resource          *pointer_resource,
+           guint32                      time,
+           enum wl_pointer_axis         axis,
+           enum wl_pointer_axis_source  source,
+           double                       steps)
+{
+  int version = wl_resource_get_version (pointer_resource);
+
+  if (source == WL_POINTER_AXIS_SOURCE_WHEEL)
+    {
+      if (version >= WL_POINTER_AXIS_VALUE120_SINCE_VERSION)
+        wl_pointer_send_axis_value120 (pointer_resource, axis, lround (steps * 120));
+      else if (version >= WL_POINTER_AXIS_DISCRETE_SINCE_VERSION && steps == (int) steps)
+        wl_pointer_send_axis_discrete (pointer_resource, axis, (int) steps);
+    }
+
+  /* GDK doesn't tell us about natural scrolling, deltas are as the device sent them */
+  if (version >= WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION)
+    wl_pointer_send_axis_relative_direction (pointer_resource, axis,
+                                             WL_POINTER_AXIS_RELATIVE_DIRECTION_IDENTICAL);
+
+  pointer_send_timestamps (pointer_resource, time);
+  wl_pointer_send_axis (pointer_resource, time, axis,
+                        wl_fixed_from_double (steps * 10.0));
+}
+
 void
 wakefield_compositor_send_scroll (WakefieldCompositor *compositor,
                                   struct wl_resource *surface,
                                   GdkEventScroll *event)
 {
   struct wl_resource *pointer_resource;
+  enum wl_pointer_axis_source source;
+  double dx = 0, dy = 0;
 
   if (surface == NULL)
     return;
@@ -611,85 +1096,457 @@ wakefield_compositor_send_scroll (WakefieldCompositor *compositor,
 
   pointer_resource = wakefield_compositor_get_pointer_for_client (compositor,
                                                                   wl_resource_get_client (surface));
-  if (pointer_resource && should_send_pointer_event (compositor))
+  if (pointer_resource == NULL || !should_send_pointer_event (compositor))
+    return;
+
+  switch (event->direction)
+    {
+    case GDK_SCROLL_SMOOTH:
+      dx = event->delta_x;
+      dy = event->delta_y;
+      break;
+    case GDK_SCROLL_UP:
+      dy = -1;
+      break;
+    case GDK_SCROLL_DOWN:
+      dy = 1;
+      break;
+    case GDK_SCROLL_LEFT:
+      dx = -1;
+      break;
+    case GDK_SCROLL_RIGHT:
+      dx = 1;
+      break;
+    }
+
+  source = get_axis_source (event);
+
+  if (wl_resource_get_version (pointer_resource) >= WL_POINTER_AXIS_SOURCE_SINCE_VERSION)
+    wl_pointer_send_axis_source (pointer_resource, source);
+
+  /* The fingers left the touchpad, kinetic scrolling may start */
+  if (event->is_stop)
     {
-      switch (event->direction)
+      if (wl_resource_get_version (pointer_resource) >= WL_POINTER_AXIS_STOP_SINCE_VERSION)
         {
-        case GDK_SCROLL_SMOOTH:
-          if (event->delta_x != 0)
-            {
-              wl_pointer_send_axis (pointer_resource,
-                                    event->time,
-                                    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-                                    wl_fixed_from_double (event->delta_x * 10.0));
-            }
-          if (event->delta_y != 0)
-            {
-              wl_pointer_send_axis (pointer_resource,
-                                    event->time,
-                                    WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                    wl_fixed_from_double (event->delta_y * 10.0));
-            }
+          pointer_send_timestamps (pointer_resource, event->time);
+          wl_pointer_send_axis_stop (pointer_resource, event->time,
+                                     WL_POINTER_AXIS_HORIZONTAL_SCROLL);
+          pointer_send_timestamps (pointer_resource, event->time);
+          wl_pointer_send_axis_stop (pointer_resource, event->time,
+                                     WL_POINTER_AXIS_VERTICAL_SCROLL);
+        }
+    }
+  else
+    {
+      if (dx != 0)
+        send_axis (pointer_resource, event->time,
+                   WL_POINTER_AXIS_HORIZONTAL_SCROLL, source, dx);
+      if (dy != 0)
+        send_axis (pointer_resource, event->time,
+                   WL_POINTER_AXIS_VERTICAL_SCROLL, source, dy);
+    }
+
+  pointer_send_frame (pointer_resource);
+}
+
+/* Returns the client the gesture went to, if any */
+static struct wl_client *
+send_swipe (WakefieldCompositor   *compositor,
+            GdkEventTouchpadSwipe *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *resource;
+  struct wl_client *client;
+  guint32 serial = 0;
+
+  if (event->phase == GDK_TOUCHPAD_GESTURE_PHASE_BEGIN)
+    pointer->swipe_surface = should_send_pointer_event (compositor) ? pointer->current_surface : NULL;
+
+  if (pointer->swipe_surface == NULL)
+    return NULL;
+
+  client = wl_resource_get_client (pointer->swipe_surface);
+  if (event->phase != GDK_TOUCHPAD_GESTURE_PHASE_UPDATE)
+    serial = wl_display_next_serial (priv->wl_display);
+
+  wl_resource_for_each (resource, &pointer->swipe_resource_list)
+    {
+      if (wl_resource_get_client (resource) != client)
+        continue;
+
+      switch (event->phase)
+        {
+        case GDK_TOUCHPAD_GESTURE_PHASE_BEGIN:
+          zwp_pointer_gesture_swipe_v1_send_begin (resource, serial, event->time,
+                                                   pointer->swipe_surface,
+                                                   event->n_fingers);
+          break;
+        case GDK_TOUCHPAD_GESTURE_PHASE_UPDATE:
+          zwp_pointer_gesture_swipe_v1_send_update (resource, event->time,
+                                                    wl_fixed_from_double (event->dx),
+                                                    wl_fixed_from_double (event->dy));
           break;
-        case GDK_SCROLL_UP:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (-10.0));
+        case GDK_TOUCHPAD_GESTURE_PHASE_END:
+        case GDK_TOUCHPAD_GESTURE_PHASE_CANCEL:
+          zwp_pointer_gesture_swipe_v1_send_end (resource, serial, event->time,
+                                                 event->phase == GDK_TOUCHPAD_GESTURE_PHASE_CANCEL);
           break;
-        case GDK_SCROLL_DOWN:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (10.0));
+        }
+    }
+
+  if (event->phase == GDK_TOUCHPAD_GESTURE_PHASE_END ||
+      event->phase == GDK_TOUCHPAD_GESTURE_PHASE_CANCEL)
+    pointer->swipe_surface = NULL;
+
+  return client;
+}
+
+/* Returns the client the gesture went to, if any */
+static struct wl_client *
+send_pinch (WakefieldCompositor   *compositor,
+            GdkEventTouchpadPinch *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *resource;
+  struct wl_client *client;
+  guint32 serial = 0;
+
+  if (event->phase == GDK_TOUCHPAD_GESTURE_PHASE_BEGIN)
+    pointer->pinch_surface = should_send_pointer_event (compositor) ? pointer->current_surface : NULL;
+
+  if (pointer->pinch_surface == NULL)
+    return NULL;
+
+  client = wl_resource_get_client (pointer->pinch_surface);
+  if (event->phase != GDK_TOUCHPAD_GESTURE_PHASE_UPDATE)
+    serial = wl_display_next_serial (priv->wl_display);
+
+  wl_resource_for_each (resource, &pointer->pinch_resource_list)
+    {
+      if (wl_resource_get_client (resource) != client)
+        continue;
+
+      switch (event->phase)
+        {
+        case GDK_TOUCHPAD_GESTURE_PHASE_BEGIN:
+          zwp_pointer_gesture_pinch_v1_send_begin (resource, serial, event->time,
+                                                   pointer->pinch_surface,
+                                                   event->n_fingers);
           break;
-        case GDK_SCROLL_LEFT:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (-10.0));
+        case GDK_TOUCHPAD_GESTURE_PHASE_UPDATE:
+          /* Both have the scale since the beginning, GDK has the
+             rotation in radians, Wayland in degrees */
+          zwp_pointer_gesture_pinch_v1_send_update (resource, event->time,
+                                                    wl_fixed_from_double (event->dx),
+                                                    wl_fixed_from_double (event->dy),
+                                                    wl_fixed_from_double (event->scale),
+                                                    wl_fixed_from_double (event->angle_delta * 180 / G_PI));
           break;
-        case GDK_SCROLL_RIGHT:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (10.0));
+        case GDK_TOUCHPAD_GESTURE_PHASE_END:
+        case GDK_TOUCHPAD_GESTURE_PHASE_CANCEL:
+          zwp_pointer_gesture_pinch_v1_send_end (resource, serial, event->time,
+                                                 event->phase == GDK_TOUCHPAD_GESTURE_PHASE_CANCEL);
           break;
         }
     }
+
+  if (event->phase == GDK_TOUCHPAD_GESTURE_PHASE_END ||
+      event->phase == GDK_TOUCHPAD_GESTURE_PHASE_CANCEL)
+    pointer->pinch_surface = NULL;
+
+  return client;
 }
 
-void
-wakefield_compositor_send_motion (WakefieldCompositor *compositor,
-                                  struct wl_resource *surface,
-                                  GdkEventMotion *event)
+static void
+deliver_motion (WakefieldCompositor *compositor,
+                struct wl_resource  *surface,
+                guint32              time,
+                double               x,
+                double               y)
 {
   struct wl_resource *pointer_resource;
 
-  if (surface == NULL)
-    return;
-
-  ensure_surface_entered (compositor, surface, event->x, event->y);
+  ensure_surface_entered (compositor, surface, x, y);
 
   pointer_resource = wakefield_compositor_get_pointer_for_client (compositor,
                                                                   wl_resource_get_client (surface));
   if (pointer_resource && should_send_pointer_event (compositor))
     {
+      WakefieldClient *w_client = wakefield_client_from_wl_client (wl_resource_get_client (surface));
+
+      /* Don't pile up motion on a client that isn't reading it, only
+         the latest position gets sent once it catches up */
+      if (w_client && w_client->congested)
+        {
+          w_client->has_pending_motion = TRUE;
+          w_client->pending_motion_time = time;
+          w_client->pending_motion_x = x;
+          w_client->pending_motion_y = y;
+          return;
+        }
+
+      pointer_send_timestamps (pointer_resource, time);
       wl_pointer_send_motion (pointer_resource,
-                              event->time,
-                              wl_fixed_from_double (event->x),
-                              wl_fixed_from_double (event->y));
+                              time,
+                              wl_fixed_from_double (x),
+                              wl_fixed_from_double (y));
+      pointer_send_frame (pointer_resource);
     }
 }
 
-void
-wakefield_compositor_send_enter (WakefieldCompositor *compositor,
-                                 struct wl_resource  *surface,
-                                 GdkEventCrossing *event)
+/* Sends the motion held back in WAKEFIELD_MOTION_COALESCE mode, this must
+   happen before any other pointer or keyboard event to keep them ordered */
+static void
+wakefield_compositor_flush_motion (WakefieldCompositor *compositor)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  WakefieldPointer *pointer = &priv->seat.pointer;
-  gboolean has_implicit_grab;
+  struct wl_resource *surface;
+
+  surface = g_steal_pointer (&priv->pending_motion_surface);
+  if (surface == NULL)
+    return;
+
+  deliver_motion (compositor, surface,
+                  priv->pending_motion_time,
+                  priv->pending_motion_x,
+                  priv->pending_motion_y);
+}
+
+static void
+send_relative_motion (WakefieldCompositor *compositor,
+                      guint64              time_us,
+                      double               dx,
+                      double               dy,
+                      double               dx_unaccel,
+                      double               dy_unaccel)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *relative_resource, *pointer_resource;
+  struct wl_client *client;
+
+  if (!should_send_pointer_event (compositor))
+    return;
+
+  client = wl_resource_get_client (pointer->current_surface);
+  relative_resource = wakefield_client_lookup_resource (client, WAKEFIELD_CLIENT_RELATIVE_POINTER,
+                                                        &pointer->relative_resource_list);
+  if (relative_resource == NULL)
+    return;
+
+  wakefield_compositor_flush_motion (compositor);
+
+  zwp_relative_pointer_v1_send_relative_motion (relative_resource,
+                                                time_us >> 32,
+                                                time_us & 0xffffffff,
+                                                wl_fixed_from_double (dx),
+                                                wl_fixed_from_double (dy),
+                                                wl_fixed_from_double (dx_unaccel),
+                                                wl_fixed_from_double (dy_unaccel));
+
+  pointer_resource = wakefield_compositor_get_pointer_for_client (compositor, client);
+  if (pointer_resource)
+    pointer_send_frame (pointer_resource);
+}
+
+/* Without raw device motion all we know is how far the pointer moved on
+   screen, acceleration included */
+static void
+send_relative_motion_from_event (WakefieldCompositor *compositor,
+                                 GdkEventMotion      *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  double dx, dy;
+
+  if (pointer->has_last_root && !pointer->raw_motion)
+    {
+      dx = event->x_root - pointer->last_root_x;
+      dy = event->y_root - pointer->last_root_y;
+
+      if (dx != 0 || dy != 0)
+        send_relative_motion (compositor, (guint64) event->time * 1000,
+                              dx, dy, dx, dy);
+    }
+
+  pointer->has_last_root = TRUE;
+  pointer->last_root_x = event->x_root;
+  pointer->last_root_y = event->y_root;
+}
+
+/* Moves the pointer without the jump showing up as relative motion */
+void
+wakefield_compositor_warp_pointer (WakefieldCompositor *compositor,
+                                   GdkDevice           *device,
+                                   GdkScreen           *screen,
+                                   int                  x_root,
+                                   int                  y_root)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+
+  gdk_device_warp (device, screen, x_root, y_root);
+
+  pointer->has_last_root = TRUE;
+  pointer->last_root_x = x_root;
+  pointer->last_root_y = y_root;
+}
+
+/* The client of @resource, for flushing what was just sent to it */
+static struct wl_client *
+resource_get_client (struct wl_resource *resource)
+{
+  return resource ? wl_resource_get_client (resource) : NULL;
+}
+
+#if defined(GDK_WINDOWING_X11)
+static int xi_opcode;
+
+static GdkFilterReturn
+raw_motion_filter (GdkXEvent *xevent,
+                   GdkEvent  *event,
+                   gpointer   data)
+{
+  WakefieldCompositor *compositor = data;
+  XGenericEventCookie *cookie = &((XEvent *) xevent)->xcookie;
+  double delta[2] = { 0, }, raw_delta[2] = { 0, };
+  const double *values, *raw_values;
+  XIRawEvent *raw;
+  int i;
+
+  if (cookie->type != GenericEvent ||
+      cookie->extension != xi_opcode ||
+      cookie->evtype != XI_RawMotion ||
+      cookie->data == NULL)
+    return GDK_FILTER_CONTINUE;
+
+  raw = cookie->data;
+  values = raw->valuators.values;
+  raw_values = raw->raw_values;
+
+  /* Only the valuators that changed are sent, x and y are the first two */
+  for (i = 0; i < raw->valuators.mask_len * 8 && i < 2; i++)
+    {
+      if (!XIMaskIsSet (raw->valuators.mask, i))
+        continue;
+
+      delta[i] = *values++;
+      raw_delta[i] = *raw_values++;
+    }
+
+  if (delta[0] != 0 || delta[1] != 0 || raw_delta[0] != 0 || raw_delta[1] != 0)
+    {
+      g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+
+      WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+      send_relative_motion (compositor, (guint64) raw->time * 1000,
+                            delta[0], delta[1], raw_delta[0], raw_delta[1]);
+      wakefield_compositor_flush_input (compositor,
+                                        resource_get_client (priv->seat.pointer.current_surface));
+    }
+
+  return GDK_FILTER_CONTINUE;
+}
+#endif
+
+static void
+select_raw_motion (WakefieldCompositor *compositor,
+                   gpointer             user_data)
+{
+#if defined(GDK_WINDOWING_X11)
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+  unsigned char mask_bits[XIMaskLen (XI_LASTEVENT)] = { 0, };
+  XIEventMask mask = { XIAllMasterDevices, sizeof (mask_bits), mask_bits };
+  Display *xdisplay;
+  int event_base, error_base;
+
+  if (pointer->raw_motion || !GDK_IS_X11_DISPLAY (display))
+    return;
+
+  xdisplay = GDK_DISPLAY_XDISPLAY (display);
+  if (!XQueryExtension (xdisplay, "XInputExtension", &xi_opcode, &event_base, &error_base))
+    return;
+
+  /* From XI 2.1 on raw events reach the root window whatever the grabs */
+  XISetMask (mask_bits, XI_RawMotion);
+  gdk_x11_display_error_trap_push (display);
+  XISelectEvents (xdisplay, DefaultRootWindow (xdisplay), &mask, 1);
+  if (gdk_x11_display_error_trap_pop (display) != 0)
+    return;
+
+  gdk_window_add_filter (NULL, raw_motion_filter, compositor);
+  pointer->raw_motion = TRUE;
+#endif
+}
+
+static gboolean
+motion_tick (GtkWidget     *widget,
+             GdkFrameClock *frame_clock,
+             gpointer       user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_client *client = resource_get_client (priv->pending_motion_surface);
+
+  priv->motion_tick_id = 0;
+  wakefield_compositor_flush_motion (compositor);
+  wakefield_compositor_flush_input (compositor, client);
+
+  return G_SOURCE_REMOVE;
+}
+
+void
+wakefield_compositor_send_motion (WakefieldCompositor *compositor,
+                                  struct wl_resource *surface,
+                                  GdkEventMotion *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldClient *w_client;
+
+  if (surface == NULL)
+    return;
+
+  w_client = wakefield_client_from_wl_client (wl_resource_get_client (surface));
+
+  /* Keep only the latest position until the next frame clock cycle,
+     unless the client asked for every single event */
+  if (priv->motion_mode == WAKEFIELD_MOTION_COALESCE &&
+      !(w_client && w_client->motion_history) &&
+      gtk_widget_get_frame_clock (GTK_WIDGET (compositor)) != NULL)
+    {
+      if (priv->pending_motion_surface != surface)
+        wakefield_compositor_flush_motion (compositor);
+
+      priv->pending_motion_surface = surface;
+      priv->pending_motion_time = event->time;
+      priv->pending_motion_x = event->x;
+      priv->pending_motion_y = event->y;
+
+      if (priv->motion_tick_id == 0)
+        priv->motion_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (compositor),
+                                                             motion_tick, NULL, NULL);
+      return;
+    }
+
+  wakefield_compositor_flush_motion (compositor);
+  deliver_motion (compositor, surface, event->time, event->x, event->y);
+}
+
+void
+wakefield_compositor_send_enter (WakefieldCompositor *compositor,
+                                 struct wl_resource  *surface,
+                                 GdkEventCrossing *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  gboolean has_implicit_grab;
 
   if (surface == NULL)
     return;
@@ -749,6 +1606,10 @@ wakefield_compositor_send_keyboard_enter (WakefieldCompositor *compositor,
   g_assert (keyboard->focus == NULL);
   keyboard->focus = surface;
 
+  /* The selection has to arrive before the keyboard enter */
+  wakefield_data_device_set_focus (priv->data_device, wl_resource_get_client (surface));
+  wakefield_primary_selection_set_focus (priv->primary_selection, wl_resource_get_client (surface));
+
   wl_array_init (&keys);
 
   keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
@@ -779,6 +1640,9 @@ wakefield_compositor_send_keyboard_leave (WakefieldCompositor *compositor,
   g_assert (keyboard->focus == surface);
   keyboard->focus = NULL;
 
+  wakefield_data_device_set_focus (priv->data_device, NULL);
+  wakefield_primary_selection_set_focus (priv->primary_selection, NULL);
+
   keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
                                                                     wl_resource_get_client (surface));
   if (keyboard_resource)
@@ -794,42 +1658,114 @@ wakefield_compositor_get_xdg_surface_for_window (WakefieldCompositor *compositor
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource;
 
-  wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
-    {
-      if (window == wakefield_xdg_surface_get_window (xdg_surface_resource))
-        return wakefield_xdg_surface_get_surface_resource (xdg_surface_resource);
-    }
+  xdg_surface_resource = g_hash_table_lookup (priv->surface_windows, window);
+  if (xdg_surface_resource == NULL)
+    return NULL;
 
-  return NULL;
+  return wakefield_xdg_surface_get_surface_resource (xdg_surface_resource);
 }
 
 static struct wl_resource *
 wakefield_compositor_get_topmost_surface (WakefieldCompositor *compositor)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct wl_resource *xdg_surface_resource;
 
-  wl_resource_for_each_reverse (xdg_surface_resource, &priv->xdg_surfaces)
+  return g_queue_peek_tail (&priv->mapped_surfaces);
+}
+
+/* @x and @y are relative to the widget, this doesn't talk to the X server
+   so it's fine to call on every drag motion */
+struct wl_resource *
+wakefield_compositor_get_surface_at (WakefieldCompositor *compositor,
+                                     double               x,
+                                     double               y,
+                                     double              *sx,
+                                     double              *sy)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GList *l;
+
+  for (l = priv->mapped_surfaces.tail; l; l = l->prev)
     {
-      struct wl_resource *surface_resource;
-      surface_resource = wakefield_xdg_surface_get_surface_resource (xdg_surface_resource);
-      if (surface_resource != NULL && wakefield_surface_is_mapped (surface_resource))
-        return surface_resource;
+      struct wl_resource *surface = l->data;
+      GdkWindow *window = wakefield_surface_get_window (surface);
+      int wx, wy;
+
+      if (window == NULL || !gdk_window_is_visible (window))
+        continue;
+
+      gdk_window_get_position (window, &wx, &wy);
+      if (x < wx || y < wy ||
+          x >= wx + gdk_window_get_width (window) ||
+          y >= wy + gdk_window_get_height (window))
+        continue;
+
+      *sx = x - wx;
+      *sy = y - wy;
+      return surface;
     }
 
   return NULL;
 }
 
+/* A drag took over the pointer, the button release goes to GTK */
+void
+wakefield_compositor_drag_started (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+
+  wakefield_compositor_flush_motion (compositor);
+
+  pointer->button_count = 0;
+  if (pointer->grab_button != 0 && pointer->grab_popup_surface == NULL)
+    {
+      pointer->grab_button = 0;
+      pointer->grab_client = NULL;
+    }
+
+  if (pointer->current_surface)
+    {
+      send_leave (compositor, pointer->current_surface);
+      pointer->current_surface = NULL;
+    }
+}
+
+void
+wakefield_compositor_window_realized (WakefieldCompositor *compositor,
+                                      GdkWindow           *window,
+                                      struct wl_resource  *xdg_surface)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  g_hash_table_insert (priv->surface_windows, window, xdg_surface);
+
+  /* We do the compression ourselves, and some clients want it all */
+  gdk_window_set_event_compression (window, priv->motion_mode != WAKEFIELD_MOTION_COALESCE);
+}
+
+void
+wakefield_compositor_window_unrealized (WakefieldCompositor *compositor,
+                                        GdkWindow           *window)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  g_hash_table_remove (priv->surface_windows, window);
+}
+
 static gboolean
 wakefield_compositor_button_press_event (GtkWidget      *widget,
                                          GdkEventButton *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv =
     wakefield_compositor_get_instance_private (compositor);
   WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *surface;
 
+  wakefield_compositor_flush_motion (compositor);
+
   pointer->serial = wl_display_next_serial (priv->wl_display);
 
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
@@ -837,6 +1773,8 @@ wakefield_compositor_button_press_event (GtkWidget      *widget,
   if (surface)
     wakefield_compositor_send_button (compositor, surface, event);
 
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
+
   return TRUE;
 }
 
@@ -845,11 +1783,14 @@ wakefield_compositor_button_release_event (GtkWidget      *widget,
                                            GdkEventButton *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv =
     wakefield_compositor_get_instance_private (compositor);
   WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *surface;
 
+  wakefield_compositor_flush_motion (compositor);
+
   pointer->serial = wl_display_next_serial (priv->wl_display);
 
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
@@ -857,6 +1798,8 @@ wakefield_compositor_button_release_event (GtkWidget      *widget,
   if (surface)
     wakefield_compositor_send_button (compositor, surface, event);
 
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
+
   return TRUE;
 }
 
@@ -865,13 +1808,18 @@ wakefield_compositor_scroll_event (GtkWidget      *widget,
                                    GdkEventScroll *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   struct wl_resource *surface;
 
+  wakefield_compositor_flush_motion (compositor);
+
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
 
   if (surface)
     wakefield_compositor_send_scroll (compositor, surface, event);
 
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
+
   return TRUE;
 }
 
@@ -880,29 +1828,72 @@ wakefield_compositor_motion_notify_event (GtkWidget      *widget,
                                           GdkEventMotion *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *surface;
 
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
 
   if (surface)
-    wakefield_compositor_send_motion (compositor, surface, event);
+    {
+      send_relative_motion_from_event (compositor, event);
+
+      if (!wakefield_pointer_constraints_handle_motion (priv->pointer_constraints,
+                                                        surface, event))
+        wakefield_compositor_send_motion (compositor, surface, event);
+    }
+
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
 
   return FALSE;
 }
 
+/* GtkWidget has no vfuncs of its own for touchpad gestures */
+static gboolean
+wakefield_compositor_event (GtkWidget *widget,
+                            GdkEvent  *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = NULL;
+  struct wl_client *client;
+
+  if (event->type != GDK_TOUCHPAD_SWIPE && event->type != GDK_TOUCHPAD_PINCH)
+    return FALSE;
+
+  locked = wakefield_display_locker (compositor);
+
+  wakefield_compositor_flush_motion (compositor);
+
+  if (event->type == GDK_TOUCHPAD_SWIPE)
+    client = send_swipe (compositor, &event->touchpad_swipe);
+  else
+    client = send_pinch (compositor, &event->touchpad_pinch);
+
+  wakefield_compositor_flush_input (compositor, client);
+
+  return TRUE;
+}
+
 static gboolean
 wakefield_compositor_enter_notify_event (GtkWidget        *widget,
                                          GdkEventCrossing *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *surface;
 
+  wakefield_compositor_flush_motion (compositor);
+
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
   if (event->mode == GDK_CROSSING_NORMAL && surface)
     wakefield_compositor_send_enter (compositor,
                                      surface,
                                      event);
 
+  wakefield_pointer_constraints_update (priv->pointer_constraints);
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
+
   return FALSE;
 }
 
@@ -911,13 +1902,23 @@ wakefield_compositor_leave_notify_event (GtkWidget        *widget,
                                          GdkEventCrossing *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *surface;
 
+  wakefield_compositor_flush_motion (compositor);
+
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
 
   if (event->mode == GDK_CROSSING_NORMAL && surface)
     wakefield_compositor_send_leave (compositor, surface, event);
 
+  /* The pointer may come back anywhere, that's not relative motion */
+  priv->seat.pointer.has_last_root = FALSE;
+
+  wakefield_pointer_constraints_update (priv->pointer_constraints);
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
+
   return FALSE;
 }
 
@@ -926,13 +1927,20 @@ wakefield_compositor_focus_in_event (GtkWidget     *widget,
                                      GdkEventFocus *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *surface;
 
+  wakefield_compositor_flush_motion (compositor);
+
   surface = wakefield_compositor_get_topmost_surface (compositor);
 
   if (surface)
     wakefield_compositor_send_keyboard_enter (compositor, surface);
 
+  wakefield_pointer_constraints_update (priv->pointer_constraints);
+  wakefield_compositor_flush_input (compositor, resource_get_client (surface));
+
   return FALSE;
 }
 
@@ -941,13 +1949,22 @@ wakefield_compositor_focus_out_event (GtkWidget     *widget,
                                       GdkEventFocus *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  struct wl_client *client = resource_get_client (keyboard->focus);
+
+  wakefield_compositor_flush_motion (compositor);
 
+  /* We won't see the releases of keys held while unfocused */
+  memset (keyboard->pressed_keys, 0, sizeof (keyboard->pressed_keys));
 
   if (keyboard->focus && wakefield_surface_get_xdg_surface (keyboard->focus))
     wakefield_compositor_send_keyboard_leave (compositor, keyboard->focus);
 
+  wakefield_pointer_constraints_update (priv->pointer_constraints);
+  wakefield_compositor_flush_input (compositor, client);
+
   return FALSE;
 }
 
@@ -956,6 +1973,7 @@ update_modifier_state (WakefieldCompositor *compositor, struct wl_resource *keyb
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  const WakefieldKeymap *keymap = keyboard->keymap;
   guint32 old_mods_depressed = keyboard->mods_depressed;
   guint32 old_mods_latched = keyboard->mods_latched;
   guint32 old_mods_locked = keyboard->mods_locked;
@@ -966,22 +1984,26 @@ update_modifier_state (WakefieldCompositor *compositor, struct wl_resource *keyb
   keyboard->mods_locked = 0;
   keyboard->group = event->group;
 
+  /* Without a keymap the client can't make sense of modifiers anyway */
+  if (keymap == NULL)
+    return;
+
   if (event->state & GDK_SHIFT_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->shift_mod;
+    keyboard->mods_depressed |= 1 << keymap->shift_mod;
   if (event->state & GDK_LOCK_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->caps_mod;
+    keyboard->mods_depressed |= 1 << keymap->caps_mod;
   if (event->state & GDK_CONTROL_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->ctrl_mod;
+    keyboard->mods_depressed |= 1 << keymap->ctrl_mod;
   if (event->state & GDK_MOD1_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->alt_mod;
+    keyboard->mods_depressed |= 1 << keymap->alt_mod;
   if (event->state & GDK_MOD2_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->mod2_mod;
+    keyboard->mods_depressed |= 1 << keymap->mod2_mod;
   if (event->state & GDK_MOD3_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->mod3_mod;
+    keyboard->mods_depressed |= 1 << keymap->mod3_mod;
   if (event->state & GDK_MOD4_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->super_mod;
+    keyboard->mods_depressed |= 1 << keymap->super_mod;
   if (event->state & GDK_MOD5_MASK)
-    keyboard->mods_depressed |= 1 << keyboard->mod5_mod;
+    keyboard->mods_depressed |= 1 << keymap->mod5_mod;
 
 
   if (old_mods_depressed != keyboard->mods_depressed ||
@@ -996,26 +2018,66 @@ update_modifier_state (WakefieldCompositor *compositor, struct wl_resource *keyb
                                 keyboard->group);
 }
 
+/* Returns whether the state of the key changed */
+static gboolean
+keyboard_set_key_pressed (WakefieldKeyboard *keyboard,
+                          guint16            hardware_keycode,
+                          gboolean           pressed)
+{
+  guint32 bit;
+  guint32 *word;
+  gboolean was_pressed;
+
+  if (hardware_keycode >= 256)
+    return TRUE;
+
+  word = &keyboard->pressed_keys[hardware_keycode / 32];
+  bit = 1u << (hardware_keycode % 32);
+  was_pressed = (*word & bit) != 0;
+
+  if (pressed)
+    *word |= bit;
+  else
+    *word &= ~bit;
+
+  return was_pressed != pressed;
+}
+
 static gboolean
 wakefield_compositor_key_press_event (GtkWidget *widget,
                                       GdkEventKey *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   WakefieldKeyboard *keyboard = &priv->seat.keyboard;
   struct wl_resource *keyboard_resource;
-  uint32_t serial = wl_display_next_serial (priv->wl_display);
+  uint32_t serial;
+
+  /* Clients repeat keys themselves, from the repeat info */
+  if (!keyboard_set_key_pressed (keyboard, event->hardware_keycode, TRUE))
+    return FALSE;
+
+  serial = wl_display_next_serial (priv->wl_display);
+
+  wakefield_compositor_flush_motion (compositor);
 
   if (keyboard->focus != NULL)
     {
       keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
                                                                         wl_resource_get_client (keyboard->focus));
 
-      update_modifier_state (compositor, keyboard_resource, event);
-      wl_keyboard_send_key (keyboard_resource, serial, event->time, event->hardware_keycode - 8, WL_KEYBOARD_KEY_STATE_PRESSED);
-
+      /* The client may not have bound a keyboard */
+      if (keyboard_resource)
+        {
+          update_modifier_state (compositor, keyboard_resource, event);
+          keyboard_send_timestamps (keyboard_resource, event->time);
+          wl_keyboard_send_key (keyboard_resource, serial, event->time, event->hardware_keycode - 8, WL_KEYBOARD_KEY_STATE_PRESSED);
+        }
     }
 
+  wakefield_compositor_flush_input (compositor, resource_get_client (keyboard->focus));
+
   return FALSE;
 }
 
@@ -1024,57 +2086,275 @@ wakefield_compositor_key_release_event (GtkWidget     *widget,
                                         GdkEventKey *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   WakefieldKeyboard *keyboard = &priv->seat.keyboard;
   struct wl_resource *keyboard_resource;
   uint32_t serial = wl_display_next_serial (priv->wl_display);
 
+  keyboard_set_key_pressed (keyboard, event->hardware_keycode, FALSE);
+
+  wakefield_compositor_flush_motion (compositor);
+
   if (keyboard->focus != NULL)
     {
       keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
                                                                         wl_resource_get_client (keyboard->focus));
 
-      update_modifier_state (compositor, keyboard_resource, event);
-      wl_keyboard_send_key (keyboard_resource, serial, event->time, event->hardware_keycode - 8, WL_KEYBOARD_KEY_STATE_RELEASED);
+      /* The client may not have bound a keyboard */
+      if (keyboard_resource)
+        {
+          update_modifier_state (compositor, keyboard_resource, event);
+          keyboard_send_timestamps (keyboard_resource, event->time);
+          wl_keyboard_send_key (keyboard_resource, serial, event->time, event->hardware_keycode - 8, WL_KEYBOARD_KEY_STATE_RELEASED);
+        }
     }
 
+  wakefield_compositor_flush_input (compositor, resource_get_client (keyboard->focus));
+
   return FALSE;
 }
 
-static void
-resource_release (struct wl_client *client,
-                  struct wl_resource *resource)
+static gboolean
+send_touch_frames (gpointer user_data)
 {
-  wl_resource_destroy (resource);
+  WakefieldCompositor *compositor = user_data;
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *touch_resource;
+  WakefieldClient *w_client;
+
+  priv->seat.touch.frame_source_id = 0;
+
+  wl_list_for_each (w_client, &priv->display->clients, link)
+    {
+      if (!w_client->touch_frame_pending)
+        continue;
+
+      w_client->touch_frame_pending = FALSE;
+
+      touch_resource = wakefield_compositor_get_touch_for_client (compositor, w_client->client);
+      if (touch_resource)
+        {
+          wl_touch_send_frame (touch_resource);
+          wakefield_compositor_flush_input (compositor, w_client->client);
+        }
+    }
+
+  return G_SOURCE_REMOVE;
 }
 
+/* All the points GDK has queued up go into the same frame */
 static void
-unbind_resource (struct wl_resource *resource)
+queue_touch_frame (WakefieldCompositor *compositor,
+                   struct wl_client    *client)
 {
-  wl_list_remove (wl_resource_get_link (resource));
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldTouch *touch = &priv->seat.touch;
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  if (w_client == NULL)
+    return;
+
+  w_client->touch_frame_pending = TRUE;
+
+  if (touch->frame_source_id == 0)
+    touch->frame_source_id = g_idle_add_full (GDK_PRIORITY_EVENTS + 1,
+                                              send_touch_frames,
+                                              compositor, NULL);
 }
 
-static void
-unset_cursor_surface (WakefieldPointer *pointer,
-                      WakefieldSurface *cursor_surface)
+static gboolean
+point_is_on_surface (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
 {
-  g_signal_handler_disconnect (cursor_surface,
-                               pointer->cursor_surface_commit_listener);
-  g_object_remove_weak_pointer (G_OBJECT (cursor_surface),
-                                (gpointer*)&pointer->cursor_surface);
-  pointer->cursor_surface = NULL;
+  WakefieldTouchPoint *point = value;
+
+  return point->surface == user_data;
 }
 
-static void
-pointer_cursor_surface_committed (WakefieldSurface *surface,
-                                  GdkWindow *window)
+static gboolean
+point_is_from_client (gpointer key,
+                      gpointer value,
+                      gpointer user_data)
 {
-  WakefieldCompositor *compositor = wakefield_surface_get_compositor (surface);
-  WakefieldCompositorPrivate *priv =
-    wakefield_compositor_get_instance_private (compositor);
-  WakefieldPointer *pointer = &priv->seat.pointer;
-  cairo_surface_t *cursor_surface;
-  int w, h;
+  WakefieldTouchPoint *point = value;
+
+  return wl_resource_get_client (point->surface) == user_data;
+}
+
+/* wl_touch.cancel is for all the touches of a client, so when one of
+   them on @surface goes away they all do */
+static void
+cancel_touches (WakefieldCompositor *compositor,
+                struct wl_resource  *surface)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldTouch *touch = &priv->seat.touch;
+  struct wl_client *client = wl_resource_get_client (surface);
+  struct wl_resource *touch_resource;
+
+  if (g_hash_table_find (touch->points, point_is_on_surface, surface) == NULL)
+    return;
+
+  g_hash_table_foreach_remove (touch->points, point_is_from_client, client);
+
+  touch_resource = wakefield_compositor_get_touch_for_client (compositor, client);
+  if (touch_resource)
+    wl_touch_send_cancel (touch_resource);
+}
+
+static gboolean
+wakefield_compositor_touch_event (GtkWidget     *widget,
+                                  GdkEventTouch *event)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldTouch *touch = &priv->seat.touch;
+  struct wl_resource *touch_resource, *surface;
+  WakefieldTouchPoint *point;
+
+  wakefield_compositor_flush_motion (compositor);
+
+  if (event->type == GDK_TOUCH_BEGIN)
+    {
+      surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
+      if (surface == NULL)
+        return TRUE;
+
+      point = g_new0 (WakefieldTouchPoint, 1);
+      point->surface = surface;
+      point->id = touch->next_id++;
+      g_hash_table_insert (touch->points, event->sequence, point);
+    }
+  else
+    {
+      point = g_hash_table_lookup (touch->points, event->sequence);
+      if (point == NULL)
+        return TRUE;
+    }
+
+  touch_resource = wakefield_compositor_get_touch_for_client (compositor,
+                                                              wl_resource_get_client (point->surface));
+
+  if (event->type == GDK_TOUCH_CANCEL)
+    {
+      cancel_touches (compositor, point->surface);
+      wakefield_compositor_flush_input (compositor, wl_resource_get_client (point->surface));
+      return TRUE;
+    }
+
+  if (touch_resource)
+    {
+      touch_send_timestamps (touch_resource, event->time);
+
+      switch ((int) event->type)
+        {
+        case GDK_TOUCH_BEGIN:
+          wl_touch_send_down (touch_resource,
+                              wl_display_next_serial (priv->wl_display),
+                              event->time, point->surface, point->id,
+                              wl_fixed_from_double (event->x),
+                              wl_fixed_from_double (event->y));
+          break;
+        case GDK_TOUCH_UPDATE:
+          wl_touch_send_motion (touch_resource, event->time, point->id,
+                                wl_fixed_from_double (event->x),
+                                wl_fixed_from_double (event->y));
+          break;
+        case GDK_TOUCH_END:
+          wl_touch_send_up (touch_resource,
+                            wl_display_next_serial (priv->wl_display),
+                            event->time, point->id);
+          break;
+        }
+
+      queue_touch_frame (compositor, wl_resource_get_client (touch_resource));
+    }
+
+  if (event->type == GDK_TOUCH_END)
+    g_hash_table_remove (touch->points, event->sequence);
+
+  /* Handled here rather than emulated as pointer events by GTK */
+  return TRUE;
+}
+
+static void
+resource_release (struct wl_client *client,
+                  struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+unbind_resource (struct wl_resource *resource)
+{
+  wl_list_remove (wl_resource_get_link (resource));
+}
+
+static void
+unbind_pointer (struct wl_resource *resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (resource);
+
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_POINTER,
+                                     &pointer->resource_list);
+}
+
+static void
+unbind_keyboard (struct wl_resource *resource)
+{
+  WakefieldKeyboard *keyboard = wl_resource_get_user_data (resource);
+
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_KEYBOARD,
+                                     &keyboard->resource_list);
+}
+
+static void
+unbind_output (struct wl_resource *resource)
+{
+  WakefieldOutput *output = wl_resource_get_user_data (resource);
+
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_OUTPUT,
+                                     &output->resource_list);
+}
+
+static void
+unbind_relative_pointer (struct wl_resource *resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (resource);
+
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_RELATIVE_POINTER,
+                                     &pointer->relative_resource_list);
+}
+
+static void
+unset_cursor_surface (WakefieldPointer *pointer,
+                      WakefieldSurface *cursor_surface)
+{
+  g_signal_handler_disconnect (cursor_surface,
+                               pointer->cursor_surface_commit_listener);
+  g_object_remove_weak_pointer (G_OBJECT (cursor_surface),
+                                (gpointer*)&pointer->cursor_surface);
+  pointer->cursor_surface = NULL;
+}
+
+static void
+pointer_cursor_surface_committed (WakefieldSurface *surface,
+                                  GdkWindow *window)
+{
+  WakefieldCompositor *compositor = wakefield_surface_get_compositor (surface);
+  WakefieldCompositorPrivate *priv =
+    wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  cairo_surface_t *cursor_surface;
+  int w, h;
 
   cursor_surface = wakefield_surface_create_cairo_surface (surface, &w, &h);
   if (cursor_surface)
@@ -1093,36 +2373,31 @@ pointer_cursor_surface_committed (WakefieldSurface *surface,
     }
 }
 
-static void
-pointer_set_cursor (struct wl_client *client,
-                    struct wl_resource *resource,
-                    uint32_t serial,
-                    struct wl_resource *surface_resource,
-                    int32_t x, int32_t y)
+typedef struct
 {
-  WakefieldPointer *pointer = wl_resource_get_user_data (resource);
-  WakefieldSurface *cursor_surface = NULL;
-  GdkWindow *window;
+  WakefieldPointer *pointer;
+  WakefieldSurface *cursor_surface;
+  uint32_t serial;
+  int32_t x;
+  int32_t y;
+} WakefieldCursorUpdate;
 
-  if (surface_resource)
-    {
-      cursor_surface = wl_resource_get_user_data (surface_resource);
+static void
+cursor_update_free (gpointer user_data)
+{
+  WakefieldCursorUpdate *update = user_data;
 
-      switch (wakefield_surface_get_role (surface_resource))
-        {
-        case WAKEFIELD_SURFACE_ROLE_NONE:
-        case WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR:
-          break;
-        case WAKEFIELD_SURFACE_ROLE_XDG_TOPLEVEL:
-        case WAKEFIELD_SURFACE_ROLE_XDG_POPUP:
-          wl_resource_post_error (resource, WL_POINTER_ERROR_ROLE,
-                                  "This wl_surface already has a role");
-          break;
-        }
+  g_clear_object (&update->cursor_surface);
+  g_free (update);
+}
 
-      wakefield_surface_set_role (surface_resource,
-                                  WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR);
-    }
+static void
+pointer_update_cursor (WakefieldPointer *pointer,
+                       uint32_t          serial,
+                       WakefieldSurface *cursor_surface,
+                       int32_t x, int32_t y)
+{
+  GdkWindow *window;
 
   if (pointer->serial != serial)
     return;
@@ -1154,6 +2429,65 @@ pointer_set_cursor (struct wl_client *client,
     pointer->cursor_surface = NULL;;
 }
 
+static void
+pointer_update_cursor_in_main (WakefieldCompositor *compositor,
+                               gpointer             user_data)
+{
+  WakefieldCursorUpdate *update = user_data;
+
+  /* The cursor surface may have been destroyed in the mean time */
+  if (update->cursor_surface &&
+      wakefield_surface_get_resource (update->cursor_surface) == NULL)
+    return;
+
+  pointer_update_cursor (update->pointer, update->serial,
+                         update->cursor_surface, update->x, update->y);
+}
+
+static void
+pointer_set_cursor (struct wl_client *client,
+                    struct wl_resource *resource,
+                    uint32_t serial,
+                    struct wl_resource *surface_resource,
+                    int32_t x, int32_t y)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (resource);
+  WakefieldSurface *cursor_surface = NULL;
+  WakefieldCursorUpdate *update;
+
+  if (surface_resource)
+    {
+      cursor_surface = wl_resource_get_user_data (surface_resource);
+
+      switch (wakefield_surface_get_role (surface_resource))
+        {
+        case WAKEFIELD_SURFACE_ROLE_NONE:
+        case WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR:
+          break;
+        case WAKEFIELD_SURFACE_ROLE_XDG_TOPLEVEL:
+        case WAKEFIELD_SURFACE_ROLE_XDG_POPUP:
+        case WAKEFIELD_SURFACE_ROLE_DND_ICON:
+          wl_resource_post_error (resource, WL_POINTER_ERROR_ROLE,
+                                  "This wl_surface already has a role");
+          break;
+        }
+
+      wakefield_surface_set_role (surface_resource,
+                                  WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR);
+    }
+
+  update = g_new0 (WakefieldCursorUpdate, 1);
+  update->pointer = pointer;
+  update->cursor_surface = cursor_surface ? g_object_ref (cursor_surface) : NULL;
+  update->serial = serial;
+  update->x = x;
+  update->y = y;
+
+  wakefield_compositor_run_in_main (pointer->compositor,
+                                    pointer_update_cursor_in_main,
+                                    update, cursor_update_free);
+}
+
 static const struct wl_pointer_interface pointer_implementation = {
   pointer_set_cursor,
   resource_release,
@@ -1169,14 +2503,22 @@ seat_get_pointer (struct wl_client    *client,
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_pointer_interface, wl_resource_get_version (seat_resource), id);
-  wl_resource_set_implementation (cr, &pointer_implementation, pointer, unbind_resource);
+  wl_resource_set_implementation (cr, &pointer_implementation, pointer, unbind_pointer);
   wl_list_insert (&pointer->resource_list, wl_resource_get_link (cr));
+  wakefield_client_cache_resource (cr, WAKEFIELD_CLIENT_POINTER);
 }
 
 static void
-wakefield_pointer_init (WakefieldPointer *pointer)
+wakefield_pointer_init (WakefieldCompositor *compositor,
+                        WakefieldPointer *pointer)
 {
+  pointer->compositor = compositor;
   wl_list_init (&pointer->resource_list);
+  wl_list_init (&pointer->relative_resource_list);
+  wl_list_init (&pointer->timestamps_resource_list);
+  wl_list_init (&pointer->swipe_resource_list);
+  wl_list_init (&pointer->pinch_resource_list);
+  wl_list_init (&pointer->hold_resource_list);
   pointer->cursor_surface = NULL;
 }
 
@@ -1194,41 +2536,52 @@ seat_get_keyboard (struct wl_client    *client,
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_keyboard_interface, wl_resource_get_version (seat_resource), id);
-  wl_resource_set_implementation (cr, &keyboard_implementation, keyboard, unbind_resource);
+  wl_resource_set_implementation (cr, &keyboard_implementation, keyboard, unbind_keyboard);
   wl_list_insert (&keyboard->resource_list, wl_resource_get_link (cr));
+  wakefield_client_cache_resource (cr, WAKEFIELD_CLIENT_KEYBOARD);
 
-  if (keyboard->keymap_fd != -1)
-    {
-      /* FIXME: Read repeat info from gsettings */
-      wl_keyboard_send_repeat_info (cr, 0, 0);
-      wl_keyboard_send_keymap (cr,
-                               WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
-                               keyboard->keymap_fd,
-                               keyboard->keymap_size);
-    }
+  keyboard_send_repeat_info (cr, keyboard);
+  if (keyboard->keymap)
+    keyboard_send_keymap (cr, keyboard->keymap);
 }
 
-static struct xkb_keymap *
-get_keymap (WakefieldCompositor *compositor,
-            WakefieldKeyboard *keyboard)
+static void
+unbind_touch (struct wl_resource *resource)
 {
-  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+  WakefieldTouch *touch = wl_resource_get_user_data (resource);
 
-#if defined(GDK_WINDOWING_X11)
-  if (GDK_IS_X11_DISPLAY (display) && keyboard->has_x11_xkb)
-    {
-      Display *xdisplay = gdk_x11_display_get_xdisplay (display);
-      xcb_connection_t *conn = XGetXCBConnection (xdisplay);
-      int32_t core_id = xkb_x11_get_core_keyboard_device_id (conn);
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_TOUCH,
+                                     &touch->resource_list);
+}
 
-      return xkb_x11_keymap_new_from_device (keyboard->context,
-                                             conn,
-                                             core_id,
-                                             XKB_KEYMAP_COMPILE_NO_FLAGS);
-    }
-#endif
+static const struct wl_touch_interface touch_implementation = {
+  resource_release,
+};
 
-  return NULL;
+static void
+seat_get_touch (struct wl_client    *client,
+                struct wl_resource  *seat_resource,
+                uint32_t             id)
+{
+  WakefieldSeat *seat = wl_resource_get_user_data (seat_resource);
+  WakefieldTouch *touch = &seat->touch;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wl_touch_interface, wl_resource_get_version (seat_resource), id);
+  wl_resource_set_implementation (cr, &touch_implementation, touch, unbind_touch);
+  wl_list_insert (&touch->resource_list, wl_resource_get_link (cr));
+  wakefield_client_cache_resource (cr, WAKEFIELD_CLIENT_TOUCH);
+}
+
+static void
+wakefield_touch_init (WakefieldCompositor *compositor,
+                      WakefieldTouch *touch)
+{
+  touch->compositor = compositor;
+  wl_list_init (&touch->resource_list);
+  wl_list_init (&touch->timestamps_resource_list);
+  touch->points = g_hash_table_new_full (NULL, NULL, NULL, g_free);
 }
 
 static int
@@ -1282,134 +2635,627 @@ write_all (int           fd,
     }
 }
 
-static void
-update_keymap (WakefieldCompositor *compositor,
-               WakefieldKeyboard *keyboard)
+/* Clients can't change it, so one file does for all of them */
+static int
+create_sealed_file (const char *data,
+                    gsize       size)
 {
-  struct wl_resource *keyboard_resource;
-  struct xkb_keymap *keymap;
-  char *str;
-  gsize size;
-
-  if (keyboard->keymap)
-    xkb_keymap_unref (keyboard->keymap);
-  keyboard->keymap = NULL;
-  if (keyboard->keymap_fd != -1)
-    close (keyboard->keymap_fd);
-  keyboard->keymap_fd = -1;
-  keyboard->keymap_size = 0;
-
-  keymap = get_keymap (compositor, keyboard);
-  if (keymap)
-    {
-      str = xkb_keymap_get_as_string (keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
-      if (str)
-        {
-          size = strlen (str);
-          keyboard->keymap_fd = create_anonymous_file (size);
-          if (keyboard->keymap_fd != -1)
-            {
-              write_all (keyboard->keymap_fd, str, size);
-              keyboard->keymap = xkb_keymap_ref (keymap);
-              keyboard->keymap_size = size;
-            }
-          free (str);
-        }
-
-      keyboard->shift_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_SHIFT);
-      keyboard->caps_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_CAPS);
-      keyboard->ctrl_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_CTRL);
-      keyboard->alt_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_ALT);
-      keyboard->mod2_mod = xkb_keymap_mod_get_index (keymap, "Mod2");
-      keyboard->mod3_mod = xkb_keymap_mod_get_index (keymap, "Mod3");
-      keyboard->super_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_LOGO);
-      keyboard->mod5_mod = xkb_keymap_mod_get_index (keymap, "Mod5");
+#ifdef HAVE_MEMFD_CREATE
+  int fd;
 
-      keyboard->num_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_NUM);
-      keyboard->caps_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_CAPS);
-      keyboard->scroll_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_SCROLL);
+  fd = memfd_create ("wakefield-keymap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
 
-      xkb_keymap_unref (keymap);
-    }
+  write_all (fd, data, size);
 
-  if (keyboard->keymap_fd != -1)
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
     {
-      wl_resource_for_each (keyboard_resource, &keyboard->resource_list)
-        wl_keyboard_send_keymap (keyboard_resource,
-                                 WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
-                                 keyboard->keymap_fd,
-                                 keyboard->keymap_size);
+      close (fd);
+      return -1;
     }
+
+  return fd;
+#else
+  return -1;
+#endif
 }
 
+#define KEYBOARD_MAP_PRIVATE_SINCE_VERSION 7
+
 static void
-wakefield_keyboard_init (WakefieldCompositor *compositor,
-                         WakefieldKeyboard *keyboard)
+keyboard_send_keymap (struct wl_resource    *keyboard_resource,
+                      const WakefieldKeymap *keymap)
 {
-  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
-
-  wl_list_init (&keyboard->resource_list);
-
-  keyboard->context = xkb_context_new (XKB_CONTEXT_NO_FLAGS);
+  int fd;
 
-#if defined(GDK_WINDOWING_X11)
-  if (GDK_IS_X11_DISPLAY (display))
+  /* From v7 on clients have to map it MAP_PRIVATE, older ones may map it
+     shared and writable, so they get a copy of their own */
+  if (keymap->fd != -1 &&
+      wl_resource_get_version (keyboard_resource) >= KEYBOARD_MAP_PRIVATE_SINCE_VERSION)
     {
-      Display *xdisplay = gdk_x11_display_get_xdisplay (display);
-      xcb_connection_t *conn = XGetXCBConnection (xdisplay);
-
-      keyboard->has_x11_xkb =
-        xkb_x11_setup_xkb_extension (conn,
-                                     XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION,
-                                     0,
-                                     NULL, NULL, NULL, NULL);
+      wl_keyboard_send_keymap (keyboard_resource,
+                               WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+                               keymap->fd, keymap->size);
+      return;
     }
-#endif
 
-  keyboard->keymap_fd = -1;
-  update_keymap (compositor, keyboard);
-}
-
-#define SEAT_VERSION 4
+  fd = create_anonymous_file (keymap->size);
+  if (fd == -1)
+    return;
 
-static const struct wl_seat_interface seat_interface = {
-  seat_get_pointer,
-  seat_get_keyboard, /* get_keyboard */
-  .get_touch = NULL,
-  .release = NULL,
-};
+  write_all (fd, keymap->string, keymap->size);
+  wl_keyboard_send_keymap (keyboard_resource,
+                           WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+                           fd, keymap->size);
+  close (fd);
+}
 
 static void
-wl_seat_destructor (struct wl_resource *resource)
+wakefield_keymap_free (gpointer data)
 {
+  WakefieldKeymap *keymap = data;
+
+  if (keymap->fd != -1)
+    close (keymap->fd);
+  free (keymap->string);
+  g_free (keymap);
 }
 
+#if defined(GDK_WINDOWING_X11)
 static void
-bind_seat (struct wl_client *client,
-           void *data,
-           uint32_t version,
-           uint32_t id)
+compile_keymap_thread (GTask        *task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
 {
-  struct WaylandSeat *seat = data;
-  struct wl_resource *cr;
-
-  cr = wl_resource_create (client, &wl_seat_interface, version, id);
-  wl_resource_set_implementation (cr, &seat_interface, seat, wl_seat_destructor);
-  wl_seat_send_capabilities (cr, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD);
+  const char *display_name = task_data;
+  xcb_connection_t *conn;
+  struct xkb_context *context;
+  struct xkb_keymap *xkb_keymap;
+  WakefieldKeymap *keymap;
+
+  /* GDK's own connection is not ours to use from another thread, since
+     Xlib isn't initialized for threads there */
+  conn = xcb_connect (display_name, NULL);
+  if (xcb_connection_has_error (conn))
+    {
+      xcb_disconnect (conn);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Could not connect to the X server %s", display_name);
+      return;
+    }
+
+  if (!xkb_x11_setup_xkb_extension (conn,
+                                    XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION,
+                                    0,
+                                    NULL, NULL, NULL, NULL))
+    {
+      xcb_disconnect (conn);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                               "The X server has no XKB extension");
+      return;
+    }
+
+  context = xkb_context_new (XKB_CONTEXT_NO_FLAGS);
+  xkb_keymap = xkb_x11_keymap_new_from_device (context,
+                                               conn,
+                                               xkb_x11_get_core_keyboard_device_id (conn),
+                                               XKB_KEYMAP_COMPILE_NO_FLAGS);
+  xkb_context_unref (context);
+  xcb_disconnect (conn);
+
+  if (xkb_keymap == NULL)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Failed to compile the keymap");
+      return;
+    }
+
+  keymap = g_new0 (WakefieldKeymap, 1);
+  keymap->string = xkb_keymap_get_as_string (xkb_keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+  keymap->size = strlen (keymap->string) + 1;
+  keymap->hash = g_str_hash (keymap->string);
+  keymap->fd = create_sealed_file (keymap->string, keymap->size);
+
+  keymap->shift_mod = xkb_keymap_mod_get_index (xkb_keymap, XKB_MOD_NAME_SHIFT);
+  keymap->caps_mod = xkb_keymap_mod_get_index (xkb_keymap, XKB_MOD_NAME_CAPS);
+  keymap->ctrl_mod = xkb_keymap_mod_get_index (xkb_keymap, XKB_MOD_NAME_CTRL);
+  keymap->alt_mod = xkb_keymap_mod_get_index (xkb_keymap, XKB_MOD_NAME_ALT);
+  keymap->mod2_mod = xkb_keymap_mod_get_index (xkb_keymap, "Mod2");
+  keymap->mod3_mod = xkb_keymap_mod_get_index (xkb_keymap, "Mod3");
+  keymap->super_mod = xkb_keymap_mod_get_index (xkb_keymap, XKB_MOD_NAME_LOGO);
+  keymap->mod5_mod = xkb_keymap_mod_get_index (xkb_keymap, "Mod5");
+
+  keymap->num_led = xkb_keymap_led_get_index (xkb_keymap, XKB_LED_NAME_NUM);
+  keymap->caps_led = xkb_keymap_led_get_index (xkb_keymap, XKB_LED_NAME_CAPS);
+  keymap->scroll_led = xkb_keymap_led_get_index (xkb_keymap, XKB_LED_NAME_SCROLL);
+
+  xkb_keymap_unref (xkb_keymap);
+
+  g_task_return_pointer (task, keymap, wakefield_keymap_free);
+}
+#endif
+
+static WakefieldKeymap *shared_keymap;
+/* Every WakefieldKeyboard following shared_keymap */
+static GList *shared_keymap_keyboards;
+static GdkDisplay *shared_keymap_display;
+static gboolean shared_keymap_compiling;
+/* The layout changed again while compiling */
+static gboolean shared_keymap_outdated;
+
+static void
+wakefield_keyboard_set_keymap (WakefieldKeyboard     *keyboard,
+                               const WakefieldKeymap *keymap)
+{
+  struct wl_resource *keyboard_resource;
+
+  keyboard->keymap = keymap;
+
+  wl_resource_for_each (keyboard_resource, &keyboard->resource_list)
+    keyboard_send_keymap (keyboard_resource, keymap);
+}
+
+static gboolean
+wakefield_keymap_equal (const WakefieldKeymap *a,
+                        const WakefieldKeymap *b)
+{
+  return a->hash == b->hash &&
+    a->size == b->size &&
+    memcmp (a->string, b->string, a->size) == 0;
+}
+
+static void compile_shared_keymap (void);
+
+static void
+shared_keymap_compiled (GObject      *source_object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  WakefieldKeymap *keymap;
+  WakefieldKeymap *old_keymap;
+  GList *l;
+
+  shared_keymap_compiling = FALSE;
+  keymap = g_task_propagate_pointer (G_TASK (result), &error);
+
+  if (shared_keymap_outdated)
+    {
+      shared_keymap_outdated = FALSE;
+      compile_shared_keymap ();
+    }
+
+  if (keymap == NULL)
+    {
+      g_warning ("No keymap for Wayland clients: %s", error->message);
+      return;
+    }
+
+  /* keys-changed is also emitted for changes that don't touch the keymap */
+  if (shared_keymap && wakefield_keymap_equal (shared_keymap, keymap))
+    {
+      wakefield_keymap_free (keymap);
+      return;
+    }
+
+  old_keymap = shared_keymap;
+  shared_keymap = keymap;
+
+  for (l = shared_keymap_keyboards; l; l = l->next)
+    {
+      WakefieldKeyboard *keyboard = l->data;
+      g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (keyboard->compositor);
+
+      wakefield_keyboard_set_keymap (keyboard, shared_keymap);
+    }
+
+  /* No keyboard refers to it anymore */
+  if (old_keymap)
+    wakefield_keymap_free (old_keymap);
+}
+
+static void
+compile_shared_keymap (void)
+{
+#if defined(GDK_WINDOWING_X11)
+  Display *xdisplay = gdk_x11_display_get_xdisplay (shared_keymap_display);
+  g_autoptr (GTask) task = NULL;
+
+  if (shared_keymap_compiling)
+    {
+      shared_keymap_outdated = TRUE;
+      return;
+    }
+
+  /* Compiling takes a while, so don't block the main loop on it */
+  task = g_task_new (NULL, NULL, shared_keymap_compiled, NULL);
+  g_task_set_source_tag (task, compile_shared_keymap);
+  g_task_set_task_data (task, g_strdup (DisplayString (xdisplay)), g_free);
+  g_task_run_in_thread (task, compile_keymap_thread);
+  shared_keymap_compiling = TRUE;
+#endif
+}
+
+static void
+keys_changed_cb (GdkKeymap *gdk_keymap,
+                 gpointer   user_data)
+{
+  compile_shared_keymap ();
+}
+
+#define KEYBOARD_SCHEMA "org.gnome.desktop.peripherals.keyboard"
+/* Defaults of KEYBOARD_SCHEMA, for when it's not installed */
+#define DEFAULT_REPEAT_RATE 33
+#define DEFAULT_REPEAT_DELAY 500
+
+static void
+keyboard_send_repeat_info (struct wl_resource *keyboard_resource,
+                           WakefieldKeyboard  *keyboard)
+{
+  if (wl_resource_get_version (keyboard_resource) < WL_KEYBOARD_REPEAT_INFO_SINCE_VERSION)
+    return;
+
+  wl_keyboard_send_repeat_info (keyboard_resource,
+                                keyboard->repeat_rate,
+                                keyboard->repeat_delay);
+}
+
+static void
+update_repeat_info (WakefieldKeyboard *keyboard)
+{
+  guint interval;
+
+  if (!g_settings_get_boolean (keyboard->settings, "repeat"))
+    {
+      keyboard->repeat_rate = 0;
+      keyboard->repeat_delay = 0;
+      return;
+    }
+
+  interval = g_settings_get_uint (keyboard->settings, "repeat-interval");
+  keyboard->repeat_rate = interval > 0 ? MAX (1000 / interval, 1) : 0;
+  keyboard->repeat_delay = MIN (g_settings_get_uint (keyboard->settings, "delay"), G_MAXINT32);
+}
+
+static void
+keyboard_settings_changed (GSettings  *settings,
+                           const char *key,
+                           gpointer    user_data)
+{
+  WakefieldKeyboard *keyboard = user_data;
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (keyboard->compositor);
+  struct wl_resource *keyboard_resource;
+  gint32 old_rate = keyboard->repeat_rate;
+  gint32 old_delay = keyboard->repeat_delay;
+
+  update_repeat_info (keyboard);
+
+  if (old_rate == keyboard->repeat_rate && old_delay == keyboard->repeat_delay)
+    return;
+
+  wl_resource_for_each (keyboard_resource, &keyboard->resource_list)
+    keyboard_send_repeat_info (keyboard_resource, keyboard);
+}
+
+static void
+wakefield_keyboard_init_settings (WakefieldKeyboard *keyboard)
+{
+  GSettingsSchemaSource *source = g_settings_schema_source_get_default ();
+  g_autoptr (GSettingsSchema) schema = NULL;
+
+  keyboard->repeat_rate = DEFAULT_REPEAT_RATE;
+  keyboard->repeat_delay = DEFAULT_REPEAT_DELAY;
+
+  if (source)
+    schema = g_settings_schema_source_lookup (source, KEYBOARD_SCHEMA, TRUE);
+  if (schema == NULL)
+    return;
+
+  keyboard->settings = g_settings_new_full (schema, NULL, NULL);
+  g_signal_connect (keyboard->settings, "changed",
+                    G_CALLBACK (keyboard_settings_changed), keyboard);
+  update_repeat_info (keyboard);
+}
+
+static void
+wakefield_keyboard_init (WakefieldCompositor *compositor,
+                         WakefieldKeyboard *keyboard)
+{
+  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+
+  keyboard->compositor = compositor;
+  wl_list_init (&keyboard->resource_list);
+  wl_list_init (&keyboard->timestamps_resource_list);
+
+  wakefield_keyboard_init_settings (keyboard);
+
+#if defined(GDK_WINDOWING_X11)
+  if (!GDK_IS_X11_DISPLAY (display))
+    return;
+
+  if (shared_keymap_display == NULL)
+    {
+      shared_keymap_display = display;
+      /* GDK emits this on XKB new keyboard and map notifies */
+      g_signal_connect (gdk_keymap_get_for_display (display), "keys-changed",
+                        G_CALLBACK (keys_changed_cb), NULL);
+      compile_shared_keymap ();
+    }
+
+  if (display != shared_keymap_display)
+    return;
+
+  shared_keymap_keyboards = g_list_prepend (shared_keymap_keyboards, keyboard);
+  keyboard->keymap = shared_keymap;
+#endif
+}
+
+static void
+wakefield_keyboard_finalize (WakefieldKeyboard *keyboard)
+{
+  shared_keymap_keyboards = g_list_remove (shared_keymap_keyboards, keyboard);
+  g_clear_object (&keyboard->settings);
+}
+
+#define SEAT_VERSION 9
+
+static const struct wl_seat_interface seat_interface = {
+  seat_get_pointer,
+  seat_get_keyboard, /* get_keyboard */
+  seat_get_touch,
+  .release = resource_release,
+};
+
+static void
+wl_seat_destructor (struct wl_resource *resource)
+{
+}
+
+static void
+bind_seat (struct wl_client *client,
+           void *data,
+           uint32_t version,
+           uint32_t id)
+{
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldSeat *seat = &priv->seat;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wl_seat_interface, version, id);
+  wl_resource_set_implementation (cr, &seat_interface, seat, wl_seat_destructor);
+  wl_seat_send_capabilities (cr, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD |
+                                 (seat->has_touch ? WL_SEAT_CAPABILITY_TOUCH : 0));
 
   if (version >= WL_SEAT_NAME_SINCE_VERSION)
     wl_seat_send_name (cr, "seat0");
 }
 
+static const struct zwp_relative_pointer_v1_interface relative_pointer_implementation = {
+  resource_release,
+};
+
+static void
+relative_pointer_manager_get_relative_pointer (struct wl_client   *client,
+                                               struct wl_resource *resource,
+                                               uint32_t            id,
+                                               struct wl_resource *pointer_resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_relative_pointer_v1_interface,
+                           wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (cr, &relative_pointer_implementation,
+                                  pointer, unbind_relative_pointer);
+  wl_list_insert (&pointer->relative_resource_list, wl_resource_get_link (cr));
+  wakefield_client_cache_resource (cr, WAKEFIELD_CLIENT_RELATIVE_POINTER);
+
+  /* Absolute motion isn't coalesced for these clients either */
+  wakefield_client_set_motion_history (client, TRUE);
+
+  if (!pointer->raw_motion)
+    wakefield_compositor_run_in_main (pointer->compositor, select_raw_motion,
+                                      NULL, NULL);
+}
+
+static const struct zwp_relative_pointer_manager_v1_interface relative_pointer_manager_implementation = {
+  resource_release,
+  relative_pointer_manager_get_relative_pointer,
+};
+
+static void
+bind_relative_pointer_manager (struct wl_client *client,
+                               void *data,
+                               uint32_t version,
+                               uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_relative_pointer_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &relative_pointer_manager_implementation, NULL, NULL);
+}
+
+#define RELATIVE_POINTER_MANAGER_VERSION 1
+
+static const struct zwp_input_timestamps_v1_interface input_timestamps_implementation = {
+  resource_release,
+};
+
+static void
+create_input_timestamps (struct wl_client   *client,
+                         struct wl_resource *resource,
+                         uint32_t            id,
+                         struct wl_list     *timestamps_resource_list)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_input_timestamps_v1_interface,
+                           wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (cr, &input_timestamps_implementation,
+                                  NULL, unbind_resource);
+  wl_list_insert (timestamps_resource_list, wl_resource_get_link (cr));
+}
+
+static void
+input_timestamps_manager_get_keyboard_timestamps (struct wl_client   *client,
+                                                  struct wl_resource *resource,
+                                                  uint32_t            id,
+                                                  struct wl_resource *keyboard_resource)
+{
+  WakefieldKeyboard *keyboard = wl_resource_get_user_data (keyboard_resource);
+
+  create_input_timestamps (client, resource, id, &keyboard->timestamps_resource_list);
+}
+
+static void
+input_timestamps_manager_get_pointer_timestamps (struct wl_client   *client,
+                                                 struct wl_resource *resource,
+                                                 uint32_t            id,
+                                                 struct wl_resource *pointer_resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+
+  create_input_timestamps (client, resource, id, &pointer->timestamps_resource_list);
+}
+
+static void
+input_timestamps_manager_get_touch_timestamps (struct wl_client   *client,
+                                               struct wl_resource *resource,
+                                               uint32_t            id,
+                                               struct wl_resource *touch_resource)
+{
+  WakefieldTouch *touch = wl_resource_get_user_data (touch_resource);
+
+  create_input_timestamps (client, resource, id, &touch->timestamps_resource_list);
+}
+
+static const struct zwp_input_timestamps_manager_v1_interface input_timestamps_manager_implementation = {
+  resource_release,
+  input_timestamps_manager_get_keyboard_timestamps,
+  input_timestamps_manager_get_pointer_timestamps,
+  input_timestamps_manager_get_touch_timestamps,
+};
+
+static void
+bind_input_timestamps_manager (struct wl_client *client,
+                               void *data,
+                               uint32_t version,
+                               uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_input_timestamps_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &input_timestamps_manager_implementation, NULL, NULL);
+}
+
+#define INPUT_TIMESTAMPS_MANAGER_VERSION 1
+
+static const struct zwp_pointer_gesture_swipe_v1_interface pointer_gesture_swipe_implementation = {
+  resource_release,
+};
+
+static const struct zwp_pointer_gesture_pinch_v1_interface pointer_gesture_pinch_implementation = {
+  resource_release,
+};
+
+static const struct zwp_pointer_gesture_hold_v1_interface pointer_gesture_hold_implementation = {
+  resource_release,
+};
+
+static void
+create_pointer_gesture (struct wl_client         *client,
+                        struct wl_resource       *resource,
+                        uint32_t                  id,
+                        const struct wl_interface *interface,
+                        const void               *implementation,
+                        struct wl_list           *resource_list)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, interface, wl_resource_get_version (resource), id);
+  wl_resource_set_implementation (cr, implementation, NULL, unbind_resource);
+  wl_list_insert (resource_list, wl_resource_get_link (cr));
+}
+
+static void
+pointer_gestures_get_swipe_gesture (struct wl_client   *client,
+                                    struct wl_resource *resource,
+                                    uint32_t            id,
+                                    struct wl_resource *pointer_resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+
+  create_pointer_gesture (client, resource, id,
+                          &zwp_pointer_gesture_swipe_v1_interface,
+                          &pointer_gesture_swipe_implementation,
+                          &pointer->swipe_resource_list);
+}
+
+static void
+pointer_gestures_get_pinch_gesture (struct wl_client   *client,
+                                    struct wl_resource *resource,
+                                    uint32_t            id,
+                                    struct wl_resource *pointer_resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+
+  create_pointer_gesture (client, resource, id,
+                          &zwp_pointer_gesture_pinch_v1_interface,
+                          &pointer_gesture_pinch_implementation,
+                          &pointer->pinch_resource_list);
+}
+
+/* GDK3 has no hold gestures, these never get any event */
+static void
+pointer_gestures_get_hold_gesture (struct wl_client   *client,
+                                   struct wl_resource *resource,
+                                   uint32_t            id,
+                                   struct wl_resource *pointer_resource)
+{
+  WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+
+  create_pointer_gesture (client, resource, id,
+                          &zwp_pointer_gesture_hold_v1_interface,
+                          &pointer_gesture_hold_implementation,
+                          &pointer->hold_resource_list);
+}
+
+static const struct zwp_pointer_gestures_v1_interface pointer_gestures_implementation = {
+  pointer_gestures_get_swipe_gesture,
+  pointer_gestures_get_pinch_gesture,
+  resource_release,
+  pointer_gestures_get_hold_gesture,
+};
+
+static void
+bind_pointer_gestures (struct wl_client *client,
+                       void *data,
+                       uint32_t version,
+                       uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_pointer_gestures_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &pointer_gestures_implementation, NULL, NULL);
+}
+
+#define POINTER_GESTURES_VERSION 3
+
 static void
 wakefield_seat_init (WakefieldCompositor *compositor,
-                     WakefieldSeat *seat,
-                     struct wl_display    *wl_display)
+                     WakefieldSeat *seat)
 {
-  wakefield_pointer_init (&seat->pointer);
+  GdkSeat *gdk_seat = gdk_display_get_default_seat (gtk_widget_get_display (GTK_WIDGET (compositor)));
+
+  wakefield_pointer_init (compositor, &seat->pointer);
   wakefield_keyboard_init (compositor, &seat->keyboard);
+  wakefield_touch_init (compositor, &seat->touch);
 
-  wl_global_create (wl_display, &wl_seat_interface, SEAT_VERSION, seat, bind_seat);
+  /* Binds may happen in the dispatch thread, so ask GDK now */
+  seat->has_touch = (gdk_seat_get_capabilities (gdk_seat) & GDK_SEAT_CAPABILITY_TOUCH) != 0;
 }
 
 static void
@@ -1418,14 +3264,15 @@ bind_output (struct wl_client *client,
              uint32_t version,
              uint32_t id)
 {
-  WakefieldCompositor *compositor = data;
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   WakefieldOutput *output = &priv->output;
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_output_interface, version, id);
-  wl_resource_set_implementation (cr, NULL, output, unbind_resource);
+  wl_resource_set_implementation (cr, NULL, output, unbind_output);
   wl_list_insert (&output->resource_list, wl_resource_get_link (cr));
+  wakefield_client_cache_resource (cr, WAKEFIELD_CLIENT_OUTPUT);
 
   wl_output_send_geometry (cr,
                            0, 0,
@@ -1434,7 +3281,7 @@ bind_output (struct wl_client *client,
                            "Wakefield", "Gtk",
                            WL_OUTPUT_TRANSFORM_NORMAL);
 
-  refresh_output (compositor, cr);
+  refresh_output (output, cr);
 }
 
 #define WL_OUTPUT_VERSION 2
@@ -1444,11 +3291,12 @@ wakefield_output_init (WakefieldCompositor *compositor)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   wl_list_init (&priv->output.resource_list);
-  wl_global_create (priv->wl_display, &wl_output_interface,
-                    WL_OUTPUT_VERSION, compositor, bind_output);
+  priv->output.scale = 1;
 }
 
-static GSource * wayland_event_source_new (struct wl_display *display);
+static void wakefield_display_attach_wayland_source (WakefieldDisplay *display);
+static void wakefield_display_stop_dispatch_thread (WakefieldDisplay *display);
+static GSource * handoff_source_new (WakefieldCompositor *compositor);
 
 cairo_region_t *
 wakefield_region_get_region (struct wl_resource *region_resource)
@@ -1511,25 +3359,47 @@ wl_compositor_create_region (struct wl_client *client,
   region->region = cairo_region_create ();
 }
 
-void
-wakefield_compositor_surface_unmapped (WakefieldCompositor *compositor,
-                                       struct wl_resource  *surface)
+static void
+focus_topmost_surface (WakefieldCompositor *compositor,
+                       gpointer             user_data)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  WakefieldPointer *pointer = &priv->seat.pointer;
   WakefieldKeyboard *keyboard = &priv->seat.keyboard;
-  struct wl_resource *xdg_surface = wakefield_surface_get_xdg_surface (surface);
 
-  if (keyboard->focus == surface)
+  if (keyboard->focus == NULL && gtk_widget_has_focus (GTK_WIDGET (compositor)))
     {
-      wakefield_compositor_send_keyboard_leave (compositor, surface);
-
-      if (gtk_widget_has_focus (GTK_WIDGET (compositor)))
-        {
-          struct wl_resource *topmost_surface = wakefield_compositor_get_topmost_surface (compositor);
-          if (topmost_surface)
-            wakefield_compositor_send_keyboard_enter (compositor, topmost_surface);
-        }
+      struct wl_resource *topmost_surface = wakefield_compositor_get_topmost_surface (compositor);
+      if (topmost_surface)
+        wakefield_compositor_send_keyboard_enter (compositor, topmost_surface);
+    }
+}
+
+static void
+queue_draw (WakefieldCompositor *compositor,
+            gpointer             user_data)
+{
+  gtk_widget_queue_draw (GTK_WIDGET (compositor));
+}
+
+void
+wakefield_compositor_surface_unmapped (WakefieldCompositor *compositor,
+                                       struct wl_resource  *surface)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+  WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  struct wl_resource *xdg_surface = wakefield_surface_get_xdg_surface (surface);
+
+  g_queue_remove (&priv->mapped_surfaces, surface);
+
+  if (priv->pending_motion_surface == surface)
+    priv->pending_motion_surface = NULL;
+
+  if (keyboard->focus == surface)
+    {
+      wakefield_compositor_send_keyboard_leave (compositor, surface);
+      wakefield_compositor_run_in_main (compositor, focus_topmost_surface,
+                                        NULL, NULL);
     }
 
   if (pointer->grab_popup_surface == surface)
@@ -1553,15 +3423,47 @@ wakefield_compositor_surface_unmapped (WakefieldCompositor *compositor,
       pointer->current_surface = NULL;
     }
 
+  if (pointer->swipe_surface == surface)
+    pointer->swipe_surface = NULL;
+  if (pointer->pinch_surface == surface)
+    pointer->pinch_surface = NULL;
+
+  cancel_touches (compositor, surface);
+  wakefield_pointer_constraints_update (priv->pointer_constraints);
+
   if (xdg_surface)
-    gtk_widget_queue_draw (GTK_WIDGET (compositor));
+    wakefield_compositor_run_in_main (compositor, queue_draw, NULL, NULL);
+}
 
+static void
+send_configure_in_main (WakefieldCompositor *compositor,
+                        gpointer             user_data)
+{
+  struct wl_resource *surface_resource;
+  struct wl_resource *xdg_surface;
+
+  surface_resource = wakefield_surface_get_resource (user_data);
+  if (surface_resource == NULL)
+    return;
+
+  xdg_surface = wakefield_surface_get_xdg_surface (surface_resource);
+  if (xdg_surface)
+    send_xdg_configure_request (compositor, xdg_surface);
 }
 
 void
 wakefield_compositor_send_configure (WakefieldCompositor *compositor,
                                      struct wl_resource  *surface)
 {
+  /* Configures depend on the widget allocation and state */
+  if (wakefield_compositor_is_dispatch_thread (compositor))
+    {
+      wakefield_compositor_run_in_main (compositor, send_configure_in_main,
+                                        g_object_ref (wakefield_xdg_surface_get_surface (surface)),
+                                        g_object_unref);
+      return;
+    }
+
   send_xdg_configure_request (compositor, surface);
 }
 
@@ -1573,6 +3475,10 @@ wakefield_compositor_surface_mapped (WakefieldCompositor *compositor,
   struct wl_resource *xdg_surface = wakefield_surface_get_xdg_surface  (surface);
   WakefieldKeyboard *keyboard = &priv->seat.keyboard;
 
+  /* Its window gets created now, and so ends up on top */
+  if (xdg_surface)
+    g_queue_push_tail (&priv->mapped_surfaces, surface);
+
   if (xdg_surface && gtk_widget_get_realized (GTK_WIDGET (compositor)))
     {
       if (gtk_widget_has_focus (GTK_WIDGET (compositor)) &&
@@ -1640,11 +3546,53 @@ xdg_get_xdg_surface (struct wl_client *client,
   xdg_surface = wakefield_xdg_surface_new (client, shell_resource, id, surface_resource);
   wl_list_insert (priv->xdg_surfaces.prev, wl_resource_get_link (xdg_surface));
 
-  output_resource = wl_resource_find_for_client (&priv->output.resource_list, client);
-  wl_surface_send_enter (surface_resource, output_resource);
+  output_resource = wakefield_client_lookup_resource (client, WAKEFIELD_CLIENT_OUTPUT,
+                                                     &priv->output.resource_list);
+  if (output_resource)
+    wl_surface_send_enter (surface_resource, output_resource);
+
+  wakefield_compositor_send_configure (compositor, xdg_surface);
+}
+typedef struct
+{
+  WakefieldSurface *parent_surface;
+  WakefieldSurface *surface;
+  uint32_t serial;
+} WakefieldGrabRequest;
+
+static void
+grab_request_free (gpointer user_data)
+{
+  WakefieldGrabRequest *request = user_data;
 
-  send_xdg_configure_request (compositor, xdg_surface);
+  g_object_unref (request->parent_surface);
+  g_object_unref (request->surface);
+  g_free (request);
 }
+
+static void
+grab_pointer_in_main (WakefieldCompositor *compositor,
+                      gpointer             user_data)
+{
+  WakefieldGrabRequest *request = user_data;
+  struct wl_resource *parent_surface_resource;
+  struct wl_resource *surface_resource;
+  struct wl_resource *parent_xdg_surface, *xdg_surface;
+
+  parent_surface_resource = wakefield_surface_get_resource (request->parent_surface);
+  surface_resource = wakefield_surface_get_resource (request->surface);
+
+  if (parent_surface_resource == NULL || surface_resource == NULL)
+    return;
+
+  parent_xdg_surface = wakefield_surface_get_xdg_surface (parent_surface_resource);
+  xdg_surface = wakefield_surface_get_xdg_surface (surface_resource);
+
+  if (parent_xdg_surface && xdg_surface)
+    wakefield_compositor_grab_pointer (compositor, parent_xdg_surface,
+                                       xdg_surface, request->serial);
+}
+
 gboolean
 wakefield_compositor_grab_pointer (WakefieldCompositor *compositor,
                                    struct wl_resource  *parent_xdg_surface,
@@ -1657,6 +3605,21 @@ wakefield_compositor_grab_pointer (WakefieldCompositor *compositor,
   struct wl_resource *parent_surface_resource;
   struct wl_resource *surface_resource;
 
+  if (wakefield_compositor_is_dispatch_thread (compositor))
+    {
+      WakefieldGrabRequest *request = g_new0 (WakefieldGrabRequest, 1);
+
+      request->parent_surface =
+        g_object_ref (wakefield_xdg_surface_get_surface (parent_xdg_surface));
+      request->surface =
+        g_object_ref (wakefield_xdg_surface_get_surface (xdg_surface));
+      request->serial = serial;
+
+      wakefield_compositor_run_in_main (compositor, grab_pointer_in_main,
+                                        request, grab_request_free);
+      return TRUE;
+    }
+
   if (pointer->serial != serial)
       return FALSE;
 
@@ -1677,6 +3640,9 @@ wakefield_compositor_grab_pointer (WakefieldCompositor *compositor,
     wakefield_xdg_surface_get_surface_resource (parent_xdg_surface);
   pointer->grab_popup_surface = surface_resource;
 
+  /* The popup grab replaces any constraint grab */
+  wakefield_pointer_constraints_update (priv->pointer_constraints);
+
   return gdk_device_grab (pointer->grab_device,
                           wakefield_surface_get_window (parent_surface_resource),
                           GDK_OWNERSHIP_NONE,
@@ -1685,19 +3651,143 @@ wakefield_compositor_grab_pointer (WakefieldCompositor *compositor,
                           GDK_BUTTON_PRESS_MASK |
                           GDK_BUTTON_RELEASE_MASK |
                           GDK_SCROLL_MASK |
+                          GDK_SMOOTH_SCROLL_MASK |
                           GDK_ENTER_NOTIFY_MASK |
                           GDK_LEAVE_NOTIFY_MASK,
                           NULL,
                           pointer->grab_time) == GDK_GRAB_SUCCESS;
 }
 
+static void
+resume_client_in_main (WakefieldCompositor *compositor,
+                       gpointer             user_data)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_client *client = user_data;
+  struct wl_resource *xdg_surface_resource;
+
+  /* The client may be gone by now, only compare against it */
+  wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
+    {
+      if (wl_resource_get_client (xdg_surface_resource) == client)
+        send_xdg_configure_request (compositor, xdg_surface_resource);
+    }
+
+  gtk_widget_queue_draw (GTK_WIDGET (compositor));
+}
+
+static void
+wakefield_client_set_unresponsive (WakefieldClient *w_client,
+                                   gboolean         unresponsive)
+{
+  WakefieldCompositor *compositor = w_client->compositor;
+
+  w_client->unresponsive = unresponsive;
+
+  /* Catch up on the configures we skipped, and redraw either way to
+     switch between the dimmed snapshot and the live buffers */
+  if (unresponsive)
+    wakefield_compositor_run_in_main (compositor, queue_draw, NULL, NULL);
+  else
+    wakefield_compositor_run_in_main (compositor, resume_client_in_main,
+                                      w_client->client, NULL);
+
+  wakefield_client_notify_state (w_client, signals[CLIENT_UNRESPONSIVE], unresponsive);
+}
+
+gboolean
+wakefield_compositor_client_is_unresponsive (WakefieldCompositor *compositor,
+                                             struct wl_client    *client)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  return w_client != NULL && w_client->unresponsive;
+}
+
+#define PING_INTERVAL_SECONDS 5
+#define PING_TIMEOUT_MS 5000
+
+static gboolean
+ping_timed_out (gpointer user_data)
+{
+  WakefieldDisplay *display = user_data;
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_lock (display);
+  GSource *source = g_main_current_source ();
+  WakefieldClient *w_client;
+
+  /* The pong or the client's destruction may have beaten us to the lock,
+     so the client is only looked up once we know it's still there */
+  if (g_source_is_destroyed (source))
+    return G_SOURCE_REMOVE;
+
+  wl_list_for_each (w_client, &display->clients, link)
+    {
+      if (w_client->ping_timeout_id != g_source_get_id (source))
+        continue;
+
+      w_client->ping_timeout_id = 0;
+
+      g_debug ("Client %p did not answer ping %u", w_client->client, w_client->ping_serial);
+      wakefield_client_set_unresponsive (w_client, TRUE);
+      break;
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+ping_clients (gpointer user_data)
+{
+  WakefieldDisplay *display = user_data;
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_lock (display);
+  WakefieldClient *w_client;
+
+  if (g_source_is_destroyed (g_main_current_source ()))
+    return G_SOURCE_REMOVE;
+
+  wl_list_for_each (w_client, &display->clients, link)
+    {
+      WakefieldCompositorPrivate *priv =
+        wakefield_compositor_get_instance_private (w_client->compositor);
+      struct wl_resource *shell_resource;
+
+      /* Only one ping in flight, an unresponsive client just
+         keeps the one it didn't answer */
+      if (w_client->ping_serial != 0)
+        continue;
+
+      shell_resource = wl_resource_find_for_client (&priv->shell_resources, w_client->client);
+      if (shell_resource == NULL)
+        continue;
+
+      w_client->ping_serial = wl_display_next_serial (display->wl_display);
+      w_client->ping_timeout_id = g_timeout_add (PING_TIMEOUT_MS, ping_timed_out, display);
+      xdg_wm_base_send_ping (shell_resource, w_client->ping_serial);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 xdg_pong (struct wl_client *client,
           struct wl_resource *resource,
           uint32_t serial)
 {
-  wl_resource_post_error (resource, 1,
-                          "xdg-shell:: pong not implemented yet.");
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  if (w_client == NULL || w_client->ping_serial != serial)
+    return;
+
+  w_client->ping_serial = 0;
+
+  if (w_client->ping_timeout_id)
+    {
+      g_source_remove (w_client->ping_timeout_id);
+      w_client->ping_timeout_id = 0;
+    }
+
+  if (w_client->unresponsive)
+    wakefield_client_set_unresponsive (w_client, FALSE);
 }
 
 static void
@@ -1721,44 +3811,535 @@ static const struct xdg_wm_base_interface xdg_implementation = {
 
 #define XDG_SHELL_VERSION 5
 
+static void
+unbind_xdg_shell (struct wl_resource *resource)
+{
+  WakefieldCompositor *compositor = wl_resource_get_user_data (resource);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  wl_list_remove (wl_resource_get_link (resource));
+
+  if (--priv->display->n_shell_resources == 0)
+    {
+      g_source_remove (priv->display->ping_interval_id);
+      priv->display->ping_interval_id = 0;
+    }
+}
+
 static void
 bind_xdg_shell (struct wl_client *client,
                 void *data,
                 uint32_t version,
                 uint32_t id)
 {
-  WakefieldCompositor *compositor = data;
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct wl_resource *cr;
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &xdg_wm_base_interface, version, id);
+  wl_resource_set_implementation (cr, &xdg_implementation, compositor, unbind_xdg_shell);
+  wl_list_insert (&priv->shell_resources, wl_resource_get_link (cr));
+
+  if (priv->display->n_shell_resources++ == 0)
+    priv->display->ping_interval_id = g_timeout_add_seconds (PING_INTERVAL_SECONDS,
+                                                             ping_clients, priv->display);
+}
+
+static void
+bind_compositor (struct wl_client *client,
+                 void *data,
+                 uint32_t version,
+                 uint32_t id)
+{
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wl_compositor_interface, version, id);
+  wl_resource_set_implementation (cr, &compositor_interface, compositor, NULL);
+}
+
+#define WL_COMPOSITOR_VERSION 3
+
+struct wl_display *
+wakefield_compositor_get_display (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->wl_display;
+}
+
+WakefieldDataDevice *
+wakefield_compositor_get_data_device (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->data_device;
+}
+
+WakefieldPrimarySelection *
+wakefield_compositor_get_primary_selection (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->primary_selection;
+}
+
+WakefieldPointerConstraints *
+wakefield_compositor_get_pointer_constraints (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->pointer_constraints;
+}
+
+/* The surface getting pointer events, none while a popup holds the pointer */
+struct wl_resource *
+wakefield_compositor_get_pointer_focus (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldPointer *pointer = &priv->seat.pointer;
+
+  if (pointer->grab_popup_surface)
+    return NULL;
+
+  return pointer->current_surface;
+}
+
+static void
+wakefield_client_destroyed (struct wl_listener *listener, void *data)
+{
+  WakefieldClient *w_client = wl_container_of (listener, w_client, destroy_listener);
+
+  if (w_client->ping_timeout_id)
+    g_source_remove (w_client->ping_timeout_id);
+
+  wl_list_remove (&w_client->link);
+  g_free (w_client);
+}
+
+static WakefieldClient *
+wakefield_client_from_wl_client (struct wl_client *client)
+{
+  struct wl_listener *listener;
+  WakefieldClient *w_client;
+
+  listener = wl_client_get_destroy_listener (client, wakefield_client_destroyed);
+  if (listener == NULL)
+    return NULL;
+
+  return wl_container_of (listener, w_client, destroy_listener);
+}
+
+void
+wakefield_client_cache_resource (struct wl_resource      *resource,
+                                 WakefieldClientResource  kind)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (wl_resource_get_client (resource));
+
+  if (w_client)
+    w_client->resources[kind] = resource;
+}
+
+/* To be called from the resource destructor, once it's off @resource_list.
+   Binding the same interface twice is rare, so we only search for another
+   one of the client's resources then. */
+void
+wakefield_client_uncache_resource (struct wl_resource      *resource,
+                                   WakefieldClientResource  kind,
+                                   struct wl_list          *resource_list)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (wl_resource_get_client (resource));
+
+  /* The record is already gone when the whole client is being destroyed */
+  if (w_client && w_client->resources[kind] == resource)
+    w_client->resources[kind] = wl_resource_find_for_client (resource_list, w_client->client);
+}
+
+struct wl_resource *
+wakefield_client_lookup_resource (struct wl_client        *client,
+                                  WakefieldClientResource  kind,
+                                  struct wl_list          *resource_list)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  if (w_client)
+    return w_client->resources[kind];
+
+  return wl_resource_find_for_client (resource_list, client);
+}
+
+void
+wakefield_client_set_motion_history (struct wl_client *client,
+                                     gboolean          motion_history)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  if (w_client)
+    w_client->motion_history = motion_history;
+}
+
+WakefieldCompositor *
+wakefield_compositor_for_client (struct wl_client *client)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  return w_client ? w_client->compositor : NULL;
+}
+
+static void
+wakefield_client_created (struct wl_listener *listener, void *data)
+{
+  WakefieldDisplay *display = wl_container_of (listener, display, client_created_listener);
+  struct wl_client *client = data;
+  WakefieldClient *w_client;
+
+  /* wakefield_compositor_create_client_fd() reassigns it right after */
+  w_client = g_new0 (WakefieldClient, 1);
+  w_client->compositor = display->compositors->data;
+  w_client->client = client;
+  w_client->destroy_listener.notify = wakefield_client_destroyed;
+  wl_client_add_destroy_listener (client, &w_client->destroy_listener);
+  wl_list_insert (display->clients.prev, &w_client->link);
+}
+
+static void
+wakefield_display_protocol_logger (void                                    *user_data,
+                                   enum wl_protocol_logger_type             direction,
+                                   const struct wl_protocol_logger_message *message)
+{
+  WakefieldDisplay *display = user_data;
+  WakefieldClient *w_client;
+
+  if (direction == WL_PROTOCOL_LOGGER_EVENT && !display->latency_stats)
+    return;
+
+  w_client = wakefield_client_from_wl_client (wl_resource_get_client (message->resource));
+  if (w_client == NULL)
+    return;
+
+  if (direction == WL_PROTOCOL_LOGGER_EVENT)
+    {
+      if (w_client->unflushed_since == 0)
+        w_client->unflushed_since = g_get_monotonic_time ();
+      return;
+    }
+
+  w_client->n_requests++;
+  w_client->n_iteration_requests++;
+}
+
+static void
+wakefield_display_update_protocol_logger (WakefieldDisplay *display)
+{
+  gboolean needed = display->latency_stats || display->client_request_budget > 0;
+
+  if (needed && display->protocol_logger == NULL)
+    {
+      display->protocol_logger =
+        wl_display_add_protocol_logger (display->wl_display,
+                                        wakefield_display_protocol_logger,
+                                        display);
+    }
+  else if (!needed && display->protocol_logger != NULL)
+    {
+      g_clear_pointer (&display->protocol_logger, wl_protocol_logger_destroy);
+    }
+}
+
+#define FLUSH_LATENCY_REPORT_INTERVAL 256
+
+/* Input events go out to @client, the one the GDK event was sent to,
+   as soon as it has been handled instead of waiting in our buffers for
+   the next main loop iteration. Anything queued for other clients on
+   the way, like a leave, goes out with the main loop flush. */
+static void
+wakefield_compositor_flush_input (WakefieldCompositor *compositor,
+                                  struct wl_client    *client)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldDisplay *display = priv->display;
+  WakefieldClient *w_client;
+  gint64 now;
+
+  if (!display->latency_stats)
+    {
+      if (client)
+        wl_client_flush (client);
+      return;
+    }
+
+  /* The stats account for every client with something queued */
+
+  now = g_get_monotonic_time ();
+
+  wl_list_for_each (w_client, &display->clients, link)
+    {
+      if (w_client->unflushed_since == 0)
+        continue;
+
+      wl_client_flush (w_client->client);
+
+      display->n_input_flushes++;
+      display->input_flush_latency_us += now - w_client->unflushed_since;
+      w_client->unflushed_since = 0;
+
+      if (display->n_input_flushes % FLUSH_LATENCY_REPORT_INTERVAL == 0)
+        g_debug ("Input flush latency: %" G_GINT64_FORMAT " us average over %" G_GUINT64_FORMAT " flushes, "
+                 "%" G_GINT64_FORMAT " us for the %" G_GUINT64_FORMAT " left to the main loop",
+                 display->input_flush_latency_us / (gint64) display->n_input_flushes,
+                 display->n_input_flushes,
+                 display->n_deferred_flushes ? display->deferred_flush_latency_us / (gint64) display->n_deferred_flushes : 0,
+                 display->n_deferred_flushes);
+    }
+}
+
+/* Accounts for what wl_display_flush_clients() just sent */
+static void
+wakefield_display_account_flush (WakefieldDisplay *display)
+{
+  WakefieldClient *w_client;
+  gint64 now;
+
+  if (!display->latency_stats)
+    return;
+
+  now = g_get_monotonic_time ();
+
+  wl_list_for_each (w_client, &display->clients, link)
+    {
+      if (w_client->unflushed_since == 0)
+        continue;
+
+      display->n_deferred_flushes++;
+      display->deferred_flush_latency_us += now - w_client->unflushed_since;
+      w_client->unflushed_since = 0;
+    }
+}
+
+/* Returns whether the dispatch iteration went over budget, in which case
+   we should give the rest of the main loop a chance to run */
+static gboolean
+wakefield_display_account_dispatch (WakefieldDisplay *display,
+                                    gint64            elapsed_us)
+{
+  WakefieldClient *w_client;
+  gboolean over_budget;
+
+  over_budget = display->dispatch_budget_us > 0 &&
+                elapsed_us > display->dispatch_budget_us;
+
+  wl_list_for_each (w_client, &display->clients, link)
+    {
+      if (display->client_request_budget > 0 &&
+          w_client->n_iteration_requests > display->client_request_budget)
+        {
+          w_client->n_over_budget++;
+          over_budget = TRUE;
+
+          g_debug ("Client %p sent %u requests in one dispatch: "
+                   "%" G_GUINT64_FORMAT " requests, over budget %" G_GUINT64_FORMAT " times",
+                   w_client->client, w_client->n_iteration_requests,
+                   w_client->n_requests, w_client->n_over_budget);
+        }
+
+      w_client->n_iteration_requests = 0;
+    }
+
+  return over_budget;
+}
+
+typedef struct
+{
+  guint signal_id;
+  gpointer user_data;
+  gboolean state;
+} WakefieldClientStateChange;
+
+static void
+emit_client_state_change (WakefieldCompositor *compositor,
+                          gpointer             user_data)
+{
+  WakefieldClientStateChange *change = user_data;
+
+  g_signal_emit (compositor, change->signal_id, 0,
+                 change->user_data, change->state);
+}
+
+static void
+wakefield_client_notify_state (WakefieldClient *w_client,
+                               guint            signal_id,
+                               gboolean         state)
+{
+  WakefieldClientStateChange *change;
+
+  change = g_new0 (WakefieldClientStateChange, 1);
+  change->signal_id = signal_id;
+  change->user_data = w_client->user_data;
+  change->state = state;
+  wakefield_compositor_run_in_main (w_client->compositor,
+                                    emit_client_state_change,
+                                    change, g_free);
+}
+
+static void
+wakefield_client_set_congested (WakefieldClient *w_client,
+                                gboolean         congested)
+{
+  WakefieldCompositor *compositor = w_client->compositor;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  w_client->congested = congested;
+
+  if (!congested)
+    {
+      WakefieldPointer *pointer = &priv->seat.pointer;
+      struct wl_resource *pointer_resource;
+
+      pointer_resource = wakefield_compositor_get_pointer_for_client (compositor, w_client->client);
+      if (w_client->has_pending_motion && pointer_resource &&
+          pointer->current_surface &&
+          wl_resource_get_client (pointer->current_surface) == w_client->client)
+        {
+          pointer_send_timestamps (pointer_resource, w_client->pending_motion_time);
+          wl_pointer_send_motion (pointer_resource,
+                                  w_client->pending_motion_time,
+                                  wl_fixed_from_double (w_client->pending_motion_x),
+                                  wl_fixed_from_double (w_client->pending_motion_y));
+          pointer_send_frame (pointer_resource);
+        }
+      w_client->has_pending_motion = FALSE;
+
+      /* Redraw so the frame callbacks we held back get sent */
+      wakefield_compositor_run_in_main (compositor, queue_draw, NULL, NULL);
+    }
+
+  wakefield_client_notify_state (w_client, signals[CLIENT_CONGESTED], congested);
+}
+
+/* Called after flushing, anything still queued in the socket
+   is what the client hasn't read yet */
+static void
+wakefield_display_update_congestion (WakefieldDisplay *display)
+{
+  WakefieldClient *w_client;
+
+  if (display->congestion_threshold == 0)
+    return;
+
+  wl_list_for_each (w_client, &display->clients, link)
+    {
+      int queued;
+
+      if (ioctl (wl_client_get_fd (w_client->client), SIOCOUTQ, &queued) != 0)
+        continue;
+
+      if (!w_client->congested && (gsize) queued > display->congestion_threshold)
+        {
+          g_debug ("Client %p stopped reading, %d bytes queued", w_client->client, queued);
+          wakefield_client_set_congested (w_client, TRUE);
+        }
+      /* Some hysteresis, so we don't flip on every event */
+      else if (w_client->congested && (gsize) queued <= display->congestion_threshold / 2)
+        {
+          wakefield_client_set_congested (w_client, FALSE);
+        }
+    }
+}
+
+gboolean
+wakefield_compositor_client_is_congested (WakefieldCompositor *compositor,
+                                          struct wl_client    *client)
+{
+  WakefieldClient *w_client = wakefield_client_from_wl_client (client);
+
+  return w_client != NULL && w_client->congested;
+}
+
+#define DEFAULT_DISPATCH_BUDGET_US 4000
+#define DEFAULT_CLIENT_REQUEST_BUDGET 256
+#define DEFAULT_CONGESTION_THRESHOLD (64 * 1024)
+
+static WakefieldDisplay *
+wakefield_display_new (void)
+{
+  WakefieldDisplay *display = g_new0 (WakefieldDisplay, 1);
+
+  display->ref_count = 1;
+  display->wl_display = wl_display_create ();
+  wl_display_init_shm (display->wl_display);
+
+  wl_list_init (&display->clients);
+  display->client_created_listener.notify = wakefield_client_created;
+  wl_display_add_client_created_listener (display->wl_display,
+                                          &display->client_created_listener);
+
+  display->latency_stats = g_getenv ("WAKEFIELD_LATENCY_STATS") != NULL;
+  display->dispatch_budget_us = DEFAULT_DISPATCH_BUDGET_US;
+  display->client_request_budget = DEFAULT_CLIENT_REQUEST_BUDGET;
+  wakefield_display_update_protocol_logger (display);
+  display->congestion_threshold = DEFAULT_CONGESTION_THRESHOLD;
+  display->dispatch_priority = G_PRIORITY_DEFAULT;
+
+  /* The bind handlers find the compositor of each client */
+  wl_global_create (display->wl_display, &wl_compositor_interface,
+                    WL_COMPOSITOR_VERSION, display, bind_compositor);
+  wl_global_create (display->wl_display, &xdg_wm_base_interface,
+                    XDG_SHELL_VERSION, display, bind_xdg_shell);
+  wl_global_create (display->wl_display, &wl_seat_interface,
+                    SEAT_VERSION, display, bind_seat);
+  wl_global_create (display->wl_display, &wl_output_interface,
+                    WL_OUTPUT_VERSION, display, bind_output);
+  wl_global_create (display->wl_display, &zwp_relative_pointer_manager_v1_interface,
+                    RELATIVE_POINTER_MANAGER_VERSION, display, bind_relative_pointer_manager);
+  wl_global_create (display->wl_display, &zwp_input_timestamps_manager_v1_interface,
+                    INPUT_TIMESTAMPS_MANAGER_VERSION, display, bind_input_timestamps_manager);
+  wl_global_create (display->wl_display, &zwp_pointer_gestures_v1_interface,
+                    POINTER_GESTURES_VERSION, display, bind_pointer_gestures);
+  wakefield_data_device_manager_init (display->wl_display);
+  wakefield_primary_selection_init (display->wl_display);
+  wakefield_pointer_constraints_init (display->wl_display);
+
+  g_rec_mutex_init (&display->display_lock);
+
+  /* Attach the wl_event_loop to ours */
+  wakefield_display_attach_wayland_source (display);
+
+  return display;
+}
+
+static WakefieldDisplay *
+wakefield_display_ref (WakefieldDisplay *display)
+{
+  display->ref_count++;
 
-  cr = wl_resource_create (client, &xdg_wm_base_interface, version, id);
-  wl_resource_set_implementation (cr, &xdg_implementation, compositor, unbind_resource);
-  wl_list_insert (&priv->shell_resources, wl_resource_get_link (cr));
+  return display;
 }
 
 static void
-bind_compositor (struct wl_client *client,
-                 void *data,
-                 uint32_t version,
-                 uint32_t id)
+wakefield_display_unref (WakefieldDisplay *display)
 {
-  WakefieldCompositor *compositor = data;
-  struct wl_resource *cr;
+  if (--display->ref_count > 0)
+    return;
 
-  cr = wl_resource_create (client, &wl_compositor_interface, version, id);
-  wl_resource_set_implementation (cr, &compositor_interface, compositor, NULL);
-}
+  if (display->dispatch_thread)
+    wakefield_display_stop_dispatch_thread (display);
 
-#define WL_COMPOSITOR_VERSION 3
+  if (display->ping_interval_id)
+    g_source_remove (display->ping_interval_id);
 
-struct wl_display *
-wakefield_compositor_get_display (WakefieldCompositor *compositor)
-{
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_source_destroy (display->wayland_source);
+  g_source_unref (display->wayland_source);
+  wl_display_destroy (display->wl_display);
+  g_rec_mutex_clear (&display->display_lock);
 
-  return priv->wl_display;
+  g_free (display);
 }
 
+enum {
+  PROP_0,
+  PROP_SHARED_WITH,
+};
+
 static void
 wakefield_compositor_init (WakefieldCompositor *compositor)
 {
@@ -1767,28 +4348,68 @@ wakefield_compositor_init (WakefieldCompositor *compositor)
   gtk_widget_set_has_window (GTK_WIDGET (compositor), FALSE);
   gtk_widget_set_can_focus (GTK_WIDGET (compositor), TRUE);
 
-  priv->wl_display = wl_display_create ();
-  wl_display_init_shm (priv->wl_display);
-
-  wl_global_create (priv->wl_display, &wl_compositor_interface,
-                    WL_COMPOSITOR_VERSION, compositor, bind_compositor);
-
-  wl_global_create (priv->wl_display, &xdg_wm_base_interface,
-                    XDG_SHELL_VERSION, compositor, bind_xdg_shell);
   wl_list_init (&priv->shell_resources);
 
   priv->data_device = wakefield_data_device_new (compositor);
+  priv->primary_selection = wakefield_primary_selection_new (compositor);
+  priv->pointer_constraints = wakefield_pointer_constraints_new (compositor);
 
-  wakefield_seat_init (compositor, &priv->seat, priv->wl_display);
+  wakefield_seat_init (compositor, &priv->seat);
   wakefield_output_init (compositor);
 
   wl_list_init (&priv->surfaces);
   wl_list_init (&priv->xdg_surfaces);
   wl_list_init (&priv->xdg_popups);
+  priv->surface_windows = g_hash_table_new (NULL, NULL);
+  g_queue_init (&priv->mapped_surfaces);
 
-  /* Attach the wl_event_loop to ours */
-  priv->wayland_source = wayland_event_source_new (priv->wl_display);
-  g_source_attach (priv->wayland_source, NULL);
+  priv->handoff_source = handoff_source_new (compositor);
+  g_source_attach (priv->handoff_source, NULL);
+}
+
+static void
+wakefield_compositor_set_property (GObject      *object,
+                                   guint         prop_id,
+                                   const GValue *value,
+                                   GParamSpec   *pspec)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  switch (prop_id)
+    {
+    case PROP_SHARED_WITH:
+      {
+        WakefieldCompositor *shared_with = g_value_get_object (value);
+
+        if (shared_with)
+          {
+            WakefieldCompositorPrivate *shared_priv =
+              wakefield_compositor_get_instance_private (shared_with);
+
+            priv->display = wakefield_display_ref (shared_priv->display);
+          }
+      }
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+wakefield_compositor_constructed (GObject *object)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  G_OBJECT_CLASS (wakefield_compositor_parent_class)->constructed (object);
+
+  if (priv->display == NULL)
+    priv->display = wakefield_display_new ();
+
+  priv->wl_display = priv->display->wl_display;
+  priv->display->compositors = g_list_append (priv->display->compositors, compositor);
 }
 
 WakefieldCompositor *
@@ -1797,12 +4418,26 @@ wakefield_compositor_new (void)
   return g_object_new (WAKEFIELD_TYPE_COMPOSITOR, NULL);
 }
 
+/* Creates a compositor serving its clients from the same wl_display,
+   event source and dispatch thread as @compositor. Sockets belong to
+   the display, clients connecting through them go to the first one. */
+WakefieldCompositor *
+wakefield_compositor_new_shared (WakefieldCompositor *compositor)
+{
+  g_return_val_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor), NULL);
+
+  return g_object_new (WAKEFIELD_TYPE_COMPOSITOR,
+                       "shared-with", compositor,
+                       NULL);
+}
+
 gboolean
 wakefield_compositor_add_socket (WakefieldCompositor *compositor,
                                  const char *name,
                                  GError **error)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
 
   if (wl_display_add_socket (priv->wl_display, name) != 0)
     {
@@ -1826,6 +4461,7 @@ wakefield_compositor_add_socket_auto (WakefieldCompositor *compositor,
                                       GError **error)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
   const char *name;
 
   name = wl_display_add_socket_auto (priv->wl_display);
@@ -1846,16 +4482,31 @@ wakefield_compositor_add_socket_auto (WakefieldCompositor *compositor,
 
 typedef struct {
   struct wl_listener listener;
+  WakefieldCompositor *compositor;
   GDestroyNotify destroy_notify;
   gpointer user_data;
 } WakefieldClientDestroyListener;
 
+static void
+client_destroy_notify (WakefieldCompositor *compositor,
+                       gpointer             user_data)
+{
+  WakefieldClientDestroyListener *w_listener = user_data;
+
+  w_listener->destroy_notify (w_listener->user_data);
+}
+
 static void
 client_destroyed (struct wl_listener *listener, void *data)
 {
   WakefieldClientDestroyListener *w_listener = (WakefieldClientDestroyListener *)listener;
 
-  w_listener->destroy_notify (w_listener->user_data);
+  wl_list_remove (&w_listener->listener.link);
+
+  /* The embedder is most likely going to touch GTK from here */
+  wakefield_compositor_run_in_main (w_listener->compositor,
+                                    client_destroy_notify,
+                                    w_listener, g_free);
 }
 
 int
@@ -1865,6 +4516,8 @@ wakefield_compositor_create_client_fd (WakefieldCompositor *compositor,
                                        GError **error)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+  WakefieldClient *w_client;
   struct wl_client *client;
   int fds[2];
 
@@ -1881,11 +4534,30 @@ wakefield_compositor_create_client_fd (WakefieldCompositor *compositor,
     }
 
   client = wl_client_create (priv->wl_display, fds[0]);
+  if (client == NULL)
+    {
+      int errsv = errno;
+
+      close (fds[0]);
+      close (fds[1]);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errsv),
+                   _("Error creating wayland client: %s"),
+                   strerror (errsv));
+      return -1;
+    }
+
+  /* The record was created by our client-created listener */
+  w_client = wakefield_client_from_wl_client (client);
+  w_client->compositor = compositor;
+  w_client->user_data = user_data;
 
   if (destroy_notify)
     {
       WakefieldClientDestroyListener *listener = g_new0 (WakefieldClientDestroyListener, 1);
       listener->listener.notify = client_destroyed;
+      listener->compositor = compositor;
       listener->destroy_notify = destroy_notify;
       listener->user_data = user_data;
 
@@ -1901,8 +4573,38 @@ wakefield_compositor_finalize (GObject *object)
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  g_source_destroy (priv->wayland_source);
-  wl_display_destroy (priv->wl_display);
+  /* Our clients go away with us, the display may outlive us */
+  {
+    g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (compositor);
+    WakefieldClient *w_client, *tmp;
+
+    wl_list_for_each_safe (w_client, tmp, &priv->display->clients, link)
+      {
+        if (w_client->compositor == compositor)
+          wl_client_destroy (w_client->client);
+      }
+  }
+
+  priv->display->compositors = g_list_remove (priv->display->compositors, compositor);
+  wakefield_display_unref (priv->display);
+
+  g_source_destroy (priv->handoff_source);
+  g_source_unref (priv->handoff_source);
+
+  g_hash_table_destroy (priv->surface_windows);
+  g_queue_clear (&priv->mapped_surfaces);
+  wakefield_pointer_constraints_free (priv->pointer_constraints);
+  wakefield_data_device_free (priv->data_device);
+  wakefield_primary_selection_free (priv->primary_selection);
+  wakefield_keyboard_finalize (&priv->seat.keyboard);
+  g_hash_table_destroy (priv->seat.touch.points);
+  if (priv->seat.touch.frame_source_id)
+    g_source_remove (priv->seat.touch.frame_source_id);
+
+#if defined(GDK_WINDOWING_X11)
+  if (priv->seat.pointer.raw_motion)
+    gdk_window_remove_filter (NULL, raw_motion_filter, compositor);
+#endif
 
   G_OBJECT_CLASS (wakefield_compositor_parent_class)->finalize (object);
 }
@@ -1914,6 +4616,8 @@ wakefield_compositor_class_init (WakefieldCompositorClass *klass)
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+  gobject_class->constructed = wakefield_compositor_constructed;
+  gobject_class->set_property = wakefield_compositor_set_property;
   gobject_class->finalize = wakefield_compositor_finalize;
 
   widget_class->realize = wakefield_compositor_realize;
@@ -1922,6 +4626,7 @@ wakefield_compositor_class_init (WakefieldCompositorClass *klass)
   widget_class->unmap = wakefield_compositor_unmap;
   widget_class->size_allocate = wakefield_compositor_size_allocate;
   widget_class->draw = wakefield_compositor_draw;
+  widget_class->event = wakefield_compositor_event;
   widget_class->enter_notify_event = wakefield_compositor_enter_notify_event;
   widget_class->leave_notify_event = wakefield_compositor_leave_notify_event;
   widget_class->scroll_event = wakefield_compositor_scroll_event;
@@ -1933,6 +4638,40 @@ wakefield_compositor_class_init (WakefieldCompositorClass *klass)
   widget_class->focus_out_event = wakefield_compositor_focus_out_event;
   widget_class->key_press_event = wakefield_compositor_key_press_event;
   widget_class->key_release_event = wakefield_compositor_key_release_event;
+  widget_class->touch_event = wakefield_compositor_touch_event;
+
+  /* Emitted with the user_data given to wakefield_compositor_create_client_fd()
+     when a client stops reading its events, and again once it catches up.
+     Meanwhile it gets no frame callbacks and its pointer motion is coalesced. */
+  signals[CLIENT_CONGESTED] = g_signal_new ("client-congested",
+                                            G_TYPE_FROM_CLASS (gobject_class),
+                                            G_SIGNAL_RUN_LAST,
+                                            0,
+                                            NULL, NULL, NULL,
+                                            G_TYPE_NONE, 2,
+                                            G_TYPE_POINTER,
+                                            G_TYPE_BOOLEAN);
+
+  /* Same arguments, emitted when a client stops answering pings, and
+     again when it answers. Its surfaces are shown dimmed meanwhile. */
+  signals[CLIENT_UNRESPONSIVE] = g_signal_new ("client-unresponsive",
+                                               G_TYPE_FROM_CLASS (gobject_class),
+                                               G_SIGNAL_RUN_LAST,
+                                               0,
+                                               NULL, NULL, NULL,
+                                               G_TYPE_NONE, 2,
+                                               G_TYPE_POINTER,
+                                               G_TYPE_BOOLEAN);
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_SHARED_WITH,
+                                   g_param_spec_object ("shared-with",
+                                                        "Shared with",
+                                                        "Compositor whose wayland display to share",
+                                                        WAKEFIELD_TYPE_COMPOSITOR,
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_STRINGS));
 }
 
 /* Wayland GSource */
@@ -1940,7 +4679,10 @@ wakefield_compositor_class_init (WakefieldCompositorClass *klass)
 typedef struct
 {
   GSource source;
-  struct wl_display *display;
+  WakefieldDisplay *display;
+  GRecMutex *display_lock;
+  gpointer fd_tag;
+  gboolean yielding;
 } WaylandEventSource;
 
 static gboolean
@@ -1948,9 +4690,33 @@ wayland_event_source_prepare (GSource *base, int *timeout)
 {
   WaylandEventSource *source = (WaylandEventSource *)base;
 
-  *timeout = -1;
+  /* Don't block while we sit out this iteration */
+  *timeout = source->yielding ? 0 : -1;
+
+  if (source->display_lock)
+    g_rec_mutex_lock (source->display_lock);
+
+  wl_display_flush_clients (source->display->wl_display);
+  wakefield_display_account_flush (source->display);
+  wakefield_display_update_congestion (source->display);
+
+  if (source->display_lock)
+    g_rec_mutex_unlock (source->display_lock);
+
+  return FALSE;
+}
+
+static gboolean
+wayland_event_source_check (GSource *base)
+{
+  WaylandEventSource *source = (WaylandEventSource *)base;
 
-  wl_display_flush_clients (source->display);
+  /* We sat out one iteration, start polling the clients again */
+  if (source->yielding)
+    {
+      source->yielding = FALSE;
+      g_source_modify_unix_fd (base, source->fd_tag, G_IO_IN | G_IO_ERR);
+    }
 
   return FALSE;
 }
@@ -1961,9 +4727,31 @@ wayland_event_source_dispatch (GSource *base,
                                void *data)
 {
   WaylandEventSource *source = (WaylandEventSource *)base;
-  struct wl_event_loop *loop = wl_display_get_event_loop (source->display);
+  struct wl_event_loop *loop = wl_display_get_event_loop (source->display->wl_display);
+  gint64 start_time;
+  gboolean over_budget;
 
+  if (source->display_lock)
+    g_rec_mutex_lock (source->display_lock);
+
+  /* Each ready client gets at most one read of its socket per dispatch,
+     so a flooding client can't keep us here, but many of them can */
+  start_time = g_get_monotonic_time ();
   wl_event_loop_dispatch (loop, 0);
+  over_budget =
+    wakefield_display_account_dispatch (source->display,
+                                        g_get_monotonic_time () - start_time);
+
+  if (source->display_lock)
+    g_rec_mutex_unlock (source->display_lock);
+
+  /* Stop polling for one iteration, so that lower priority sources such as
+     GTK input and painting get to run before we dispatch again */
+  if (over_budget)
+    {
+      source->yielding = TRUE;
+      g_source_modify_unix_fd (base, source->fd_tag, 0);
+    }
 
   return TRUE;
 }
@@ -1971,21 +4759,362 @@ wayland_event_source_dispatch (GSource *base,
 static GSourceFuncs wayland_event_source_funcs =
 {
   .prepare = wayland_event_source_prepare,
+  .check = wayland_event_source_check,
   .dispatch = wayland_event_source_dispatch,
 };
 
 static GSource *
-wayland_event_source_new (struct wl_display *display)
+wayland_event_source_new (WakefieldDisplay *display,
+                          GRecMutex        *display_lock)
 {
   WaylandEventSource *source;
-  struct wl_event_loop *loop = wl_display_get_event_loop (display);
+  struct wl_event_loop *loop = wl_display_get_event_loop (display->wl_display);
 
   source = (WaylandEventSource *) g_source_new (&wayland_event_source_funcs,
                                                 sizeof (WaylandEventSource));
   source->display = display;
-  g_source_add_unix_fd (&source->source,
-                        wl_event_loop_get_fd (loop),
-                        G_IO_IN | G_IO_ERR);
+  source->display_lock = display_lock;
+  source->fd_tag = g_source_add_unix_fd (&source->source,
+                                         wl_event_loop_get_fd (loop),
+                                         G_IO_IN | G_IO_ERR);
+
+  return &source->source;
+}
+
+/* Main loop handoff GSource */
+
+typedef struct _WakefieldHandoff WakefieldHandoff;
+
+struct _WakefieldHandoff
+{
+  WakefieldHandoff *next;
+  WakefieldMainFunc func;
+  gpointer user_data;
+  GDestroyNotify destroy;
+};
+
+typedef struct
+{
+  GSource source;
+  WakefieldCompositor *compositor;
+
+  /* Lock-free LIFO, pushed by the dispatch thread and emptied at once by
+     the main thread, so it doesn't suffer from ABA issues */
+  WakefieldHandoff *queue;
+} HandoffSource;
+
+static WakefieldHandoff *
+handoff_source_steal_queue (HandoffSource *source)
+{
+  WakefieldHandoff *queue, *reversed = NULL;
+
+  do
+    queue = g_atomic_pointer_get (&source->queue);
+  while (!g_atomic_pointer_compare_and_exchange (&source->queue, queue, NULL));
+
+  /* Handoffs need to be processed in the order they were pushed */
+  while (queue)
+    {
+      WakefieldHandoff *next = queue->next;
+
+      queue->next = reversed;
+      reversed = queue;
+      queue = next;
+    }
+
+  return reversed;
+}
+
+static void
+handoff_free (WakefieldHandoff *handoff)
+{
+  if (handoff->destroy)
+    handoff->destroy (handoff->user_data);
+
+  g_free (handoff);
+}
+
+static gboolean
+handoff_source_prepare (GSource *base, int *timeout)
+{
+  HandoffSource *source = (HandoffSource *)base;
+
+  *timeout = -1;
+
+  return g_atomic_pointer_get (&source->queue) != NULL;
+}
+
+static gboolean
+handoff_source_check (GSource *base)
+{
+  HandoffSource *source = (HandoffSource *)base;
+
+  return g_atomic_pointer_get (&source->queue) != NULL;
+}
+
+static gboolean
+handoff_source_dispatch (GSource *base,
+                         GSourceFunc callback,
+                         void *data)
+{
+  HandoffSource *source = (HandoffSource *)base;
+  g_autoptr (WakefieldDisplayLocker) locked = wakefield_display_locker (source->compositor);
+  WakefieldHandoff *handoff;
+
+  handoff = handoff_source_steal_queue (source);
+
+  while (handoff)
+    {
+      WakefieldHandoff *next = handoff->next;
+
+      handoff->func (source->compositor, handoff->user_data);
+      handoff_free (handoff);
+      handoff = next;
+    }
+
+  return TRUE;
+}
+
+static void
+handoff_source_finalize (GSource *base)
+{
+  HandoffSource *source = (HandoffSource *)base;
+  WakefieldHandoff *handoff;
+
+  /* Anything not yet run refers to a compositor that is going away */
+  handoff = handoff_source_steal_queue (source);
+
+  while (handoff)
+    {
+      WakefieldHandoff *next = handoff->next;
+
+      handoff_free (handoff);
+      handoff = next;
+    }
+}
+
+static GSourceFuncs handoff_source_funcs =
+{
+  .prepare = handoff_source_prepare,
+  .check = handoff_source_check,
+  .dispatch = handoff_source_dispatch,
+  .finalize = handoff_source_finalize,
+};
+
+static GSource *
+handoff_source_new (WakefieldCompositor *compositor)
+{
+  HandoffSource *source;
+
+  source = (HandoffSource *) g_source_new (&handoff_source_funcs,
+                                           sizeof (HandoffSource));
+  source->compositor = compositor;
 
   return &source->source;
 }
+
+static void
+handoff_source_push (GSource          *base,
+                     WakefieldHandoff *handoff)
+{
+  HandoffSource *source = (HandoffSource *)base;
+
+  do
+    handoff->next = g_atomic_pointer_get (&source->queue);
+  while (!g_atomic_pointer_compare_and_exchange (&source->queue,
+                                                 handoff->next, handoff));
+
+  g_main_context_wakeup (g_source_get_context (base));
+}
+
+gboolean
+wakefield_compositor_is_dispatch_thread (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->display->dispatch_context != NULL &&
+         g_main_context_is_owner (priv->display->dispatch_context);
+}
+
+/* Runs @func right away, unless called from the dispatch thread: then
+   it's queued to the GTK main loop, where it runs under the display lock */
+void
+wakefield_compositor_run_in_main (WakefieldCompositor *compositor,
+                                  WakefieldMainFunc    func,
+                                  gpointer             user_data,
+                                  GDestroyNotify       destroy)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  WakefieldHandoff *handoff;
+
+  if (!wakefield_compositor_is_dispatch_thread (compositor))
+    {
+      func (compositor, user_data);
+
+      if (destroy)
+        destroy (user_data);
+      return;
+    }
+
+  handoff = g_new0 (WakefieldHandoff, 1);
+  handoff->func = func;
+  handoff->user_data = user_data;
+  handoff->destroy = destroy;
+
+  handoff_source_push (priv->handoff_source, handoff);
+}
+
+/* Dispatch thread */
+
+static gpointer
+wayland_dispatch_thread (gpointer data)
+{
+  GMainLoop *loop = data;
+  GMainContext *context = g_main_loop_get_context (loop);
+
+  g_main_context_push_thread_default (context);
+  g_main_loop_run (loop);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static void
+wakefield_display_attach_wayland_source (WakefieldDisplay *display)
+{
+  if (display->wayland_source)
+    {
+      g_source_destroy (display->wayland_source);
+      g_source_unref (display->wayland_source);
+    }
+
+  display->wayland_source =
+    wayland_event_source_new (display,
+                              display->dispatch_context ? &display->display_lock : NULL);
+  g_source_set_priority (display->wayland_source, display->dispatch_priority);
+  g_source_attach (display->wayland_source, display->dispatch_context);
+}
+
+static void
+wakefield_display_start_dispatch_thread (WakefieldDisplay *display)
+{
+  display->dispatch_context = g_main_context_new ();
+  display->dispatch_loop = g_main_loop_new (display->dispatch_context, FALSE);
+  wakefield_display_attach_wayland_source (display);
+
+  display->dispatch_thread = g_thread_new ("wakefield-dispatch",
+                                           wayland_dispatch_thread,
+                                           display->dispatch_loop);
+}
+
+static void
+wakefield_display_stop_dispatch_thread (WakefieldDisplay *display)
+{
+  g_main_loop_quit (display->dispatch_loop);
+  g_thread_join (display->dispatch_thread);
+  display->dispatch_thread = NULL;
+
+  g_clear_pointer (&display->dispatch_loop, g_main_loop_unref);
+  g_clear_pointer (&display->dispatch_context, g_main_context_unref);
+
+  wakefield_display_attach_wayland_source (display);
+}
+
+void
+wakefield_compositor_set_threaded_dispatch (WakefieldCompositor *compositor,
+                                            gboolean             threaded)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  g_return_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor));
+
+  if (!!threaded == wakefield_compositor_get_threaded_dispatch (compositor))
+    return;
+
+  if (threaded)
+    wakefield_display_start_dispatch_thread (priv->display);
+  else
+    wakefield_display_stop_dispatch_thread (priv->display);
+}
+
+gboolean
+wakefield_compositor_get_threaded_dispatch (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  g_return_val_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor), FALSE);
+
+  return priv->display->dispatch_thread != NULL;
+}
+
+void
+wakefield_compositor_set_dispatch_budget (WakefieldCompositor *compositor,
+                                          guint                max_dispatch_us,
+                                          guint                max_client_requests)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_autoptr (WakefieldDisplayLocker) locked = NULL;
+
+  g_return_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor));
+
+  locked = wakefield_display_locker (compositor);
+  priv->display->dispatch_budget_us = max_dispatch_us;
+  priv->display->client_request_budget = max_client_requests;
+  wakefield_display_update_protocol_logger (priv->display);
+}
+
+void
+wakefield_compositor_set_congestion_threshold (WakefieldCompositor *compositor,
+                                               gsize                max_queued_bytes)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_autoptr (WakefieldDisplayLocker) locked = NULL;
+  WakefieldClient *w_client;
+
+  g_return_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor));
+
+  locked = wakefield_display_locker (compositor);
+  priv->display->congestion_threshold = max_queued_bytes;
+
+  /* Without a threshold nobody can be congested */
+  if (max_queued_bytes == 0)
+    {
+      wl_list_for_each (w_client, &priv->display->clients, link)
+        {
+          if (w_client->congested)
+            wakefield_client_set_congested (w_client, FALSE);
+        }
+    }
+}
+
+void
+wakefield_compositor_set_dispatch_priority (WakefieldCompositor *compositor,
+                                            int                  priority)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  g_return_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor));
+
+  priv->display->dispatch_priority = priority;
+  g_source_set_priority (priv->display->wayland_source, priority);
+}
+
+void
+wakefield_compositor_set_motion_mode (WakefieldCompositor *compositor,
+                                      WakefieldMotionMode  mode)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  g_autoptr (WakefieldDisplayLocker) locked = NULL;
+  GHashTableIter iter;
+  gpointer window;
+
+  g_return_if_fail (WAKEFIELD_IS_COMPOSITOR (compositor));
+
+  locked = wakefield_display_locker (compositor);
+  wakefield_compositor_flush_motion (compositor);
+  priv->motion_mode = mode;
+
+  g_hash_table_iter_init (&iter, priv->surface_windows);
+  while (g_hash_table_iter_next (&iter, &window, NULL))
+    gdk_window_set_event_compression (window, mode != WAKEFIELD_MOTION_COALESCE);
+}
@@ -34,7 +34,13 @@ struct _WakefieldCompositorClass
   GtkWidgetClass parent_class;
 };
 
+typedef enum {
+  WAKEFIELD_MOTION_IMMEDIATE,
+  WAKEFIELD_MOTION_COALESCE,
+} WakefieldMotionMode;
+
 WakefieldCompositor *wakefield_compositor_new              (void);
+WakefieldCompositor *wakefield_compositor_new_shared       (WakefieldCompositor *compositor);
 const char *         wakefield_compositor_add_socket_auto  (WakefieldCompositor *compositor,
                                                             GError              **error);
 gboolean             wakefield_compositor_add_socket       (WakefieldCompositor *compositor,
@@ -44,3 +50,15 @@ int                  wakefield_compositor_create_client_fd (WakefieldCompositor
                                                             GDestroyNotify       destroy_notify,
                                                             gpointer             user_data,
                                                             GError             **error);
+void                 wakefield_compositor_set_threaded_dispatch (WakefieldCompositor *compositor,
+                                                                 gboolean             threaded);
+gboolean             wakefield_compositor_get_threaded_dispatch (WakefieldCompositor *compositor);
+void                 wakefield_compositor_set_dispatch_budget   (WakefieldCompositor *compositor,
+                                                                 guint                max_dispatch_us,
+                                                                 guint                max_client_requests);
+void                 wakefield_compositor_set_congestion_threshold (WakefieldCompositor *compositor,
+                                                                    gsize                max_queued_bytes);
+void                 wakefield_compositor_set_dispatch_priority (WakefieldCompositor *compositor,
+                                                                 int                  priority);
+void                 wakefield_compositor_set_motion_mode       (WakefieldCompositor *compositor,
+                                                                 WakefieldMotionMode  mode);
@@ -20,33 +20,1433 @@
  *     Alexander Larsson <alexl@redhat.com>
  */
 
+#include "config.h"
+
 #include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gunixoutputstream.h>
+
+#include "wakefield-private.h"
+#include "xdg-shell-server-protocol.h"
+
+#define TEXT_MIME_TYPE "text/plain;charset=utf-8"
+/* How long the host waits on a client writing the selection */
+#define TRANSFER_TIMEOUT_MS 1000
+
+typedef struct _WakefieldDataSource WakefieldDataSource;
+typedef struct _WakefieldDataOffer WakefieldDataOffer;
+
+typedef struct _WakefieldDataDevice
+{
+  WakefieldCompositor *compositor;
+
+  struct wl_list data_source_resources;
+  struct wl_list manager_resources;
+  struct wl_list device_resources;
+
+  /* The client with the keyboard focus, it gets the selection and is
+     the only one allowed to set it, with serials from after focus_serial */
+  struct wl_client *focus_client;
+  struct wl_listener focus_client_listener;
+  uint32_t focus_serial;
+
+  /* Set by an embedded client, NULL if the host owns the clipboard */
+  WakefieldDataSource *selection;
+  GtkClipboard *clipboard;
+  gboolean claiming_clipboard;
+  /* Mime types of the host clipboard, NULL until known */
+  GPtrArray *host_mime_types;
+  /* Drops replies about older host clipboard contents */
+  guint host_serial;
+
+  /* The drag of an embedded client, with a NULL source it stays within
+     drag_client */
+  gboolean drag_active;
+  WakefieldDataSource *drag_source;
+  struct wl_client *drag_client;
+  GdkDragContext *source_context;
+  gboolean drag_failed;
+  WakefieldSurface *drag_icon;
+  gulong drag_icon_handler;
+  /* Draws drag_icon, GTK keeps it in its icon window for the whole drag */
+  GtkWidget *drag_icon_widget;
+  int drag_icon_hot_x, drag_icon_hot_y;
+
+  /* A GTK drag, ours or the host's, over the widget */
+  GdkDragContext *dest_context;
+  guint32 drag_time;
+  guint drag_leave_id;
+  struct wl_resource *drag_focus;
+  struct wl_listener drag_focus_listener;
+  WakefieldDataOffer *drag_offer;
+  /* HostReads, in gtk_drag_get_data() order */
+  GQueue drag_reads;
+} WakefieldDataDevice;
+
+struct _WakefieldDataSource
+{
+  WakefieldDataDevice *data_device;
+  struct wl_resource *resource;
+  GPtrArray *mime_types;
+  uint32_t dnd_actions;
+  /* WakefieldDataOffers we made for this source */
+  GList *offers;
+};
+
+struct _WakefieldDataOffer
+{
+  WakefieldDataDevice *data_device;
+  struct wl_resource *resource;
+  /* NULL once the source is gone, and for host offers */
+  WakefieldDataSource *source;
+  /* Only for host offers */
+  GPtrArray *host_mime_types;
+
+  /* Only for drags, and then a ref for host drags */
+  GdkDragContext *drag_context;
+  uint32_t host_actions;
+  uint32_t dnd_actions;
+  uint32_t preferred_action;
+  uint32_t action;
+  gboolean accepted;
+  gboolean dropped;
+  gboolean finished;
+};
+
+static void data_device_send_selection (WakefieldDataDevice *data_device);
+static void claim_clipboard (WakefieldCompositor *compositor,
+                             gpointer             user_data);
+
+gboolean
+wakefield_mime_types_contain (GPtrArray  *mime_types,
+                              const char *mime_type,
+                              guint      *index)
+{
+  guint i;
+
+  for (i = 0; i < mime_types->len; i++)
+    {
+      if (strcmp (g_ptr_array_index (mime_types, i), mime_type) == 0)
+        {
+          if (index)
+            *index = i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Host transfers */
+
+GPtrArray *
+wakefield_mime_types_new_for_atoms (GdkAtom *atoms,
+                                    gint     n_atoms)
+{
+  GPtrArray *mime_types = g_ptr_array_new_with_free_func (g_free);
+  int i;
+
+  for (i = 0; i < n_atoms; i++)
+    {
+      g_autofree char *name = gdk_atom_name (atoms[i]);
+
+      /* Skip X11 specific targets like TARGETS or UTF8_STRING */
+      if (strchr (name, '/'))
+        g_ptr_array_add (mime_types, g_steal_pointer (&name));
+    }
+
+  if (n_atoms > 0 && gtk_targets_include_text (atoms, n_atoms))
+    {
+      if (!wakefield_mime_types_contain (mime_types, TEXT_MIME_TYPE, NULL))
+        g_ptr_array_add (mime_types, g_strdup (TEXT_MIME_TYPE));
+      if (!wakefield_mime_types_contain (mime_types, "text/plain", NULL))
+        g_ptr_array_add (mime_types, g_strdup ("text/plain"));
+    }
+
+  return mime_types;
+}
+
+typedef struct
+{
+  GOutputStream *stream;
+  GBytes *bytes;
+} HostWrite;
+
+static void
+host_write_done (GObject      *source_object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  HostWrite *write = user_data;
+  g_autoptr (GError) error = NULL;
+
+  if (!g_output_stream_write_all_finish (write->stream, result, NULL, &error) &&
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE))
+    g_debug ("Failed to send the clipboard to a client: %s", error->message);
+
+  g_object_unref (write->stream);
+  g_bytes_unref (write->bytes);
+  g_free (write);
+}
+
+/* Takes ownership of @fd */
+static void
+host_write_bytes (int     fd,
+                  GBytes *bytes)
+{
+  HostWrite *write;
+
+  if (bytes == NULL)
+    {
+      close (fd);
+      return;
+    }
+
+  /* Don't block the main loop on a client that reads slowly */
+  write = g_new0 (HostWrite, 1);
+  write->stream = g_unix_output_stream_new (fd, TRUE);
+  write->bytes = bytes;
+  g_output_stream_write_all_async (write->stream,
+                                   g_bytes_get_data (bytes, NULL),
+                                   g_bytes_get_size (bytes),
+                                   G_PRIORITY_DEFAULT, NULL,
+                                   host_write_done, write);
+}
+
+typedef struct
+{
+  int fd;
+  /* Whatever text target the host has, sent as UTF-8 */
+  gboolean text;
+} HostRead;
+
+static void
+host_contents_received (GtkClipboard     *clipboard,
+                        GtkSelectionData *selection_data,
+                        gpointer          user_data)
+{
+  HostRead *read = user_data;
+  const guchar *data = gtk_selection_data_get_data (selection_data);
+  gint length = gtk_selection_data_get_length (selection_data);
+
+  host_write_bytes (read->fd, length >= 0 ? g_bytes_new (data, length) : NULL);
+  g_free (read);
+}
+
+static void
+host_text_received (GtkClipboard *clipboard,
+                    const gchar  *text,
+                    gpointer      user_data)
+{
+  HostRead *read = user_data;
+
+  host_write_bytes (read->fd, text ? g_bytes_new (text, strlen (text)) : NULL);
+  g_free (read);
+}
+
+typedef struct
+{
+  char *mime_type;
+  int fd;
+} HostReceive;
+
+static void
+host_receive_free (gpointer data)
+{
+  HostReceive *receive = data;
+
+  if (receive->fd != -1)
+    close (receive->fd);
+  g_free (receive->mime_type);
+  g_free (receive);
+}
+
+/* Writes @mime_type of @clipboard to @fd once the host provides it, takes
+   ownership of @fd */
+void
+wakefield_clipboard_receive (GtkClipboard *clipboard,
+                             const char   *mime_type,
+                             int           fd)
+{
+  HostRead *read;
+
+  read = g_new0 (HostRead, 1);
+  read->fd = fd;
+
+  /* The host may only have text targets like UTF8_STRING, let GTK convert */
+  if (g_str_has_prefix (mime_type, "text/plain"))
+    gtk_clipboard_request_text (clipboard, host_text_received, read);
+  else
+    gtk_clipboard_request_contents (clipboard, gdk_atom_intern (mime_type, FALSE),
+                                    host_contents_received, read);
+}
+
+static void
+host_receive_in_main (WakefieldCompositor *compositor,
+                      gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  HostReceive *receive = user_data;
+
+  wakefield_clipboard_receive (data_device->clipboard, receive->mime_type, receive->fd);
+  receive->fd = -1;
+}
+
+typedef struct
+{
+  WakefieldCompositor *compositor;
+  guint serial;
+} HostTargetsRequest;
+
+static void
+host_targets_received (GtkClipboard *clipboard,
+                       GdkAtom      *atoms,
+                       gint          n_atoms,
+                       gpointer      user_data)
+{
+  HostTargetsRequest *request = user_data;
+  WakefieldCompositor *compositor = request->compositor;
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  GPtrArray *mime_types;
+  WakefieldCompositorLock *locked;
+
+  locked = wakefield_compositor_lock (compositor);
+
+  if (request->serial != data_device->host_serial || data_device->selection)
+    goto out;
+
+  mime_types = wakefield_mime_types_new_for_atoms (atoms, n_atoms);
+
+  g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+  if (mime_types->len > 0)
+    data_device->host_mime_types = mime_types;
+  else
+    g_ptr_array_unref (mime_types);
+
+  data_device_send_selection (data_device);
+
+ out:
+  wakefield_compositor_unlock (locked);
+  g_object_unref (compositor);
+  g_free (request);
+}
+
+static void
+request_host_targets (WakefieldDataDevice *data_device)
+{
+  HostTargetsRequest *request;
+
+  request = g_new0 (HostTargetsRequest, 1);
+  request->compositor = g_object_ref (data_device->compositor);
+  request->serial = data_device->host_serial;
+
+  /* Only the targets for now, the contents are fetched on paste */
+  gtk_clipboard_request_targets (data_device->clipboard, host_targets_received, request);
+}
+
+static void
+clipboard_owner_changed (GtkClipboard        *clipboard,
+                         GdkEventOwnerChange *event,
+                         WakefieldDataDevice *data_device)
+{
+  WakefieldCompositor *compositor = data_device->compositor;
+  WakefieldCompositorLock *locked;
+
+  if (gtk_clipboard_get_owner (clipboard) == G_OBJECT (compositor))
+    return;
+
+  locked = wakefield_compositor_lock (compositor);
+  data_device->host_serial++;
+  g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+  data_device_send_selection (data_device);
+  wakefield_compositor_unlock (locked);
+
+  request_host_targets (data_device);
+}
+
+/* Reads what a client writes, for the host which wants it right away */
+static GByteArray *
+read_pipe_sync (int fd)
+{
+  GByteArray *array = g_byte_array_new ();
+  guint8 buffer[4096];
+
+  while (TRUE)
+    {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      gssize n_read;
+      int ret;
+
+      ret = poll (&pfd, 1, TRANSFER_TIMEOUT_MS);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        break;
+
+      n_read = read (fd, buffer, sizeof (buffer));
+      if (n_read < 0 && errno == EINTR)
+        continue;
+      if (n_read <= 0)
+        break;
+
+      g_byte_array_append (array, buffer, n_read);
+    }
+
+  return array;
+}
+
+/* Fills @selection_data with what a client writes to @fd as @mime_type,
+   takes ownership of @fd */
+void
+wakefield_selection_data_set_from_pipe (GtkSelectionData *selection_data,
+                                        const char       *mime_type,
+                                        int               fd)
+{
+  g_autoptr (GByteArray) array = NULL;
+
+  /* GTK3 can't provide selections asynchronously */
+  array = read_pipe_sync (fd);
+  close (fd);
+
+  if (strcmp (mime_type, TEXT_MIME_TYPE) == 0 &&
+      gtk_selection_data_get_target (selection_data) != gdk_atom_intern (mime_type, FALSE))
+    gtk_selection_data_set_text (selection_data, (const char *) array->data, array->len);
+  else
+    gtk_selection_data_set (selection_data, gtk_selection_data_get_target (selection_data),
+                            8, array->data, array->len);
+}
+
+/* Fills @selection_data with the @info'th mime type of @source, must be
+   called with @locked held, which this drops while waiting on the client */
+static void
+selection_data_set_from_source (GtkSelectionData        *selection_data,
+                                WakefieldCompositorLock *locked,
+                                WakefieldDataSource     *source,
+                                guint                    info)
+{
+  g_autofree char *mime_type = NULL;
+  int fds[2];
+
+  if (source == NULL || info >= source->mime_types->len ||
+      pipe2 (fds, O_CLOEXEC) < 0)
+    {
+      wakefield_compositor_unlock (locked);
+      return;
+    }
+
+  mime_type = g_strdup (g_ptr_array_index (source->mime_types, info));
+
+  wl_data_source_send_send (source->resource, mime_type, fds[1]);
+  close (fds[1]);
+  wl_client_flush (wl_resource_get_client (source->resource));
+
+  wakefield_compositor_unlock (locked);
+
+  wakefield_selection_data_set_from_pipe (selection_data, mime_type, fds[0]);
+}
+
+static void
+clipboard_get (GtkClipboard     *clipboard,
+               GtkSelectionData *selection_data,
+               guint             info,
+               gpointer          owner)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (owner);
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  WakefieldCompositorLock *locked;
+
+  locked = wakefield_compositor_lock (compositor);
+  selection_data_set_from_source (selection_data, locked, data_device->selection, info);
+}
+
+static void
+clipboard_clear (GtkClipboard *clipboard,
+                 gpointer      owner)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (owner);
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  WakefieldCompositorLock *locked;
+
+  if (data_device->claiming_clipboard)
+    return;
+
+  /* Someone on the host took over the clipboard */
+  locked = wakefield_compositor_lock (compositor);
+  if (data_device->selection)
+    {
+      wl_data_source_send_cancelled (data_device->selection->resource);
+      data_device->selection = NULL;
+    }
+  wakefield_compositor_unlock (locked);
+}
+
+/* Target infos are indices into @mime_types */
+GtkTargetList *
+wakefield_target_list_new_for_mime_types (GPtrArray *mime_types)
+{
+  GtkTargetList *list;
+  guint text_index;
+  guint i;
+
+  list = gtk_target_list_new (NULL, 0);
+  for (i = 0; i < mime_types->len; i++)
+    gtk_target_list_add (list, gdk_atom_intern (g_ptr_array_index (mime_types, i), FALSE), 0, i);
+  if (wakefield_mime_types_contain (mime_types, TEXT_MIME_TYPE, &text_index))
+    gtk_target_list_add_text_targets (list, text_index);
+
+  return list;
+}
+
+static void
+claim_clipboard (WakefieldCompositor *compositor,
+                 gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  WakefieldDataSource *source = data_device->selection;
+  GtkTargetList *list;
+  GtkTargetEntry *targets;
+  gint n_targets;
+
+  if (source == NULL)
+    {
+      if (gtk_clipboard_get_owner (data_device->clipboard) == G_OBJECT (compositor))
+        gtk_clipboard_clear (data_device->clipboard);
+      return;
+    }
+
+  list = wakefield_target_list_new_for_mime_types (source->mime_types);
+  targets = gtk_target_table_new_from_list (list, &n_targets);
+
+  data_device->claiming_clipboard = TRUE;
+  gtk_clipboard_set_with_owner (data_device->clipboard, targets, n_targets,
+                                clipboard_get, clipboard_clear, G_OBJECT (compositor));
+  data_device->claiming_clipboard = FALSE;
+
+  gtk_target_table_free (targets, n_targets);
+  gtk_target_list_unref (list);
+}
+
+/* Drag and drop actions */
+
+static uint32_t
+wl_actions_from_gdk (GdkDragAction actions)
+{
+  uint32_t wl_actions = WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE;
+
+  if (actions & GDK_ACTION_COPY)
+    wl_actions |= WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY;
+  if (actions & GDK_ACTION_MOVE)
+    wl_actions |= WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE;
+  if (actions & GDK_ACTION_ASK)
+    wl_actions |= WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK;
+
+  return wl_actions;
+}
+
+static GdkDragAction
+gdk_actions_from_wl (uint32_t wl_actions)
+{
+  GdkDragAction actions = 0;
+
+  if (wl_actions & WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY)
+    actions |= GDK_ACTION_COPY;
+  if (wl_actions & WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE)
+    actions |= GDK_ACTION_MOVE;
+  if (wl_actions & WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK)
+    actions |= GDK_ACTION_ASK;
+
+  return actions;
+}
+
+#define ALL_DND_ACTIONS (WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY | \
+                         WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE | \
+                         WL_DATA_DEVICE_MANAGER_DND_ACTION_ASK)
+
+static void
+unref_in_main (WakefieldCompositor *compositor,
+               gpointer             user_data)
+{
+  g_object_unref (user_data);
+}
+
+typedef struct
+{
+  GdkDragContext *context;
+  gboolean success;
+  gboolean del;
+} DropFinish;
+
+static void
+drop_finish_free (gpointer data)
+{
+  DropFinish *finish = data;
+
+  g_object_unref (finish->context);
+  g_free (finish);
+}
+
+static void
+drop_finish_in_main (WakefieldCompositor *compositor,
+                     gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  DropFinish *finish = user_data;
+
+  gtk_drag_finish (finish->context, finish->success, finish->del, data_device->drag_time);
+}
+
+static void
+finish_drop (WakefieldDataOffer *offer,
+             gboolean            success)
+{
+  DropFinish *finish;
+
+  offer->finished = TRUE;
+  if (offer->drag_context == NULL)
+    return;
+
+  finish = g_new0 (DropFinish, 1);
+  finish->context = g_object_ref (offer->drag_context);
+  finish->success = success;
+  finish->del = success && offer->action == WL_DATA_DEVICE_MANAGER_DND_ACTION_MOVE;
+  wakefield_compositor_run_in_main (offer->data_device->compositor,
+                                    drop_finish_in_main, finish, drop_finish_free);
+}
+
+/* Tells the GTK drag what would happen on drop */
+static void
+update_drag_status_in_main (WakefieldCompositor *compositor,
+                            gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  WakefieldDataOffer *offer = data_device->drag_offer;
+  GdkDragAction action = 0;
+
+  if (data_device->dest_context == NULL)
+    return;
+
+  if (offer && offer->accepted)
+    action = gdk_actions_from_wl (offer->action);
+  else if (offer == NULL && data_device->drag_focus &&
+           data_device->drag_active && data_device->drag_source == NULL)
+    action = GDK_ACTION_COPY;
+
+  gdk_drag_status (data_device->dest_context, action, data_device->drag_time);
+}
+
+/* Offers */
+
+static uint32_t
+data_offer_get_source_actions (WakefieldDataOffer *offer)
+{
+  if (offer->source)
+    return offer->source->dnd_actions;
+
+  return offer->host_actions;
+}
+
+/* Picks what the drop would do, from what both sides support */
+static void
+data_offer_update_action (WakefieldDataOffer *offer)
+{
+  uint32_t available;
+  uint32_t action = WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE;
+
+  /* Clients before v3 only know about copying */
+  if (wl_resource_get_version (offer->resource) < WL_DATA_OFFER_ACTION_SINCE_VERSION)
+    available = data_offer_get_source_actions (offer) & WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY;
+  else
+    available = data_offer_get_source_actions (offer) & offer->dnd_actions;
+
+  if (available & offer->preferred_action)
+    action = offer->preferred_action;
+  else if (available)
+    action = 1 << (g_bit_nth_lsf (available, -1));
+
+  if (action == offer->action)
+    return;
+
+  offer->action = action;
+
+  if (wl_resource_get_version (offer->resource) >= WL_DATA_OFFER_ACTION_SINCE_VERSION)
+    wl_data_offer_send_action (offer->resource, action);
+  if (offer->source &&
+      wl_resource_get_version (offer->source->resource) >= WL_DATA_SOURCE_ACTION_SINCE_VERSION)
+    wl_data_source_send_action (offer->source->resource, action);
+}
+
+static void
+data_offer_accept (struct wl_client *client,
+                   struct wl_resource *offer_resource,
+                   uint32_t serial,
+                   const char *mime_type)
+{
+  WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+
+  if (offer->drag_context == NULL && offer->data_device->drag_offer != offer)
+    return;
+
+  offer->accepted = mime_type != NULL;
+  if (offer->source)
+    wl_data_source_send_target (offer->source->resource, mime_type);
+
+  wakefield_compositor_run_in_main (offer->data_device->compositor,
+                                    update_drag_status_in_main, NULL, NULL);
+}
+
+typedef struct
+{
+  char *mime_type;
+  int fd;
+  GdkDragContext *context;
+} DragReceive;
+
+static void
+drag_receive_free (gpointer data)
+{
+  DragReceive *receive = data;
+
+  if (receive->fd != -1)
+    close (receive->fd);
+  g_object_unref (receive->context);
+  g_free (receive->mime_type);
+  g_free (receive);
+}
+
+static void
+drag_receive_in_main (WakefieldCompositor *compositor,
+                      gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  DragReceive *receive = user_data;
+  GdkAtom target = gdk_atom_intern (receive->mime_type, FALSE);
+  HostRead *read;
+
+  read = g_new0 (HostRead, 1);
+  read->fd = receive->fd;
+  receive->fd = -1;
+
+  /* The host may only have text targets like UTF8_STRING */
+  if (g_str_has_prefix (receive->mime_type, "text/plain") &&
+      !g_list_find (gdk_drag_context_list_targets (receive->context), target))
+    {
+      target = gdk_atom_intern_static_string ("UTF8_STRING");
+      read->text = TRUE;
+    }
+
+  /* Arrives in drag-data-received, without blocking */
+  g_queue_push_tail (&data_device->drag_reads, read);
+  gtk_drag_get_data (GTK_WIDGET (compositor), receive->context, target, data_device->drag_time);
+}
+
+static void
+data_offer_receive (struct wl_client *client,
+                    struct wl_resource *offer_resource,
+                    const char *mime_type,
+                    int32_t fd)
+{
+  WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+
+  if (offer->source)
+    {
+      /* Between clients the fd just goes through, no copies */
+      wl_data_source_send_send (offer->source->resource, mime_type, fd);
+      close (fd);
+    }
+  else if (offer->host_mime_types && offer->drag_context &&
+           wakefield_mime_types_contain (offer->host_mime_types, mime_type, NULL))
+    {
+      DragReceive *receive = g_new0 (DragReceive, 1);
+
+      receive->mime_type = g_strdup (mime_type);
+      receive->fd = fd;
+      receive->context = g_object_ref (offer->drag_context);
+      wakefield_compositor_run_in_main (offer->data_device->compositor,
+                                        drag_receive_in_main, receive, drag_receive_free);
+    }
+  else if (offer->host_mime_types && wakefield_mime_types_contain (offer->host_mime_types, mime_type, NULL))
+    {
+      HostReceive *receive = g_new0 (HostReceive, 1);
+
+      receive->mime_type = g_strdup (mime_type);
+      receive->fd = fd;
+      wakefield_compositor_run_in_main (offer->data_device->compositor,
+                                        host_receive_in_main, receive, host_receive_free);
+    }
+  else
+    close (fd);
+}
+
+static void
+data_offer_destroy (struct wl_client *client,
+                    struct wl_resource *offer_resource)
+{
+  wl_resource_destroy (offer_resource);
+}
+
+static void
+data_offer_finish (struct wl_client *client,
+                   struct wl_resource *offer_resource)
+{
+  WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+
+  if (!offer->dropped || offer->finished || !offer->accepted ||
+      offer->action == WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE)
+    {
+      wl_resource_post_error (offer_resource, WL_DATA_OFFER_ERROR_INVALID_FINISH,
+                              "The drop isn't finishable");
+      return;
+    }
+
+  finish_drop (offer, TRUE);
+}
+
+static void
+data_offer_set_actions (struct wl_client *client,
+                        struct wl_resource *offer_resource,
+                        uint32_t dnd_actions,
+                        uint32_t preferred_action)
+{
+  WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+
+  if (dnd_actions & ~ALL_DND_ACTIONS)
+    {
+      wl_resource_post_error (offer_resource, WL_DATA_OFFER_ERROR_INVALID_ACTION_MASK,
+                              "Invalid actions mask %x", dnd_actions);
+      return;
+    }
+
+  if (preferred_action & (preferred_action - 1) ||
+      (preferred_action & ~dnd_actions) != 0)
+    {
+      wl_resource_post_error (offer_resource, WL_DATA_OFFER_ERROR_INVALID_ACTION,
+                              "Invalid preferred action %x", preferred_action);
+      return;
+    }
+
+  offer->dnd_actions = dnd_actions;
+  offer->preferred_action = preferred_action;
+  data_offer_update_action (offer);
+
+  wakefield_compositor_run_in_main (offer->data_device->compositor,
+                                    update_drag_status_in_main, NULL, NULL);
+}
+
+static const struct wl_data_offer_interface data_offer_implementation = {
+  data_offer_accept,
+  data_offer_receive,
+  data_offer_destroy,
+  data_offer_finish,
+  data_offer_set_actions,
+};
+
+static void
+data_offer_finalize (struct wl_resource *resource)
+{
+  WakefieldDataOffer *offer = wl_resource_get_user_data (resource);
+  WakefieldDataDevice *data_device = offer->data_device;
+
+  /* Clients before v3 never finish, the drop is done once they let go */
+  if (offer->dropped && !offer->finished)
+    finish_drop (offer, wl_resource_get_version (resource) < WL_DATA_OFFER_FINISH_SINCE_VERSION);
+
+  if (data_device->drag_offer == offer)
+    data_device->drag_offer = NULL;
+
+  if (offer->source)
+    offer->source->offers = g_list_remove (offer->source->offers, offer);
+  if (offer->drag_context)
+    wakefield_compositor_run_in_main (data_device->compositor, unref_in_main,
+                                      offer->drag_context, NULL);
+  g_clear_pointer (&offer->host_mime_types, g_ptr_array_unref);
+  g_free (offer);
+}
+
+/* Offers @source, or else @host_mime_types */
+static WakefieldDataOffer *
+create_data_offer (WakefieldDataDevice *data_device,
+                   struct wl_resource  *device_resource,
+                   WakefieldDataSource *source,
+                   GPtrArray           *host_mime_types)
+{
+  WakefieldDataOffer *offer;
+  GPtrArray *mime_types;
+  guint i;
 
-#include "wakefield-private.h"
-#include "xdg-shell-server-protocol.h"
+  offer = g_new0 (WakefieldDataOffer, 1);
+  offer->data_device = data_device;
+  offer->resource = wl_resource_create (wl_resource_get_client (device_resource),
+                                        &wl_data_offer_interface,
+                                        wl_resource_get_version (device_resource), 0);
+  if (offer->resource == NULL)
+    {
+      g_free (offer);
+      wl_resource_post_no_memory (device_resource);
+      return NULL;
+    }
 
-typedef struct _WakefieldDataDevice
+  wl_resource_set_implementation (offer->resource, &data_offer_implementation,
+                                  offer, data_offer_finalize);
+
+  if (source)
+    {
+      offer->source = source;
+      source->offers = g_list_prepend (source->offers, offer);
+      mime_types = source->mime_types;
+    }
+  else
+    {
+      offer->host_mime_types = g_ptr_array_ref (host_mime_types);
+      mime_types = offer->host_mime_types;
+    }
+
+  wl_data_device_send_data_offer (device_resource, offer->resource);
+  for (i = 0; i < mime_types->len; i++)
+    wl_data_offer_send_offer (offer->resource, g_ptr_array_index (mime_types, i));
+
+  return offer;
+}
+
+static void
+data_device_send_selection (WakefieldDataDevice *data_device)
 {
-  WakefieldCompositor *compositor;
+  struct wl_resource *device_resource;
+  WakefieldDataOffer *offer = NULL;
 
-  struct wl_list data_source_resources;
-  struct wl_list manager_resources;
-  struct wl_list device_resources;
-} WakefieldDataDevice;
+  if (data_device->focus_client == NULL)
+    return;
+
+  device_resource = wakefield_client_lookup_resource (data_device->focus_client,
+                                                      WAKEFIELD_CLIENT_DATA_DEVICE,
+                                                      &data_device->device_resources);
+  if (device_resource == NULL)
+    return;
+
+  if (data_device->selection)
+    offer = create_data_offer (data_device, device_resource, data_device->selection, NULL);
+  else if (data_device->host_mime_types)
+    offer = create_data_offer (data_device, device_resource, NULL, data_device->host_mime_types);
 
-typedef struct _WakefieldDataSource
+  wl_data_device_send_selection (device_resource, offer ? offer->resource : NULL);
+}
+
+static void
+focus_client_destroyed (struct wl_listener *listener,
+                        void               *data)
 {
-  WakefieldDataDevice *data_device;
-  struct wl_resource *resource;
-} WakefieldDataSource;
+  WakefieldDataDevice *data_device = wl_container_of (listener, data_device, focus_client_listener);
+
+  wl_list_remove (&data_device->focus_client_listener.link);
+  data_device->focus_client = NULL;
+}
+
+void
+wakefield_data_device_set_focus (WakefieldDataDevice *data_device,
+                                 struct wl_client    *client)
+{
+  if (data_device->focus_client == client)
+    return;
+
+  if (data_device->focus_client)
+    wl_list_remove (&data_device->focus_client_listener.link);
+
+  data_device->focus_client = client;
+  data_device->focus_serial =
+    wl_display_get_serial (wakefield_compositor_get_display (data_device->compositor));
+
+  if (client)
+    {
+      wl_client_add_destroy_listener (client, &data_device->focus_client_listener);
+      data_device_send_selection (data_device);
+    }
+}
+
+/* Drag destination, for any GTK drag over the widget */
+
+static struct wl_resource *
+drag_focus_get_device (WakefieldDataDevice *data_device)
+{
+  if (data_device->drag_focus == NULL)
+    return NULL;
+
+  return wakefield_client_lookup_resource (wl_resource_get_client (data_device->drag_focus),
+                                           WAKEFIELD_CLIENT_DATA_DEVICE,
+                                           &data_device->device_resources);
+}
+
+static void
+drag_focus_clear (WakefieldDataDevice *data_device)
+{
+  struct wl_resource *device_resource = drag_focus_get_device (data_device);
+
+  if (data_device->drag_focus == NULL)
+    return;
+
+  if (device_resource)
+    wl_data_device_send_leave (device_resource);
+
+  wl_list_remove (&data_device->drag_focus_listener.link);
+  data_device->drag_focus = NULL;
+  data_device->drag_offer = NULL;
+}
+
+static void
+drag_focus_destroyed (struct wl_listener *listener,
+                      void               *data)
+{
+  WakefieldDataDevice *data_device = wl_container_of (listener, data_device, drag_focus_listener);
+
+  wl_list_remove (&data_device->drag_focus_listener.link);
+  data_device->drag_focus = NULL;
+  data_device->drag_offer = NULL;
+}
+
+static void
+drag_focus_set (WakefieldDataDevice *data_device,
+                struct wl_resource  *surface,
+                double               sx,
+                double               sy)
+{
+  GtkWidget *widget = GTK_WIDGET (data_device->compositor);
+  GdkDragContext *context = data_device->dest_context;
+  struct wl_display *wl_display = wakefield_compositor_get_display (data_device->compositor);
+  struct wl_resource *device_resource;
+  WakefieldDataOffer *offer = NULL;
+
+  data_device->drag_focus = surface;
+  data_device->drag_focus_listener.notify = drag_focus_destroyed;
+  wl_resource_add_destroy_listener (surface, &data_device->drag_focus_listener);
+
+  device_resource = drag_focus_get_device (data_device);
+  if (device_resource == NULL)
+    return;
+
+  if (gtk_drag_get_source_widget (context) == widget && data_device->drag_active)
+    {
+      /* Our own drag, clients talk to its source directly */
+      if (data_device->drag_source)
+        offer = create_data_offer (data_device, device_resource, data_device->drag_source, NULL);
+    }
+  else
+    {
+      g_autoptr (GPtrArray) mime_types = NULL;
+      GList *targets = gdk_drag_context_list_targets (context);
+      g_autofree GdkAtom *atoms = g_new (GdkAtom, g_list_length (targets));
+      GList *l;
+      int n_atoms = 0;
+
+      for (l = targets; l; l = l->next)
+        atoms[n_atoms++] = l->data;
+      mime_types = wakefield_mime_types_new_for_atoms (atoms, n_atoms);
+
+      offer = create_data_offer (data_device, device_resource, NULL, mime_types);
+      if (offer)
+        {
+          offer->drag_context = g_object_ref (context);
+          offer->host_actions = wl_actions_from_gdk (gdk_drag_context_get_actions (context));
+        }
+    }
+
+  if (offer)
+    {
+      if (wl_resource_get_version (offer->resource) >= WL_DATA_OFFER_SOURCE_ACTIONS_SINCE_VERSION)
+        wl_data_offer_send_source_actions (offer->resource, data_offer_get_source_actions (offer));
+      data_offer_update_action (offer);
+    }
+
+  data_device->drag_offer = offer;
+  wl_data_device_send_enter (device_resource, wl_display_next_serial (wl_display),
+                             surface, wl_fixed_from_double (sx), wl_fixed_from_double (sy),
+                             offer ? offer->resource : NULL);
+}
+
+static void
+cancel_drag_leave (WakefieldDataDevice *data_device)
+{
+  if (data_device->drag_leave_id)
+    {
+      g_source_remove (data_device->drag_leave_id);
+      data_device->drag_leave_id = 0;
+    }
+}
+
+static gboolean
+drag_motion (GtkWidget           *widget,
+             GdkDragContext      *context,
+             gint                 x,
+             gint                 y,
+             guint                time,
+             WakefieldDataDevice *data_device)
+{
+  WakefieldCompositor *compositor = data_device->compositor;
+  struct wl_resource *device_resource;
+  struct wl_resource *surface;
+  double sx, sy;
+  WakefieldCompositorLock *locked;
+
+  cancel_drag_leave (data_device);
+
+  locked = wakefield_compositor_lock (compositor);
+
+  if (data_device->dest_context != context)
+    {
+      drag_focus_clear (data_device);
+      g_set_object (&data_device->dest_context, context);
+    }
+  data_device->drag_time = time;
+
+  surface = wakefield_compositor_get_surface_at (compositor, x, y, &sx, &sy);
+
+  /* Drags without a source stay within their client */
+  if (surface && gtk_drag_get_source_widget (context) == widget &&
+      data_device->drag_active && data_device->drag_source == NULL &&
+      wl_resource_get_client (surface) != data_device->drag_client)
+    surface = NULL;
+
+  if (surface != data_device->drag_focus)
+    {
+      drag_focus_clear (data_device);
+      if (surface)
+        drag_focus_set (data_device, surface, sx, sy);
+    }
+  else if (surface && (device_resource = drag_focus_get_device (data_device)))
+    wl_data_device_send_motion (device_resource, time,
+                                wl_fixed_from_double (sx), wl_fixed_from_double (sy));
+
+  update_drag_status_in_main (compositor, NULL);
+
+  wakefield_compositor_unlock (locked);
+
+  return TRUE;
+}
+
+static gboolean
+drag_leave_idle (gpointer user_data)
+{
+  WakefieldDataDevice *data_device = user_data;
+  WakefieldCompositorLock *locked;
+
+  data_device->drag_leave_id = 0;
+
+  locked = wakefield_compositor_lock (data_device->compositor);
+  drag_focus_clear (data_device);
+  g_clear_object (&data_device->dest_context);
+  wakefield_compositor_unlock (locked);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+drag_leave (GtkWidget           *widget,
+            GdkDragContext      *context,
+            guint                time,
+            WakefieldDataDevice *data_device)
+{
+  /* GTK emits this right before drag-drop as well */
+  if (data_device->drag_leave_id == 0)
+    data_device->drag_leave_id = g_idle_add (drag_leave_idle, data_device);
+}
+
+static gboolean
+drag_drop (GtkWidget           *widget,
+           GdkDragContext      *context,
+           gint                 x,
+           gint                 y,
+           guint                time,
+           WakefieldDataDevice *data_device)
+{
+  WakefieldCompositor *compositor = data_device->compositor;
+  struct wl_resource *device_resource;
+  WakefieldDataOffer *offer;
+  WakefieldCompositorLock *locked;
+
+  cancel_drag_leave (data_device);
+
+  locked = wakefield_compositor_lock (compositor);
+
+  data_device->drag_time = time;
+  device_resource = drag_focus_get_device (data_device);
+  offer = data_device->drag_offer;
+
+  if (device_resource && offer && offer->accepted &&
+      offer->action != WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE)
+    {
+      /* Finished once the client read what it wanted */
+      offer->dropped = TRUE;
+      if (offer->drag_context == NULL)
+        offer->drag_context = g_object_ref (context);
+      wl_data_device_send_drop (device_resource);
+    }
+  else if (device_resource && offer == NULL &&
+           data_device->drag_active && data_device->drag_source == NULL)
+    {
+      wl_data_device_send_drop (device_resource);
+      gtk_drag_finish (context, TRUE, FALSE, time);
+    }
+  else
+    gtk_drag_finish (context, FALSE, FALSE, time);
+
+  drag_focus_clear (data_device);
+  g_clear_object (&data_device->dest_context);
+
+  wakefield_compositor_unlock (locked);
+
+  return TRUE;
+}
+
+static void
+drag_data_received (GtkWidget           *widget,
+                    GdkDragContext      *context,
+                    gint                 x,
+                    gint                 y,
+                    GtkSelectionData    *selection_data,
+                    guint                info,
+                    guint                time,
+                    WakefieldDataDevice *data_device)
+{
+  HostRead *read = g_queue_pop_head (&data_device->drag_reads);
+  const guchar *data = gtk_selection_data_get_data (selection_data);
+  gint length = gtk_selection_data_get_length (selection_data);
+
+  if (read == NULL)
+    return;
+
+  if (read->text)
+    {
+      g_autofree char *text = (char *) gtk_selection_data_get_text (selection_data);
+
+      host_write_bytes (read->fd, text ? g_bytes_new (text, strlen (text)) : NULL);
+    }
+  else
+    host_write_bytes (read->fd, length >= 0 ? g_bytes_new (data, length) : NULL);
+
+  g_free (read);
+}
+
+/* Drag source, for drags of embedded clients */
+
+static gboolean
+drag_icon_draw (GtkWidget           *widget,
+                cairo_t             *cr,
+                WakefieldDataDevice *data_device)
+{
+  WakefieldCompositorLock *locked;
+  struct wl_resource *surface_resource;
+
+  locked = wakefield_compositor_lock (data_device->compositor);
+  surface_resource = data_device->drag_icon ?
+    wakefield_surface_get_resource (data_device->drag_icon) : NULL;
+  if (surface_resource)
+    wakefield_surface_draw (surface_resource, cr);
+  wakefield_compositor_unlock (locked);
+
+  return TRUE;
+}
+
+static void
+drag_icon_committed (WakefieldSurface    *surface,
+                     WakefieldDataDevice *data_device)
+{
+  int width, height, offset_x, offset_y;
+
+  if (data_device->source_context == NULL || data_device->drag_icon_widget == NULL)
+    return;
+
+  wakefield_surface_get_size (surface, &width, &height);
+  gtk_widget_set_size_request (data_device->drag_icon_widget, width, height);
+
+  /* The attach offsets move the icon away from the pointer, GTK moves
+     its window around by itself otherwise */
+  wakefield_surface_get_offset (surface, &offset_x, &offset_y);
+  if (-offset_x != data_device->drag_icon_hot_x || -offset_y != data_device->drag_icon_hot_y)
+    {
+      data_device->drag_icon_hot_x = -offset_x;
+      data_device->drag_icon_hot_y = -offset_y;
+      gtk_drag_set_icon_widget (data_device->source_context, data_device->drag_icon_widget,
+                                data_device->drag_icon_hot_x, data_device->drag_icon_hot_y);
+    }
+
+  gtk_widget_queue_draw (data_device->drag_icon_widget);
+}
+
+static void
+drag_source_clear (WakefieldDataDevice *data_device)
+{
+  data_device->drag_active = FALSE;
+  data_device->drag_source = NULL;
+  data_device->drag_client = NULL;
+
+  if (data_device->drag_icon)
+    {
+      g_signal_handler_disconnect (data_device->drag_icon, data_device->drag_icon_handler);
+      data_device->drag_icon_handler = 0;
+      g_clear_object (&data_device->drag_icon);
+    }
+  if (data_device->drag_icon_widget)
+    {
+      gtk_widget_destroy (data_device->drag_icon_widget);
+      g_clear_object (&data_device->drag_icon_widget);
+    }
+  g_clear_object (&data_device->source_context);
+}
+
+static const GtkTargetEntry local_drag_target = {
+  (char *) "application/x-wakefield-local-drag", GTK_TARGET_SAME_WIDGET, 0
+};
+
+static void
+begin_drag_in_main (WakefieldCompositor *compositor,
+                    gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+  WakefieldSurface *icon = user_data;
+  WakefieldDataSource *source = data_device->drag_source;
+  GtkTargetList *list;
+  GdkDragAction actions;
+  GdkDragContext *context;
+
+  /* The source may be gone already */
+  if (!data_device->drag_active)
+    return;
+
+  if (source)
+    {
+      list = wakefield_target_list_new_for_mime_types (source->mime_types);
+      actions = gdk_actions_from_wl (source->dnd_actions);
+    }
+  else
+    {
+      list = gtk_target_list_new (&local_drag_target, 1);
+      actions = GDK_ACTION_COPY;
+    }
+
+  wakefield_compositor_drag_started (compositor);
+
+  context = gtk_drag_begin_with_coordinates (GTK_WIDGET (compositor), list,
+                                             actions ? actions : GDK_ACTION_COPY,
+                                             GDK_BUTTON_PRIMARY, NULL, -1, -1);
+  gtk_target_list_unref (list);
+
+  if (context == NULL)
+    {
+      if (source)
+        wl_data_source_send_cancelled (source->resource);
+      drag_source_clear (data_device);
+      return;
+    }
+
+  data_device->source_context = g_object_ref (context);
+  data_device->drag_failed = FALSE;
+
+  if (icon && wakefield_surface_get_resource (icon) != NULL)
+    {
+      int width, height, offset_x, offset_y;
+
+      data_device->drag_icon = g_object_ref (icon);
+      data_device->drag_icon_handler =
+        g_signal_connect (icon, "committed", G_CALLBACK (drag_icon_committed), data_device);
+
+      /* Set once, commits only resize and redraw it */
+      data_device->drag_icon_widget = g_object_ref_sink (gtk_drawing_area_new ());
+      g_signal_connect (data_device->drag_icon_widget, "draw",
+                        G_CALLBACK (drag_icon_draw), data_device);
+      wakefield_surface_get_size (icon, &width, &height);
+      gtk_widget_set_size_request (data_device->drag_icon_widget, width, height);
+      gtk_widget_show (data_device->drag_icon_widget);
+
+      wakefield_surface_get_offset (icon, &offset_x, &offset_y);
+      data_device->drag_icon_hot_x = -offset_x;
+      data_device->drag_icon_hot_y = -offset_y;
+      gtk_drag_set_icon_widget (context, data_device->drag_icon_widget,
+                                data_device->drag_icon_hot_x, data_device->drag_icon_hot_y);
+    }
+  else
+    gtk_drag_set_icon_default (context);
+}
+
+static void
+cancel_drag_in_main (WakefieldCompositor *compositor,
+                     gpointer             user_data)
+{
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
+
+  if (data_device->source_context)
+    gtk_drag_cancel (data_device->source_context);
+}
+
+static void
+drag_data_get (GtkWidget           *widget,
+               GdkDragContext      *context,
+               GtkSelectionData    *selection_data,
+               guint                info,
+               guint                time,
+               WakefieldDataDevice *data_device)
+{
+  WakefieldCompositorLock *locked;
+
+  if (context != data_device->source_context)
+    return;
+
+  locked = wakefield_compositor_lock (data_device->compositor);
+  selection_data_set_from_source (selection_data, locked,
+                                  data_device->drag_source, info);
+}
+
+static gboolean
+drag_failed (GtkWidget           *widget,
+             GdkDragContext      *context,
+             GtkDragResult        result,
+             WakefieldDataDevice *data_device)
+{
+  if (context == data_device->source_context)
+    data_device->drag_failed = TRUE;
+
+  return FALSE;
+}
+
+static void
+drag_end (GtkWidget           *widget,
+          GdkDragContext      *context,
+          WakefieldDataDevice *data_device)
+{
+  WakefieldDataSource *source = data_device->drag_source;
+  WakefieldCompositorLock *locked;
+
+  if (context != data_device->source_context)
+    return;
+
+  locked = wakefield_compositor_lock (data_device->compositor);
+
+  if (source && data_device->drag_failed)
+    wl_data_source_send_cancelled (source->resource);
+  else if (source &&
+           wl_resource_get_version (source->resource) >= WL_DATA_SOURCE_DND_FINISHED_SINCE_VERSION)
+    {
+      wl_data_source_send_dnd_drop_performed (source->resource);
+      wl_data_source_send_dnd_finished (source->resource);
+    }
+
+  drag_source_clear (data_device);
+
+  wakefield_compositor_unlock (locked);
+}
+
+/* Sources */
 
 static void
 data_source_offer (struct wl_client *client,
                    struct wl_resource *source_resource,
                    const char *type)
 {
-  wl_resource_post_error (source_resource, 1,
-                          "data-source:: offer not implemented yet.");
+  WakefieldDataSource *data_source = wl_resource_get_user_data (source_resource);
+
+  if (!wakefield_mime_types_contain (data_source->mime_types, type, NULL))
+    g_ptr_array_add (data_source->mime_types, g_strdup (type));
 }
 
 
@@ -61,8 +1461,16 @@ data_source_set_actions (struct wl_client *client,
                          struct wl_resource *source_resource,
                          uint32_t dnd_actions)
 {
-  wl_resource_post_error (source_resource, 1,
-                          "data-source:: set_actions not implemented yet.");
+  WakefieldDataSource *data_source = wl_resource_get_user_data (source_resource);
+
+  if (dnd_actions & ~ALL_DND_ACTIONS)
+    {
+      wl_resource_post_error (source_resource, WL_DATA_SOURCE_ERROR_INVALID_ACTION_MASK,
+                              "Invalid actions mask %x", dnd_actions);
+      return;
+    }
+
+  data_source->dnd_actions = dnd_actions;
 }
 
 static struct wl_data_source_interface data_source_implementation = {
@@ -75,8 +1483,32 @@ static void
 data_source_finalize (struct wl_resource *resource)
 {
   WakefieldDataSource *data_source = wl_resource_get_user_data (resource);
+  WakefieldDataDevice *data_device = data_source->data_device;
+  GList *l;
+
+  for (l = data_source->offers; l; l = l->next)
+    {
+      WakefieldDataOffer *offer = l->data;
+      offer->source = NULL;
+    }
+  g_list_free (data_source->offers);
+
+  if (data_device->drag_source == data_source)
+    {
+      data_device->drag_source = NULL;
+      data_device->drag_active = FALSE;
+      wakefield_compositor_run_in_main (data_device->compositor, cancel_drag_in_main, NULL, NULL);
+    }
+
+  if (data_device->selection == data_source)
+    {
+      data_device->selection = NULL;
+      data_device_send_selection (data_device);
+      wakefield_compositor_run_in_main (data_device->compositor, claim_clipboard, NULL, NULL);
+    }
 
   wl_list_remove (wl_resource_get_link (resource));
+  g_ptr_array_unref (data_source->mime_types);
   g_free (data_source);
 }
 
@@ -91,8 +1523,12 @@ create_data_source (struct wl_client *client,
 
   data_source = g_new0 (WakefieldDataSource, 1);
   data_source->data_device = data_device;
+  data_source->mime_types = g_ptr_array_new_with_free_func (g_free);
+  /* Sources before v3 can't tell, and only copy */
+  data_source->dnd_actions = WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY;
 
-  data_source->resource = wl_resource_create (client, &wl_data_source_interface, 1, id);
+  data_source->resource = wl_resource_create (client, &wl_data_source_interface,
+                                              wl_resource_get_version (manager_resource), id);
   wl_resource_set_implementation (data_source->resource, &data_source_implementation,
                                   data_source, data_source_finalize);
   wl_list_insert (&data_device->data_source_resources,
@@ -107,8 +1543,33 @@ data_device_start_drag (struct wl_client *client,
                         struct wl_resource *icon_resource,
                         uint32_t serial)
 {
-  wl_resource_post_error (device_resource, 1,
-                          "data-device:: start_drag not implemented yet.");
+  WakefieldDataDevice *data_device = wl_resource_get_user_data (device_resource);
+  WakefieldSurface *icon = NULL;
+
+  if (data_device->drag_active || data_device->source_context)
+    return;
+
+  if (icon_resource)
+    {
+      WakefieldSurfaceRole role = wakefield_surface_get_role (icon_resource);
+
+      if (role != WAKEFIELD_SURFACE_ROLE_NONE && role != WAKEFIELD_SURFACE_ROLE_DND_ICON)
+        {
+          wl_resource_post_error (device_resource, WL_DATA_DEVICE_ERROR_ROLE,
+                                  "The icon surface already has a role");
+          return;
+        }
+
+      wakefield_surface_set_role (icon_resource, WAKEFIELD_SURFACE_ROLE_DND_ICON);
+      icon = g_object_ref (wl_resource_get_user_data (icon_resource));
+    }
+
+  data_device->drag_active = TRUE;
+  data_device->drag_source = source_resource ? wl_resource_get_user_data (source_resource) : NULL;
+  data_device->drag_client = client;
+
+  wakefield_compositor_run_in_main (data_device->compositor, begin_drag_in_main,
+                                    icon, icon ? g_object_unref : NULL);
 }
 
 static void
@@ -117,8 +1578,36 @@ data_device_set_selection (struct wl_client *client,
                            struct wl_resource *source_resource,
                            uint32_t serial)
 {
-  wl_resource_post_error (device_resource, 1,
-                          "data-device:: set_selection not implemented yet.");
+  WakefieldDataDevice *data_device = wl_resource_get_user_data (device_resource);
+  WakefieldDataSource *source = source_resource ? wl_resource_get_user_data (source_resource) : NULL;
+  struct wl_display *wl_display = wakefield_compositor_get_display (data_device->compositor);
+
+  if (data_device->selection == source)
+    return;
+
+  /* Background clients don't get to replace the host clipboard, nor
+     the focused one with a serial from before it got the focus */
+  if (client != data_device->focus_client ||
+      (int32_t) (serial - data_device->focus_serial) <= 0 ||
+      (int32_t) (serial - wl_display_get_serial (wl_display)) > 0)
+    {
+      if (source)
+        wl_data_source_send_cancelled (source->resource);
+      return;
+    }
+
+  if (data_device->selection)
+    wl_data_source_send_cancelled (data_device->selection->resource);
+
+  data_device->selection = source;
+  if (source)
+    {
+      data_device->host_serial++;
+      g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+    }
+
+  data_device_send_selection (data_device);
+  wakefield_compositor_run_in_main (data_device->compositor, claim_clipboard, NULL, NULL);
 }
 
 static void
@@ -137,7 +1626,11 @@ static const struct wl_data_device_interface data_device_implementation = {
 static void
 data_device_finalize (struct wl_resource *resource)
 {
+  WakefieldDataDevice *data_device = wl_resource_get_user_data (resource);
+
   wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_DATA_DEVICE,
+                                     &data_device->device_resources);
 }
 
 static void
@@ -161,6 +1654,10 @@ get_data_device (struct wl_client *client,
                   wl_resource_get_link (device_resource));
   wl_resource_set_implementation (device_resource, &data_device_implementation,
                                   data_device, data_device_finalize);
+  wakefield_client_cache_resource (device_resource, WAKEFIELD_CLIENT_DATA_DEVICE);
+
+  if (client == data_device->focus_client)
+    data_device_send_selection (data_device);
 }
 
 static const struct wl_data_device_manager_interface manager_implementation = {
@@ -180,7 +1677,8 @@ bind_data_device_manager (struct wl_client *client,
                           uint32_t version,
                           uint32_t id)
 {
-  WakefieldDataDevice *data_device = data;
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
+  WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
   struct wl_resource *manager_resource;
 
   manager_resource = wl_resource_create (client, &wl_data_device_manager_interface, version, id);
@@ -195,7 +1693,7 @@ bind_data_device_manager (struct wl_client *client,
                   wl_resource_get_link (manager_resource));
 }
 
-#define DATA_DEVICE_MANAGER_VERSION 2
+#define DATA_DEVICE_MANAGER_VERSION 3
 
 WakefieldDataDevice *
 wakefield_data_device_new (WakefieldCompositor *compositor)
@@ -208,9 +1706,57 @@ wakefield_data_device_new (WakefieldCompositor *compositor)
   wl_list_init (&data_device->manager_resources);
   wl_list_init (&data_device->data_source_resources);
   wl_list_init (&data_device->device_resources);
+  data_device->focus_client_listener.notify = focus_client_destroyed;
+
+  data_device->clipboard = gtk_widget_get_clipboard (GTK_WIDGET (compositor),
+                                                     GDK_SELECTION_CLIPBOARD);
+  g_signal_connect (data_device->clipboard, "owner-change",
+                    G_CALLBACK (clipboard_owner_changed), data_device);
+  /* Pick up what the host clipboard has already */
+  request_host_targets (data_device);
 
-  wl_global_create (wakefield_compositor_get_display (compositor), &wl_data_device_manager_interface, DATA_DEVICE_MANAGER_VERSION,
-                    data_device, bind_data_device_manager);
+  g_queue_init (&data_device->drag_reads);
+  gtk_drag_dest_set (GTK_WIDGET (compositor), 0, NULL, 0,
+                     GDK_ACTION_COPY | GDK_ACTION_MOVE | GDK_ACTION_ASK);
+  g_signal_connect (compositor, "drag-motion", G_CALLBACK (drag_motion), data_device);
+  g_signal_connect (compositor, "drag-leave", G_CALLBACK (drag_leave), data_device);
+  g_signal_connect (compositor, "drag-drop", G_CALLBACK (drag_drop), data_device);
+  g_signal_connect (compositor, "drag-data-received", G_CALLBACK (drag_data_received), data_device);
+  g_signal_connect (compositor, "drag-data-get", G_CALLBACK (drag_data_get), data_device);
+  g_signal_connect (compositor, "drag-failed", G_CALLBACK (drag_failed), data_device);
+  g_signal_connect (compositor, "drag-end", G_CALLBACK (drag_end), data_device);
 
   return data_device;
 }
+
+void
+wakefield_data_device_free (WakefieldDataDevice *data_device)
+{
+  HostRead *read;
+
+  g_signal_handlers_disconnect_by_data (data_device->clipboard, data_device);
+  g_signal_handlers_disconnect_by_data (data_device->compositor, data_device);
+  cancel_drag_leave (data_device);
+  if (data_device->focus_client)
+    wl_list_remove (&data_device->focus_client_listener.link);
+  if (data_device->drag_focus)
+    wl_list_remove (&data_device->drag_focus_listener.link);
+
+  while ((read = g_queue_pop_head (&data_device->drag_reads)))
+    {
+      close (read->fd);
+      g_free (read);
+    }
+  drag_source_clear (data_device);
+  g_clear_object (&data_device->dest_context);
+  g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+  g_free (data_device);
+}
+
+/* One global per display, binds go to the data device of the client's compositor */
+void
+wakefield_data_device_manager_init (struct wl_display *wl_display)
+{
+  wl_global_create (wl_display, &wl_data_device_manager_interface, DATA_DEVICE_MANAGER_VERSION,
+                    NULL, bind_data_device_manager);
+}
@@ -0,0 +1,631 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <math.h>
+
+#include "wakefield-private.h"
+#include "pointer-constraints-unstable-v1-server-protocol.h"
+
+typedef struct _WakefieldPointerConstraint WakefieldPointerConstraint;
+
+struct _WakefieldPointerConstraints
+{
+  WakefieldCompositor *compositor;
+
+  struct wl_list constraints;
+  WakefieldPointerConstraint *active;
+};
+
+struct _WakefieldPointerConstraint
+{
+  WakefieldPointerConstraints *constraints;
+  struct wl_resource *resource;
+  struct wl_list link;
+
+  /* NULL once the wl_surface is destroyed, the constraint is inert then */
+  struct wl_resource *surface_resource;
+  struct wl_listener surface_destroy_listener;
+  gulong surface_committed_handler;
+
+  gboolean locked;
+  uint32_t lifetime;
+  /* A oneshot constraint that got deactivated never activates again */
+  gboolean defunct;
+
+  /* NULL means the whole surface */
+  cairo_region_t *region;
+  cairo_region_t *pending_region;
+  gboolean has_pending_region;
+
+  gboolean has_hint;
+  double hint_x;
+  double hint_y;
+  gboolean has_pending_hint;
+  double pending_hint_x;
+  double pending_hint_y;
+
+  /* Valid while active, in root coordinates */
+  GdkDevice *device;
+  int lock_x;
+  int lock_y;
+};
+
+#define CONSTRAINT_EVENT_MASK (GDK_POINTER_MOTION_MASK | \
+                               GDK_BUTTON_PRESS_MASK | \
+                               GDK_BUTTON_RELEASE_MASK | \
+                               GDK_SCROLL_MASK | \
+                               GDK_SMOOTH_SCROLL_MASK | \
+                               GDK_ENTER_NOTIFY_MASK | \
+                               GDK_LEAVE_NOTIFY_MASK)
+
+typedef struct
+{
+  GdkDevice *device;
+  GdkWindow *window;
+  gboolean warp;
+  double x;
+  double y;
+} WakefieldConstraintRelease;
+
+static void
+constraint_release_free (gpointer user_data)
+{
+  WakefieldConstraintRelease *release = user_data;
+
+  g_object_unref (release->device);
+  g_clear_object (&release->window);
+  g_free (release);
+}
+
+static void
+constraint_release_in_main (WakefieldCompositor *compositor,
+                            gpointer             user_data)
+{
+  WakefieldConstraintRelease *release = user_data;
+  int x, y;
+
+  gdk_device_ungrab (release->device, GDK_CURRENT_TIME);
+
+  /* Let the pointer show up where the client drew its own cursor */
+  if (release->warp && !gdk_window_is_destroyed (release->window))
+    {
+      gdk_window_get_origin (release->window, &x, &y);
+      wakefield_compositor_warp_pointer (compositor, release->device,
+                                         gdk_window_get_screen (release->window),
+                                         x + (int) round (release->x),
+                                         y + (int) round (release->y));
+    }
+}
+
+static void
+constraint_deactivate (WakefieldPointerConstraint *constraint,
+                       gboolean                    notify)
+{
+  WakefieldPointerConstraints *constraints = constraint->constraints;
+  WakefieldConstraintRelease *release;
+  GdkWindow *window = NULL;
+
+  if (constraints->active != constraint)
+    return;
+
+  constraints->active = NULL;
+
+  if (constraint->surface_resource)
+    window = wakefield_surface_get_window (constraint->surface_resource);
+
+  release = g_new0 (WakefieldConstraintRelease, 1);
+  release->device = g_steal_pointer (&constraint->device);
+  release->window = window ? g_object_ref (window) : NULL;
+  release->warp = window && constraint->locked && constraint->has_hint;
+  release->x = constraint->hint_x;
+  release->y = constraint->hint_y;
+
+  /* We may be in the dispatch thread, GDK calls happen in the main one */
+  wakefield_compositor_run_in_main (constraints->compositor,
+                                    constraint_release_in_main,
+                                    release, constraint_release_free);
+
+  if (!notify)
+    return;
+
+  if (constraint->locked)
+    zwp_locked_pointer_v1_send_unlocked (constraint->resource);
+  else
+    zwp_confined_pointer_v1_send_unconfined (constraint->resource);
+
+  if (constraint->lifetime == ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_ONESHOT)
+    constraint->defunct = TRUE;
+}
+
+static gboolean
+constraint_region_contains (WakefieldPointerConstraint *constraint,
+                            double                      x,
+                            double                      y)
+{
+  if (constraint->region == NULL)
+    return TRUE;
+
+  return cairo_region_contains_point (constraint->region, floor (x), floor (y));
+}
+
+static gboolean
+constraint_may_activate (WakefieldPointerConstraint *constraint)
+{
+  WakefieldCompositor *compositor = constraint->constraints->compositor;
+
+  if (constraint->defunct || constraint->surface_resource == NULL)
+    return FALSE;
+
+  if (wakefield_compositor_get_pointer_focus (compositor) != constraint->surface_resource)
+    return FALSE;
+
+  /* Don't take the pointer away while the user is busy somewhere else */
+  return gtk_widget_has_focus (GTK_WIDGET (compositor));
+}
+
+/* x and y are relative to the surface */
+static void
+constraint_maybe_activate (WakefieldPointerConstraint *constraint,
+                           GdkDevice                  *device,
+                           double                      x,
+                           double                      y)
+{
+  WakefieldPointerConstraints *constraints = constraint->constraints;
+  GdkWindow *window;
+  GdkCursor *cursor = NULL;
+  GdkGrabStatus status;
+
+  if (constraints->active != NULL ||
+      !constraint_may_activate (constraint) ||
+      !constraint_region_contains (constraint, x, y))
+    return;
+
+  window = wakefield_surface_get_window (constraint->surface_resource);
+  if (window == NULL)
+    return;
+
+  /* The client draws its own cursor, if any, while locked */
+  if (constraint->locked)
+    cursor = gdk_cursor_new_for_display (gdk_window_get_display (window),
+                                         GDK_BLANK_CURSOR);
+
+  /* The grab keeps motion coming when the pointer is about to leave the
+     surface, so that it can be brought back */
+  status = gdk_device_grab (device, window, GDK_OWNERSHIP_NONE, FALSE,
+                            CONSTRAINT_EVENT_MASK, cursor, GDK_CURRENT_TIME);
+  g_clear_object (&cursor);
+
+  if (status != GDK_GRAB_SUCCESS)
+    return;
+
+  constraints->active = constraint;
+  constraint->device = g_object_ref (device);
+  gdk_device_get_position (device, NULL, &constraint->lock_x, &constraint->lock_y);
+
+  if (constraint->locked)
+    zwp_locked_pointer_v1_send_locked (constraint->resource);
+  else
+    zwp_confined_pointer_v1_send_confined (constraint->resource);
+}
+
+static WakefieldPointerConstraint *
+find_constraint (WakefieldPointerConstraints *constraints,
+                 struct wl_resource          *surface_resource)
+{
+  WakefieldPointerConstraint *constraint;
+
+  wl_list_for_each (constraint, &constraints->constraints, link)
+    {
+      if (constraint->surface_resource == surface_resource)
+        return constraint;
+    }
+
+  return NULL;
+}
+
+static void
+update_in_main (WakefieldCompositor *compositor,
+                gpointer             user_data)
+{
+  WakefieldPointerConstraints *constraints = user_data;
+  WakefieldPointerConstraint *constraint;
+  struct wl_resource *surface_resource;
+  GdkWindow *window;
+  GdkDevice *device;
+  double x, y;
+
+  if (constraints->active && !constraint_may_activate (constraints->active))
+    constraint_deactivate (constraints->active, TRUE);
+
+  if (constraints->active)
+    return;
+
+  surface_resource = wakefield_compositor_get_pointer_focus (compositor);
+  if (surface_resource == NULL)
+    return;
+
+  constraint = find_constraint (constraints, surface_resource);
+  window = wakefield_surface_get_window (surface_resource);
+  if (constraint == NULL || window == NULL)
+    return;
+
+  device = gdk_seat_get_pointer (gdk_display_get_default_seat (gdk_window_get_display (window)));
+  gdk_window_get_device_position_double (window, device, &x, &y, NULL);
+
+  constraint_maybe_activate (constraint, device, x, y);
+}
+
+/* Re-evaluates the constraints after the pointer focus, the keyboard
+   focus or the constraints themselves changed */
+void
+wakefield_pointer_constraints_update (WakefieldPointerConstraints *constraints)
+{
+  wakefield_compositor_run_in_main (constraints->compositor, update_in_main,
+                                    constraints, NULL);
+}
+
+static void
+nearest_point_in_rectangle (const cairo_rectangle_int_t *rect,
+                            double                       x,
+                            double                       y,
+                            double                      *nx,
+                            double                      *ny)
+{
+  *nx = CLAMP (x, rect->x, rect->x + rect->width - 1);
+  *ny = CLAMP (y, rect->y, rect->y + rect->height - 1);
+}
+
+/* Returns TRUE when the motion must not reach the client as is */
+gboolean
+wakefield_pointer_constraints_handle_motion (WakefieldPointerConstraints *constraints,
+                                             struct wl_resource          *surface_resource,
+                                             GdkEventMotion              *event)
+{
+  WakefieldPointerConstraint *constraint = constraints->active;
+  cairo_rectangle_int_t bounds = { 0, };
+  cairo_region_t *region;
+  double best_x = 0, best_y = 0, best_distance = G_MAXDOUBLE;
+  int i, n_rects;
+
+  if (constraint == NULL)
+    {
+      constraint = find_constraint (constraints, surface_resource);
+      if (constraint)
+        constraint_maybe_activate (constraint, gdk_event_get_device ((GdkEvent *) event),
+                                   event->x, event->y);
+      return constraints->active && constraints->active->locked;
+    }
+
+  if (constraint->surface_resource != surface_resource)
+    return FALSE;
+
+  /* Only relative motion gets through, and we keep pulling the pointer
+     back so that it doesn't stop at the screen edges */
+  if (constraint->locked)
+    {
+      if ((int) event->x_root != constraint->lock_x ||
+          (int) event->y_root != constraint->lock_y)
+        wakefield_compositor_warp_pointer (constraints->compositor, constraint->device,
+                                           gdk_window_get_screen (event->window),
+                                           constraint->lock_x, constraint->lock_y);
+      return TRUE;
+    }
+
+  bounds.width = gdk_window_get_width (event->window);
+  bounds.height = gdk_window_get_height (event->window);
+
+  if (constraint->region)
+    {
+      region = cairo_region_copy (constraint->region);
+      cairo_region_intersect_rectangle (region, &bounds);
+    }
+  else
+    region = cairo_region_create_rectangle (&bounds);
+
+  if (cairo_region_is_empty (region) ||
+      cairo_region_contains_point (region, floor (event->x), floor (event->y)))
+    {
+      cairo_region_destroy (region);
+      return FALSE;
+    }
+
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++)
+    {
+      cairo_rectangle_int_t rect;
+      double nx, ny, distance;
+
+      cairo_region_get_rectangle (region, i, &rect);
+      nearest_point_in_rectangle (&rect, event->x, event->y, &nx, &ny);
+
+      distance = (nx - event->x) * (nx - event->x) + (ny - event->y) * (ny - event->y);
+      if (distance < best_distance)
+        {
+          best_distance = distance;
+          best_x = nx;
+          best_y = ny;
+        }
+    }
+
+  cairo_region_destroy (region);
+
+  /* The motion event the warp generates is the one the client sees */
+  wakefield_compositor_warp_pointer (constraints->compositor, constraint->device,
+                                     gdk_window_get_screen (event->window),
+                                     round (event->x_root + best_x - event->x),
+                                     round (event->y_root + best_y - event->y));
+
+  return TRUE;
+}
+
+static void
+surface_committed (WakefieldSurface *surface,
+                   gpointer          user_data)
+{
+  WakefieldPointerConstraint *constraint = user_data;
+
+  if (constraint->has_pending_region)
+    {
+      g_clear_pointer (&constraint->region, cairo_region_destroy);
+      constraint->region = g_steal_pointer (&constraint->pending_region);
+      constraint->has_pending_region = FALSE;
+    }
+
+  if (constraint->has_pending_hint)
+    {
+      constraint->hint_x = constraint->pending_hint_x;
+      constraint->hint_y = constraint->pending_hint_y;
+      constraint->has_hint = TRUE;
+      constraint->has_pending_hint = FALSE;
+    }
+
+  /* The new region may now contain the pointer */
+  wakefield_pointer_constraints_update (constraint->constraints);
+}
+
+static void
+constraint_detach_surface (WakefieldPointerConstraint *constraint)
+{
+  WakefieldSurface *surface;
+
+  if (constraint->surface_resource == NULL)
+    return;
+
+  surface = wl_resource_get_user_data (constraint->surface_resource);
+  g_signal_handler_disconnect (surface, constraint->surface_committed_handler);
+  wl_list_remove (&constraint->surface_destroy_listener.link);
+  constraint->surface_resource = NULL;
+}
+
+static void
+constraint_surface_destroyed (struct wl_listener *listener,
+                              void               *data)
+{
+  WakefieldPointerConstraint *constraint =
+    wl_container_of (listener, constraint, surface_destroy_listener);
+
+  constraint_deactivate (constraint, TRUE);
+  constraint_detach_surface (constraint);
+}
+
+static void
+constraint_resource_destroyed (struct wl_resource *resource)
+{
+  WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
+
+  constraint_deactivate (constraint, FALSE);
+  constraint_detach_surface (constraint);
+  wl_list_remove (&constraint->link);
+  g_clear_pointer (&constraint->region, cairo_region_destroy);
+  g_clear_pointer (&constraint->pending_region, cairo_region_destroy);
+  g_free (constraint);
+}
+
+static void
+constraint_destroy (struct wl_client   *client,
+                    struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+constraint_set_region (struct wl_client   *client,
+                       struct wl_resource *resource,
+                       struct wl_resource *region_resource)
+{
+  WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
+
+  g_clear_pointer (&constraint->pending_region, cairo_region_destroy);
+  if (region_resource)
+    constraint->pending_region = wakefield_region_get_region (region_resource);
+  constraint->has_pending_region = TRUE;
+}
+
+static void
+locked_pointer_set_cursor_position_hint (struct wl_client   *client,
+                                         struct wl_resource *resource,
+                                         wl_fixed_t          surface_x,
+                                         wl_fixed_t          surface_y)
+{
+  WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
+
+  constraint->pending_hint_x = wl_fixed_to_double (surface_x);
+  constraint->pending_hint_y = wl_fixed_to_double (surface_y);
+  constraint->has_pending_hint = TRUE;
+}
+
+static const struct zwp_locked_pointer_v1_interface locked_pointer_implementation = {
+  constraint_destroy,
+  locked_pointer_set_cursor_position_hint,
+  constraint_set_region,
+};
+
+static const struct zwp_confined_pointer_v1_interface confined_pointer_implementation = {
+  constraint_destroy,
+  constraint_set_region,
+};
+
+static void
+create_constraint (struct wl_client   *client,
+                   struct wl_resource *resource,
+                   uint32_t            id,
+                   struct wl_resource *surface_resource,
+                   struct wl_resource *region_resource,
+                   uint32_t            lifetime,
+                   gboolean            locked)
+{
+  WakefieldPointerConstraints *constraints = wl_resource_get_user_data (resource);
+  WakefieldPointerConstraint *constraint;
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct wl_resource *cr;
+
+  if (lifetime != ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_ONESHOT &&
+      lifetime != ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_PERSISTENT)
+    {
+      wl_resource_post_error (resource, WL_DISPLAY_ERROR_INVALID_METHOD,
+                              "Invalid constraint lifetime %u", lifetime);
+      return;
+    }
+
+  /* There is only one seat, so one pointer */
+  if (find_constraint (constraints, surface_resource))
+    {
+      wl_resource_post_error (resource, ZWP_POINTER_CONSTRAINTS_V1_ERROR_ALREADY_CONSTRAINED,
+                              "The pointer is already constrained on this surface");
+      return;
+    }
+
+  if (locked)
+    {
+      cr = wl_resource_create (client, &zwp_locked_pointer_v1_interface,
+                               wl_resource_get_version (resource), id);
+      wl_resource_set_implementation (cr, &locked_pointer_implementation,
+                                      NULL, constraint_resource_destroyed);
+    }
+  else
+    {
+      cr = wl_resource_create (client, &zwp_confined_pointer_v1_interface,
+                               wl_resource_get_version (resource), id);
+      wl_resource_set_implementation (cr, &confined_pointer_implementation,
+                                      NULL, constraint_resource_destroyed);
+    }
+
+  constraint = g_new0 (WakefieldPointerConstraint, 1);
+  constraint->constraints = constraints;
+  constraint->resource = cr;
+  constraint->locked = locked;
+  constraint->lifetime = lifetime;
+  if (region_resource)
+    constraint->region = wakefield_region_get_region (region_resource);
+
+  constraint->surface_resource = surface_resource;
+  constraint->surface_destroy_listener.notify = constraint_surface_destroyed;
+  wl_resource_add_destroy_listener (surface_resource,
+                                    &constraint->surface_destroy_listener);
+  constraint->surface_committed_handler =
+    g_signal_connect (surface, "committed", G_CALLBACK (surface_committed), constraint);
+
+  wl_list_insert (&constraints->constraints, &constraint->link);
+  wl_resource_set_user_data (cr, constraint);
+
+  wakefield_pointer_constraints_update (constraints);
+}
+
+static void
+pointer_constraints_destroy (struct wl_client   *client,
+                             struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static void
+pointer_constraints_lock_pointer (struct wl_client   *client,
+                                  struct wl_resource *resource,
+                                  uint32_t            id,
+                                  struct wl_resource *surface_resource,
+                                  struct wl_resource *pointer_resource,
+                                  struct wl_resource *region_resource,
+                                  uint32_t            lifetime)
+{
+  create_constraint (client, resource, id, surface_resource,
+                     region_resource, lifetime, TRUE);
+}
+
+static void
+pointer_constraints_confine_pointer (struct wl_client   *client,
+                                     struct wl_resource *resource,
+                                     uint32_t            id,
+                                     struct wl_resource *surface_resource,
+                                     struct wl_resource *pointer_resource,
+                                     struct wl_resource *region_resource,
+                                     uint32_t            lifetime)
+{
+  create_constraint (client, resource, id, surface_resource,
+                     region_resource, lifetime, FALSE);
+}
+
+static const struct zwp_pointer_constraints_v1_interface pointer_constraints_implementation = {
+  pointer_constraints_destroy,
+  pointer_constraints_lock_pointer,
+  pointer_constraints_confine_pointer,
+};
+
+static void
+bind_pointer_constraints (struct wl_client *client,
+                          void             *data,
+                          uint32_t          version,
+                          uint32_t          id)
+{
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_pointer_constraints_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &pointer_constraints_implementation,
+                                  wakefield_compositor_get_pointer_constraints (compositor),
+                                  NULL);
+}
+
+WakefieldPointerConstraints *
+wakefield_pointer_constraints_new (WakefieldCompositor *compositor)
+{
+  WakefieldPointerConstraints *constraints = g_new0 (WakefieldPointerConstraints, 1);
+
+  constraints->compositor = compositor;
+  wl_list_init (&constraints->constraints);
+
+  return constraints;
+}
+
+void
+wakefield_pointer_constraints_free (WakefieldPointerConstraints *constraints)
+{
+  /* Our clients, and so their constraints, are gone already */
+  g_warn_if_fail (wl_list_empty (&constraints->constraints));
+
+  g_free (constraints);
+}
+
+#define POINTER_CONSTRAINTS_VERSION 1
+
+void
+wakefield_pointer_constraints_init (struct wl_display *wl_display)
+{
+  wl_global_create (wl_display, &zwp_pointer_constraints_v1_interface,
+                    POINTER_CONSTRAINTS_VERSION, NULL, bind_pointer_constraints);
+}
@@ -0,0 +1,701 @@
+/*
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "wakefield-private.h"
+#include "primary-selection-unstable-v1-server-protocol.h"
+
+typedef struct _WakefieldPrimarySource WakefieldPrimarySource;
+
+struct _WakefieldPrimarySelection
+{
+  WakefieldCompositor *compositor;
+
+  struct wl_list manager_resources;
+  struct wl_list device_resources;
+
+  /* The client with the keyboard focus, it gets the selection and is
+     the only one allowed to set it, with serials from after focus_serial */
+  struct wl_client *focus_client;
+  struct wl_listener focus_client_listener;
+  uint32_t focus_serial;
+
+  /* Set by an embedded client, NULL if the host owns PRIMARY */
+  WakefieldPrimarySource *selection;
+  GtkClipboard *clipboard;
+  gboolean claiming_clipboard;
+  /* What we last put on PRIMARY, while we still own it */
+  GPtrArray *claimed_mime_types;
+
+  /* Mime types of the host PRIMARY, NULL until known */
+  GPtrArray *host_mime_types;
+  gboolean fetching_host_targets;
+  gboolean host_targets_outdated;
+};
+
+struct _WakefieldPrimarySource
+{
+  WakefieldPrimarySelection *primary_selection;
+  struct wl_resource *resource;
+  GPtrArray *mime_types;
+  /* WakefieldPrimaryOffers we made for this source */
+  GList *offers;
+};
+
+typedef struct
+{
+  WakefieldPrimarySelection *primary_selection;
+  struct wl_resource *resource;
+  /* NULL once the source is gone, and for host offers */
+  WakefieldPrimarySource *source;
+  /* Only for host offers */
+  GPtrArray *host_mime_types;
+} WakefieldPrimaryOffer;
+
+static void primary_selection_send_selection (WakefieldPrimarySelection *primary_selection);
+
+static gboolean
+mime_types_equal (GPtrArray *a,
+                  GPtrArray *b)
+{
+  guint i;
+
+  if (a == NULL || b == NULL || a->len != b->len)
+    return FALSE;
+
+  for (i = 0; i < a->len; i++)
+    {
+      if (!wakefield_mime_types_contain (b, g_ptr_array_index (a, i), NULL))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static GPtrArray *
+mime_types_copy (GPtrArray *mime_types)
+{
+  GPtrArray *copy = g_ptr_array_new_with_free_func (g_free);
+  guint i;
+
+  for (i = 0; i < mime_types->len; i++)
+    g_ptr_array_add (copy, g_strdup (g_ptr_array_index (mime_types, i)));
+
+  return copy;
+}
+
+/* The host side */
+
+static void request_host_targets (WakefieldPrimarySelection *primary_selection);
+
+static void
+host_targets_received (GtkClipboard *clipboard,
+                       GdkAtom      *atoms,
+                       gint          n_atoms,
+                       gpointer      user_data)
+{
+  WakefieldCompositor *compositor = user_data;
+  WakefieldPrimarySelection *primary_selection = wakefield_compositor_get_primary_selection (compositor);
+  GPtrArray *mime_types;
+  WakefieldCompositorLock *locked;
+
+  locked = wakefield_compositor_lock (compositor);
+
+  primary_selection->fetching_host_targets = FALSE;
+
+  /* It changed again while we were asking, only the latest matters */
+  if (primary_selection->host_targets_outdated)
+    {
+      primary_selection->host_targets_outdated = FALSE;
+      request_host_targets (primary_selection);
+      goto out;
+    }
+
+  if (primary_selection->selection)
+    goto out;
+
+  mime_types = wakefield_mime_types_new_for_atoms (atoms, n_atoms);
+  if (mime_types->len == 0)
+    g_clear_pointer (&mime_types, g_ptr_array_unref);
+
+  /* Host offers fetch whatever is on PRIMARY at paste time, so the ones
+     the client has are still good if the types didn't change */
+  if ((mime_types == NULL && primary_selection->host_mime_types == NULL) ||
+      mime_types_equal (mime_types, primary_selection->host_mime_types))
+    {
+      g_clear_pointer (&mime_types, g_ptr_array_unref);
+      goto out;
+    }
+
+  g_clear_pointer (&primary_selection->host_mime_types, g_ptr_array_unref);
+  primary_selection->host_mime_types = mime_types;
+  primary_selection_send_selection (primary_selection);
+
+ out:
+  wakefield_compositor_unlock (locked);
+  g_object_unref (compositor);
+}
+
+static void
+request_host_targets (WakefieldPrimarySelection *primary_selection)
+{
+  if (primary_selection->fetching_host_targets)
+    {
+      primary_selection->host_targets_outdated = TRUE;
+      return;
+    }
+
+  primary_selection->fetching_host_targets = TRUE;
+
+  /* Only the targets for now, the contents are fetched on paste */
+  gtk_clipboard_request_targets (primary_selection->clipboard, host_targets_received,
+                                 g_object_ref (primary_selection->compositor));
+}
+
+static void
+clipboard_owner_changed (GtkClipboard              *clipboard,
+                         GdkEventOwnerChange       *event,
+                         WakefieldPrimarySelection *primary_selection)
+{
+  if (gtk_clipboard_get_owner (clipboard) == G_OBJECT (primary_selection->compositor))
+    return;
+
+  /* Selecting text by dragging changes the owner all the time, so keep
+     the current offers until we know the types changed */
+  request_host_targets (primary_selection);
+}
+
+static void
+clipboard_get (GtkClipboard     *clipboard,
+               GtkSelectionData *selection_data,
+               guint             info,
+               gpointer          owner)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (owner);
+  WakefieldPrimarySelection *primary_selection = wakefield_compositor_get_primary_selection (compositor);
+  WakefieldPrimarySource *source;
+  g_autofree char *mime_type = NULL;
+  int fds[2];
+  WakefieldCompositorLock *locked;
+
+  locked = wakefield_compositor_lock (compositor);
+
+  source = primary_selection->selection;
+  if (source == NULL || info >= source->mime_types->len ||
+      pipe2 (fds, O_CLOEXEC) < 0)
+    {
+      wakefield_compositor_unlock (locked);
+      return;
+    }
+
+  mime_type = g_strdup (g_ptr_array_index (source->mime_types, info));
+
+  zwp_primary_selection_source_v1_send_send (source->resource, mime_type, fds[1]);
+  close (fds[1]);
+  wl_client_flush (wl_resource_get_client (source->resource));
+
+  wakefield_compositor_unlock (locked);
+
+  wakefield_selection_data_set_from_pipe (selection_data, mime_type, fds[0]);
+}
+
+static void
+clipboard_clear (GtkClipboard *clipboard,
+                 gpointer      owner)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (owner);
+  WakefieldPrimarySelection *primary_selection = wakefield_compositor_get_primary_selection (compositor);
+  WakefieldCompositorLock *locked;
+
+  if (primary_selection->claiming_clipboard)
+    return;
+
+  /* Someone on the host selected something */
+  locked = wakefield_compositor_lock (compositor);
+  g_clear_pointer (&primary_selection->claimed_mime_types, g_ptr_array_unref);
+  if (primary_selection->selection)
+    {
+      zwp_primary_selection_source_v1_send_cancelled (primary_selection->selection->resource);
+      primary_selection->selection = NULL;
+      primary_selection_send_selection (primary_selection);
+    }
+  wakefield_compositor_unlock (locked);
+}
+
+static void
+claim_clipboard (WakefieldCompositor *compositor,
+                 gpointer             user_data)
+{
+  WakefieldPrimarySelection *primary_selection = wakefield_compositor_get_primary_selection (compositor);
+  WakefieldPrimarySource *source = primary_selection->selection;
+  GtkTargetList *list;
+  GtkTargetEntry *targets;
+  gint n_targets;
+
+  if (source == NULL)
+    {
+      g_clear_pointer (&primary_selection->claimed_mime_types, g_ptr_array_unref);
+      if (gtk_clipboard_get_owner (primary_selection->clipboard) == G_OBJECT (compositor))
+        gtk_clipboard_clear (primary_selection->clipboard);
+      return;
+    }
+
+  /* Contents are read from the current source on paste, so a new source
+     with the same types doesn't need to tell the host anything */
+  if (mime_types_equal (source->mime_types, primary_selection->claimed_mime_types) &&
+      gtk_clipboard_get_owner (primary_selection->clipboard) == G_OBJECT (compositor))
+    return;
+
+  list = wakefield_target_list_new_for_mime_types (source->mime_types);
+  targets = gtk_target_table_new_from_list (list, &n_targets);
+
+  primary_selection->claiming_clipboard = TRUE;
+  gtk_clipboard_set_with_owner (primary_selection->clipboard, targets, n_targets,
+                                clipboard_get, clipboard_clear, G_OBJECT (compositor));
+  primary_selection->claiming_clipboard = FALSE;
+
+  g_clear_pointer (&primary_selection->claimed_mime_types, g_ptr_array_unref);
+  primary_selection->claimed_mime_types = mime_types_copy (source->mime_types);
+
+  gtk_target_table_free (targets, n_targets);
+  gtk_target_list_unref (list);
+}
+
+/* Offers */
+
+typedef struct
+{
+  char *mime_type;
+  int fd;
+} HostReceive;
+
+static void
+host_receive_free (gpointer data)
+{
+  HostReceive *receive = data;
+
+  if (receive->fd != -1)
+    close (receive->fd);
+  g_free (receive->mime_type);
+  g_free (receive);
+}
+
+static void
+host_receive_in_main (WakefieldCompositor *compositor,
+                      gpointer             user_data)
+{
+  WakefieldPrimarySelection *primary_selection = wakefield_compositor_get_primary_selection (compositor);
+  HostReceive *receive = user_data;
+
+  wakefield_clipboard_receive (primary_selection->clipboard, receive->mime_type, receive->fd);
+  receive->fd = -1;
+}
+
+static void
+primary_offer_receive (struct wl_client   *client,
+                       struct wl_resource *offer_resource,
+                       const char         *mime_type,
+                       int32_t             fd)
+{
+  WakefieldPrimaryOffer *offer = wl_resource_get_user_data (offer_resource);
+
+  if (offer->source)
+    {
+      /* Between clients the fd just goes through, no copies */
+      zwp_primary_selection_source_v1_send_send (offer->source->resource, mime_type, fd);
+      close (fd);
+    }
+  else if (offer->host_mime_types &&
+           wakefield_mime_types_contain (offer->host_mime_types, mime_type, NULL))
+    {
+      HostReceive *receive = g_new0 (HostReceive, 1);
+
+      receive->mime_type = g_strdup (mime_type);
+      receive->fd = fd;
+      wakefield_compositor_run_in_main (offer->primary_selection->compositor,
+                                        host_receive_in_main, receive, host_receive_free);
+    }
+  else
+    close (fd);
+}
+
+static void
+primary_offer_destroy (struct wl_client   *client,
+                       struct wl_resource *offer_resource)
+{
+  wl_resource_destroy (offer_resource);
+}
+
+static const struct zwp_primary_selection_offer_v1_interface primary_offer_implementation = {
+  primary_offer_receive,
+  primary_offer_destroy,
+};
+
+static void
+primary_offer_finalize (struct wl_resource *resource)
+{
+  WakefieldPrimaryOffer *offer = wl_resource_get_user_data (resource);
+
+  if (offer->source)
+    offer->source->offers = g_list_remove (offer->source->offers, offer);
+  g_clear_pointer (&offer->host_mime_types, g_ptr_array_unref);
+  g_free (offer);
+}
+
+static void
+primary_selection_send_selection (WakefieldPrimarySelection *primary_selection)
+{
+  struct wl_resource *device_resource;
+  WakefieldPrimaryOffer *offer;
+  GPtrArray *mime_types;
+  guint i;
+
+  if (primary_selection->focus_client == NULL)
+    return;
+
+  device_resource = wakefield_client_lookup_resource (primary_selection->focus_client,
+                                                      WAKEFIELD_CLIENT_PRIMARY_SELECTION_DEVICE,
+                                                      &primary_selection->device_resources);
+  if (device_resource == NULL)
+    return;
+
+  if (primary_selection->selection)
+    mime_types = primary_selection->selection->mime_types;
+  else
+    mime_types = primary_selection->host_mime_types;
+
+  if (mime_types == NULL)
+    {
+      zwp_primary_selection_device_v1_send_selection (device_resource, NULL);
+      return;
+    }
+
+  offer = g_new0 (WakefieldPrimaryOffer, 1);
+  offer->primary_selection = primary_selection;
+  offer->resource = wl_resource_create (primary_selection->focus_client,
+                                        &zwp_primary_selection_offer_v1_interface,
+                                        wl_resource_get_version (device_resource), 0);
+  if (offer->resource == NULL)
+    {
+      g_free (offer);
+      wl_resource_post_no_memory (device_resource);
+      return;
+    }
+
+  wl_resource_set_implementation (offer->resource, &primary_offer_implementation,
+                                  offer, primary_offer_finalize);
+
+  if (primary_selection->selection)
+    {
+      offer->source = primary_selection->selection;
+      offer->source->offers = g_list_prepend (offer->source->offers, offer);
+    }
+  else
+    offer->host_mime_types = g_ptr_array_ref (mime_types);
+
+  zwp_primary_selection_device_v1_send_data_offer (device_resource, offer->resource);
+  for (i = 0; i < mime_types->len; i++)
+    zwp_primary_selection_offer_v1_send_offer (offer->resource, g_ptr_array_index (mime_types, i));
+
+  zwp_primary_selection_device_v1_send_selection (device_resource, offer->resource);
+}
+
+static void
+focus_client_destroyed (struct wl_listener *listener,
+                        void               *data)
+{
+  WakefieldPrimarySelection *primary_selection =
+    wl_container_of (listener, primary_selection, focus_client_listener);
+
+  wl_list_remove (&primary_selection->focus_client_listener.link);
+  primary_selection->focus_client = NULL;
+}
+
+void
+wakefield_primary_selection_set_focus (WakefieldPrimarySelection *primary_selection,
+                                       struct wl_client          *client)
+{
+  if (primary_selection->focus_client == client)
+    return;
+
+  if (primary_selection->focus_client)
+    wl_list_remove (&primary_selection->focus_client_listener.link);
+
+  primary_selection->focus_client = client;
+  primary_selection->focus_serial =
+    wl_display_get_serial (wakefield_compositor_get_display (primary_selection->compositor));
+
+  if (client)
+    {
+      wl_client_add_destroy_listener (client, &primary_selection->focus_client_listener);
+      primary_selection_send_selection (primary_selection);
+    }
+}
+
+/* Sources */
+
+static void
+primary_source_offer (struct wl_client   *client,
+                      struct wl_resource *source_resource,
+                      const char         *mime_type)
+{
+  WakefieldPrimarySource *source = wl_resource_get_user_data (source_resource);
+
+  if (!wakefield_mime_types_contain (source->mime_types, mime_type, NULL))
+    g_ptr_array_add (source->mime_types, g_strdup (mime_type));
+}
+
+static void
+primary_source_destroy (struct wl_client   *client,
+                        struct wl_resource *source_resource)
+{
+  wl_resource_destroy (source_resource);
+}
+
+static const struct zwp_primary_selection_source_v1_interface primary_source_implementation = {
+  primary_source_offer,
+  primary_source_destroy,
+};
+
+static void
+primary_source_finalize (struct wl_resource *resource)
+{
+  WakefieldPrimarySource *source = wl_resource_get_user_data (resource);
+  WakefieldPrimarySelection *primary_selection = source->primary_selection;
+  GList *l;
+
+  for (l = source->offers; l; l = l->next)
+    {
+      WakefieldPrimaryOffer *offer = l->data;
+      offer->source = NULL;
+    }
+  g_list_free (source->offers);
+
+  if (primary_selection->selection == source)
+    {
+      primary_selection->selection = NULL;
+      primary_selection_send_selection (primary_selection);
+      wakefield_compositor_run_in_main (primary_selection->compositor, claim_clipboard, NULL, NULL);
+    }
+
+  g_ptr_array_unref (source->mime_types);
+  g_free (source);
+}
+
+/* Devices */
+
+static void
+primary_device_set_selection (struct wl_client   *client,
+                              struct wl_resource *device_resource,
+                              struct wl_resource *source_resource,
+                              uint32_t            serial)
+{
+  WakefieldPrimarySelection *primary_selection = wl_resource_get_user_data (device_resource);
+  WakefieldPrimarySource *source = source_resource ? wl_resource_get_user_data (source_resource) : NULL;
+  struct wl_display *wl_display = wakefield_compositor_get_display (primary_selection->compositor);
+
+  if (primary_selection->selection == source)
+    return;
+
+  /* Same rules as for the clipboard */
+  if (client != primary_selection->focus_client ||
+      (int32_t) (serial - primary_selection->focus_serial) <= 0 ||
+      (int32_t) (serial - wl_display_get_serial (wl_display)) > 0)
+    {
+      if (source)
+        zwp_primary_selection_source_v1_send_cancelled (source->resource);
+      return;
+    }
+
+  if (primary_selection->selection)
+    zwp_primary_selection_source_v1_send_cancelled (primary_selection->selection->resource);
+
+  primary_selection->selection = source;
+  if (source)
+    g_clear_pointer (&primary_selection->host_mime_types, g_ptr_array_unref);
+
+  primary_selection_send_selection (primary_selection);
+  wakefield_compositor_run_in_main (primary_selection->compositor, claim_clipboard, NULL, NULL);
+}
+
+static void
+primary_device_destroy (struct wl_client   *client,
+                        struct wl_resource *device_resource)
+{
+  wl_resource_destroy (device_resource);
+}
+
+static const struct zwp_primary_selection_device_v1_interface primary_device_implementation = {
+  primary_device_set_selection,
+  primary_device_destroy,
+};
+
+static void
+primary_device_finalize (struct wl_resource *resource)
+{
+  WakefieldPrimarySelection *primary_selection = wl_resource_get_user_data (resource);
+
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_uncache_resource (resource, WAKEFIELD_CLIENT_PRIMARY_SELECTION_DEVICE,
+                                     &primary_selection->device_resources);
+}
+
+/* The manager */
+
+static void
+manager_create_source (struct wl_client   *client,
+                       struct wl_resource *manager_resource,
+                       uint32_t            id)
+{
+  WakefieldPrimarySelection *primary_selection = wl_resource_get_user_data (manager_resource);
+  WakefieldPrimarySource *source;
+
+  source = g_new0 (WakefieldPrimarySource, 1);
+  source->primary_selection = primary_selection;
+  source->mime_types = g_ptr_array_new_with_free_func (g_free);
+
+  source->resource = wl_resource_create (client, &zwp_primary_selection_source_v1_interface,
+                                         wl_resource_get_version (manager_resource), id);
+  if (source->resource == NULL)
+    {
+      g_ptr_array_unref (source->mime_types);
+      g_free (source);
+      wl_resource_post_no_memory (manager_resource);
+      return;
+    }
+
+  wl_resource_set_implementation (source->resource, &primary_source_implementation,
+                                  source, primary_source_finalize);
+}
+
+static void
+manager_get_device (struct wl_client   *client,
+                    struct wl_resource *manager_resource,
+                    uint32_t            id,
+                    struct wl_resource *seat_resource)
+{
+  WakefieldPrimarySelection *primary_selection = wl_resource_get_user_data (manager_resource);
+  struct wl_resource *device_resource;
+
+  device_resource = wl_resource_create (client, &zwp_primary_selection_device_v1_interface,
+                                        wl_resource_get_version (manager_resource), id);
+  if (device_resource == NULL)
+    {
+      wl_resource_post_no_memory (manager_resource);
+      return;
+    }
+
+  wl_list_insert (&primary_selection->device_resources,
+                  wl_resource_get_link (device_resource));
+  wl_resource_set_implementation (device_resource, &primary_device_implementation,
+                                  primary_selection, primary_device_finalize);
+  wakefield_client_cache_resource (device_resource, WAKEFIELD_CLIENT_PRIMARY_SELECTION_DEVICE);
+
+  if (client == primary_selection->focus_client)
+    primary_selection_send_selection (primary_selection);
+}
+
+static void
+manager_destroy (struct wl_client   *client,
+                 struct wl_resource *manager_resource)
+{
+  wl_resource_destroy (manager_resource);
+}
+
+static const struct zwp_primary_selection_device_manager_v1_interface manager_implementation = {
+  manager_create_source,
+  manager_get_device,
+  manager_destroy,
+};
+
+static void
+manager_finalize (struct wl_resource *resource)
+{
+  wl_list_remove (wl_resource_get_link (resource));
+}
+
+static void
+bind_primary_selection_manager (struct wl_client *client,
+                                void             *data,
+                                uint32_t          version,
+                                uint32_t          id)
+{
+  WakefieldCompositor *compositor = wakefield_compositor_for_client (client);
+  WakefieldPrimarySelection *primary_selection = wakefield_compositor_get_primary_selection (compositor);
+  struct wl_resource *manager_resource;
+
+  manager_resource = wl_resource_create (client, &zwp_primary_selection_device_manager_v1_interface,
+                                         version, id);
+  if (manager_resource == NULL)
+    {
+      wl_client_post_no_memory (client);
+      return;
+    }
+
+  wl_resource_set_implementation (manager_resource, &manager_implementation,
+                                  primary_selection, manager_finalize);
+  wl_list_insert (&primary_selection->manager_resources,
+                  wl_resource_get_link (manager_resource));
+}
+
+WakefieldPrimarySelection *
+wakefield_primary_selection_new (WakefieldCompositor *compositor)
+{
+  WakefieldPrimarySelection *primary_selection = g_new0 (WakefieldPrimarySelection, 1);
+
+  primary_selection->compositor = compositor;
+  wl_list_init (&primary_selection->manager_resources);
+  wl_list_init (&primary_selection->device_resources);
+  primary_selection->focus_client_listener.notify = focus_client_destroyed;
+
+  primary_selection->clipboard = gtk_widget_get_clipboard (GTK_WIDGET (compositor),
+                                                           GDK_SELECTION_PRIMARY);
+  g_signal_connect (primary_selection->clipboard, "owner-change",
+                    G_CALLBACK (clipboard_owner_changed), primary_selection);
+  /* Pick up what the host has selected already */
+  request_host_targets (primary_selection);
+
+  return primary_selection;
+}
+
+void
+wakefield_primary_selection_free (WakefieldPrimarySelection *primary_selection)
+{
+  g_signal_handlers_disconnect_by_data (primary_selection->clipboard, primary_selection);
+  if (primary_selection->focus_client)
+    wl_list_remove (&primary_selection->focus_client_listener.link);
+  g_clear_pointer (&primary_selection->claimed_mime_types, g_ptr_array_unref);
+  g_clear_pointer (&primary_selection->host_mime_types, g_ptr_array_unref);
+  g_free (primary_selection);
+}
+
+#define PRIMARY_SELECTION_VERSION 1
+
+/* One global per display, binds go to the primary selection of the
+   client's compositor */
+void
+wakefield_primary_selection_init (struct wl_display *wl_display)
+{
+  wl_global_create (wl_display, &zwp_primary_selection_device_manager_v1_interface,
+                    PRIMARY_SELECTION_VERSION, NULL, bind_primary_selection_manager);
+}
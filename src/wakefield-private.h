@@ -24,15 +24,77 @@
 #include "wakefield-compositor.h"
 
 #include <wayland-server.h>
+#include <pixman.h>
 
 typedef struct _WakefieldSurface WakefieldSurface;
 typedef struct _WakefieldDataDevice WakefieldDataDevice;
+typedef struct _WakefieldPrimarySelection WakefieldPrimarySelection;
+typedef struct _WakefieldPointerConstraints WakefieldPointerConstraints;
+typedef struct _WakefieldDisplay WakefieldCompositorLock;
+
+typedef void (* WakefieldMainFunc) (WakefieldCompositor *compositor,
+                                    gpointer             user_data);
+
+typedef enum {
+  WAKEFIELD_CLIENT_POINTER,
+  WAKEFIELD_CLIENT_KEYBOARD,
+  WAKEFIELD_CLIENT_TOUCH,
+  WAKEFIELD_CLIENT_OUTPUT,
+  WAKEFIELD_CLIENT_DATA_DEVICE,
+  WAKEFIELD_CLIENT_PRIMARY_SELECTION_DEVICE,
+  WAKEFIELD_CLIENT_RELATIVE_POINTER,
+
+  WAKEFIELD_N_CLIENT_RESOURCES
+} WakefieldClientResource;
+
+void                wakefield_client_cache_resource             (struct wl_resource      *resource,
+                                                                 WakefieldClientResource  kind);
+void                wakefield_client_uncache_resource           (struct wl_resource      *resource,
+                                                                 WakefieldClientResource  kind,
+                                                                 struct wl_list          *resource_list);
+struct wl_resource *wakefield_client_lookup_resource            (struct wl_client        *client,
+                                                                 WakefieldClientResource  kind,
+                                                                 struct wl_list          *resource_list);
+void                wakefield_client_set_motion_history         (struct wl_client        *client,
+                                                                 gboolean                 motion_history);
 
 struct wl_display * wakefield_compositor_get_display            (WakefieldCompositor *compositor);
+WakefieldDataDevice *wakefield_compositor_get_data_device       (WakefieldCompositor *compositor);
+WakefieldPrimarySelection *wakefield_compositor_get_primary_selection (WakefieldCompositor *compositor);
+WakefieldPointerConstraints *wakefield_compositor_get_pointer_constraints (WakefieldCompositor *compositor);
+WakefieldCompositor *wakefield_compositor_for_client            (struct wl_client    *client);
+struct wl_resource *wakefield_compositor_get_pointer_focus      (WakefieldCompositor *compositor);
+struct wl_resource *wakefield_compositor_get_surface_at         (WakefieldCompositor *compositor,
+                                                                 double               x,
+                                                                 double               y,
+                                                                 double              *sx,
+                                                                 double              *sy);
+void                wakefield_compositor_drag_started           (WakefieldCompositor *compositor);
+void                wakefield_compositor_warp_pointer           (WakefieldCompositor *compositor,
+                                                                 GdkDevice           *device,
+                                                                 GdkScreen           *screen,
+                                                                 int                  x_root,
+                                                                 int                  y_root);
+gboolean            wakefield_compositor_is_dispatch_thread     (WakefieldCompositor *compositor);
+WakefieldCompositorLock *wakefield_compositor_lock              (WakefieldCompositor *compositor);
+void                wakefield_compositor_unlock                 (WakefieldCompositorLock *locked);
+gboolean            wakefield_compositor_client_is_congested    (WakefieldCompositor *compositor,
+                                                                 struct wl_client    *client);
+gboolean            wakefield_compositor_client_is_unresponsive (WakefieldCompositor *compositor,
+                                                                 struct wl_client    *client);
+void                wakefield_compositor_run_in_main            (WakefieldCompositor *compositor,
+                                                                 WakefieldMainFunc    func,
+                                                                 gpointer             user_data,
+                                                                 GDestroyNotify       destroy);
 void                wakefield_compositor_surface_unmapped       (WakefieldCompositor *compositor,
                                                                  struct wl_resource  *surface);
 void                wakefield_compositor_surface_mapped         (WakefieldCompositor *compositor,
                                                                  struct wl_resource  *surface);
+void                wakefield_compositor_window_realized        (WakefieldCompositor *compositor,
+                                                                 GdkWindow           *window,
+                                                                 struct wl_resource  *xdg_surface);
+void                wakefield_compositor_window_unrealized      (WakefieldCompositor *compositor,
+                                                                 GdkWindow           *window);
 void                wakefield_compositor_send_configure         (WakefieldCompositor *compositor,
                                                                  struct wl_resource  *surfaces);
 gboolean            wakefield_compositor_grab_pointer           (WakefieldCompositor *compositor,
@@ -60,6 +122,7 @@ typedef enum {
   WAKEFIELD_SURFACE_ROLE_XDG_TOPLEVEL,
   WAKEFIELD_SURFACE_ROLE_XDG_POPUP,
   WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR,
+  WAKEFIELD_SURFACE_ROLE_DND_ICON,
 } WakefieldSurfaceRole;
 
 struct wl_resource * wakefield_surface_new              (WakefieldCompositor *compositor,
@@ -68,6 +131,10 @@ struct wl_resource * wakefield_surface_new              (WakefieldCompositor *co
                                                          uint32_t             id);
 void                 wakefield_surface_draw             (struct wl_resource  *surface_resource,
                                                          cairo_t             *cr);
+gboolean             wakefield_surface_draw_opaque      (struct wl_resource  *surface_resource,
+                                                         cairo_t             *cr,
+                                                         int                  width,
+                                                         int                  height);
 struct wl_resource * wakefield_surface_get_xdg_surface  (struct wl_resource  *surface_resource);
 WakefieldSurfaceRole wakefield_surface_get_role         (struct wl_resource  *surface_resource);
 void                 wakefield_surface_set_role         (struct wl_resource *surface_resource,
@@ -76,9 +143,20 @@ GdkWindow *          wakefield_surface_get_window       (struct wl_resource  *su
 gboolean             wakefield_surface_is_mapped        (struct wl_resource  *surface_resource);
 
 WakefieldCompositor *wakefield_surface_get_compositor   (WakefieldSurface *surface);
+struct wl_resource * wakefield_surface_get_resource     (WakefieldSurface *surface);
+void                 wakefield_surface_get_size         (WakefieldSurface *surface,
+                                                         int              *width,
+                                                         int              *height);
+void                 wakefield_surface_get_offset       (WakefieldSurface *surface,
+                                                         int              *x,
+                                                         int              *y);
 cairo_surface_t *    wakefield_surface_create_cairo_surface (WakefieldSurface *surface,
                                                              int              *width,
                                                              int              *height);
+gboolean             wakefield_surface_composite_image  (cairo_t                     *cr,
+                                                         pixman_image_t              *src,
+                                                         const cairo_rectangle_int_t *bounds,
+                                                         pixman_op_t                  op);
 
 struct wl_resource *wakefield_xdg_surface_new (struct wl_client   *client,
                                                struct wl_resource *shell_resource,
@@ -93,6 +171,18 @@ void                wakefield_xdg_surface_realize (struct wl_resource *xdg_surfa
                                                    GdkWindow *parent);
 void                wakefield_xdg_surface_unrealize (struct wl_resource *xdg_surface_resource);
 GdkWindow *         wakefield_xdg_surface_get_window (struct wl_resource *xdg_surface_resource);
+gboolean            wakefield_xdg_surface_configure_throttled (struct wl_resource *xdg_surface_resource);
+void                wakefield_xdg_surface_configure_sent (struct wl_resource *xdg_surface_resource,
+                                                          uint32_t            serial,
+                                                          gboolean            wait_for_ack);
+gboolean            wakefield_xdg_toplevel_is_configured (struct wl_resource *xdg_toplevel_resource,
+                                                          int32_t             width,
+                                                          int32_t             height,
+                                                          uint32_t            states);
+void                wakefield_xdg_toplevel_set_configured (struct wl_resource *xdg_toplevel_resource,
+                                                           int32_t             width,
+                                                           int32_t             height,
+                                                           uint32_t            states);
 
 struct wl_resource *wakefield_xdg_popup_new (WakefieldCompositor *compositor,
                                              struct wl_client   *client,
@@ -113,4 +203,35 @@ void                wakefield_xdg_popup_close      (struct wl_resource *xdg_popu
 
 cairo_region_t *wakefield_region_get_region (struct wl_resource *region_resource);
 
-WakefieldDataDevice *wakefield_data_device_new (WakefieldCompositor *compositor);
+WakefieldDataDevice *wakefield_data_device_new          (WakefieldCompositor *compositor);
+void                 wakefield_data_device_free         (WakefieldDataDevice *data_device);
+void                 wakefield_data_device_manager_init (struct wl_display   *wl_display);
+void                 wakefield_data_device_set_focus    (WakefieldDataDevice *data_device,
+                                                         struct wl_client    *client);
+
+gboolean             wakefield_mime_types_contain           (GPtrArray        *mime_types,
+                                                             const char       *mime_type,
+                                                             guint            *index);
+GPtrArray *          wakefield_mime_types_new_for_atoms     (GdkAtom          *atoms,
+                                                             gint              n_atoms);
+GtkTargetList *      wakefield_target_list_new_for_mime_types (GPtrArray      *mime_types);
+void                 wakefield_clipboard_receive            (GtkClipboard     *clipboard,
+                                                             const char       *mime_type,
+                                                             int               fd);
+void                 wakefield_selection_data_set_from_pipe (GtkSelectionData *selection_data,
+                                                             const char       *mime_type,
+                                                             int               fd);
+
+WakefieldPrimarySelection *wakefield_primary_selection_new       (WakefieldCompositor       *compositor);
+void                       wakefield_primary_selection_free      (WakefieldPrimarySelection *primary_selection);
+void                       wakefield_primary_selection_init      (struct wl_display         *wl_display);
+void                       wakefield_primary_selection_set_focus (WakefieldPrimarySelection *primary_selection,
+                                                                  struct wl_client          *client);
+
+WakefieldPointerConstraints *wakefield_pointer_constraints_new           (WakefieldCompositor         *compositor);
+void                         wakefield_pointer_constraints_free          (WakefieldPointerConstraints *constraints);
+void                         wakefield_pointer_constraints_init          (struct wl_display           *wl_display);
+void                         wakefield_pointer_constraints_update        (WakefieldPointerConstraints *constraints);
+gboolean                     wakefield_pointer_constraints_handle_motion (WakefieldPointerConstraints *constraints,
+                                                                          struct wl_resource          *surface_resource,
+                                                                          GdkEventMotion              *event);
@@ -26,6 +26,7 @@
 #include "config.h"
 
 #include <string.h>
+#include <pixman.h>
 
 #include "wakefield-private.h"
 #include "xdg-shell-server-protocol.h"
@@ -46,8 +47,7 @@ static void xdg_surface_get_popup (struct wl_client *client,
                                    struct wl_resource *parent,
                                    struct wl_resource *positioner);
 
-static void xdg_popup_compute_allocation (WakefieldXdgPopup *xdg_popup,
-                                          gboolean           use_surface_size);
+static void xdg_popup_update_position (WakefieldXdgPopup *xdg_popup);
 
 enum {
   COMMITTED,
@@ -60,18 +60,30 @@ static guint signals[LAST_SIGNAL];
 typedef struct _WakefieldSurfacePendingState
 {
   struct wl_resource *buffer;
+  int dx, dy;
   int scale;
 
   cairo_region_t *input_region;
+  cairo_region_t *opaque_region;
+  gboolean opaque_region_changed;
   struct wl_list frame_callbacks;
 } WakefieldSurfacePendingState;
 
 typedef struct _WakefieldXdgSurface
 {
+  WakefieldCompositor *compositor;
   WakefieldSurface *surface;
 
   struct wl_resource *resource;
   GdkWindow *window;
+  cairo_rectangle_int_t geometry;
+
+  /* At most one toplevel configure waits for an ack, newer ones are
+     folded into a single configure with the latest state once it comes */
+  gboolean has_configured;
+  uint32_t configure_serial;
+  gboolean configure_in_flight;
+  gboolean configure_queued;
 } WakefieldXdgSurface;
 
 typedef struct _WakefieldXdgToplevel
@@ -80,6 +92,12 @@ typedef struct _WakefieldXdgToplevel
 
   struct wl_resource *resource;
   GdkWindow *window;
+
+  /* What the last configure said, to not repeat it */
+  gboolean configured;
+  int32_t configured_width;
+  int32_t configured_height;
+  uint32_t configured_states;
 } WakefieldXdgToplevel;
 
 typedef struct _WakeFieldXdgPositioner
@@ -108,9 +126,18 @@ typedef struct _WakefieldXdgPopup
   WakefieldSurface *surface;
   WakefieldSurface *parent_surface;
   WakeFieldXdgPositioner xdg_positioner;
+  /* Relative to the parent */
   cairo_rectangle_int_t allocation;
   uint32_t grab_serial;
 
+  /* Where the window geometry was placed and where that puts the
+     buffer in the compositor, so that nobody has to walk up the
+     parents for it */
+  int32_t window_x;
+  int32_t window_y;
+  int32_t absolute_x;
+  int32_t absolute_y;
+
   struct wl_resource *resource;
 } WakefieldXdgPopup;
 
@@ -130,6 +157,15 @@ struct _WakefieldSurface
   cairo_region_t *damage;
   WakefieldSurfacePendingState pending, current;
   gboolean mapped;
+
+  /* Sum of the attach offsets, relative to where the surface started */
+  int offset_x, offset_y;
+
+  /* Dimmed copy of the last frame, drawn while the client is unresponsive */
+  cairo_surface_t *unresponsive_snapshot;
+
+  /* Wraps the current shm buffer for as long as it stays attached */
+  pixman_image_t *buffer_image;
 };
 
 G_DEFINE_FINAL_TYPE (WakefieldSurface, wakefield_surface, G_TYPE_OBJECT);
@@ -224,9 +260,9 @@ wakefield_surface_get_window (struct wl_resource  *surface_resource)
   return NULL;
 }
 
-static void
-wakefield_surface_get_current_size (WakefieldSurface *surface,
-                                    int *width, int *height)
+void
+wakefield_surface_get_size (WakefieldSurface *surface,
+                            int *width, int *height)
 {
   struct wl_shm_buffer *shm_buffer;
 
@@ -259,12 +295,56 @@ cairo_format_for_wl_shm_format (enum wl_shm_format format)
     }
 }
 
+static pixman_format_code_t
+pixman_format_for_wl_shm_format (enum wl_shm_format format)
+{
+  switch (format)
+    {
+    case WL_SHM_FORMAT_ARGB8888:
+      return PIXMAN_a8r8g8b8;
+    case WL_SHM_FORMAT_XRGB8888:
+      return PIXMAN_x8r8g8b8;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static pixman_format_code_t
+pixman_format_for_cairo_format (cairo_format_t format)
+{
+  switch (format)
+    {
+    case CAIRO_FORMAT_ARGB32:
+      return PIXMAN_a8r8g8b8;
+    case CAIRO_FORMAT_RGB24:
+      return PIXMAN_x8r8g8b8;
+    default:
+      return 0;
+    }
+}
+
+void
+wakefield_surface_get_offset (WakefieldSurface *surface,
+                              int              *x,
+                              int              *y)
+{
+  *x = surface->offset_x;
+  *y = surface->offset_y;
+}
+
 WakefieldCompositor *
 wakefield_surface_get_compositor (WakefieldSurface *surface)
 {
   return surface->compositor;
 }
 
+/* This is NULL once the wl_surface has been destroyed */
+struct wl_resource *
+wakefield_surface_get_resource (WakefieldSurface *surface)
+{
+  return surface->resource;
+}
+
 cairo_surface_t *
 wakefield_surface_create_cairo_surface (WakefieldSurface *surface,
                                         int *width_out, int *height_out)
@@ -317,56 +397,381 @@ wakefield_surface_create_cairo_surface (WakefieldSurface *surface,
   return cr_surface;
 }
 
+static void
+wakefield_surface_paint (WakefieldSurface *surface,
+                         cairo_t          *cr,
+                         cairo_surface_t  *cr_surface)
+{
+  if (surface->xdg_popup)
+    {
+      cairo_translate (cr, surface->xdg_popup->absolute_x, surface->xdg_popup->absolute_y);
+    }
+  else if (surface->xdg_toplevel && surface->xdg_surface)
+    {
+      WakefieldXdgSurface *xdg_surface = surface->xdg_surface;
+      GtkAllocation allocation;
+      double scale_x, scale_y;
+      int width, height;
+
+      /* Toplevels are maximized, so that's the size they are told */
+      gtk_widget_get_allocation (GTK_WIDGET (surface->compositor), &allocation);
+
+      if (xdg_surface->geometry.width > 0 && xdg_surface->geometry.height > 0)
+        {
+          width = xdg_surface->geometry.width;
+          height = xdg_surface->geometry.height;
+        }
+      else
+        {
+          cairo_surface_get_device_scale (cr_surface, &scale_x, &scale_y);
+          width = cairo_image_surface_get_width (cr_surface) / scale_x;
+          height = cairo_image_surface_get_height (cr_surface) / scale_y;
+        }
+
+      /* Until the client catches up with a resize, crop the last buffer
+         if it's too big and stretch it where it's too small */
+      if (width != allocation.width || height != allocation.height)
+        {
+          cairo_save (cr);
+          cairo_rectangle (cr, 0, 0, allocation.width, allocation.height);
+          cairo_clip (cr);
+          if (width > 0 && height > 0)
+            cairo_scale (cr,
+                         MAX (1.0, (double) allocation.width / width),
+                         MAX (1.0, (double) allocation.height / height));
+          cairo_set_source_surface (cr, cr_surface, 0, 0);
+          cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_FAST);
+          cairo_paint (cr);
+          cairo_restore (cr);
+          return;
+        }
+    }
+
+  cairo_set_source_surface (cr, cr_surface, 0, 0);
+  cairo_paint (cr);
+}
+
+static cairo_surface_t *
+create_unresponsive_snapshot (WakefieldSurface *surface)
+{
+  cairo_surface_t *snapshot;
+  cairo_t *cr;
+
+  snapshot = wakefield_surface_create_cairo_surface (surface, NULL, NULL);
+  if (snapshot == NULL)
+    return NULL;
+
+  cr = cairo_create (snapshot);
+  cairo_set_operator (cr, CAIRO_OPERATOR_ATOP);
+  cairo_set_source_rgba (cr, 0, 0, 0, 0.5);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  return snapshot;
+}
+
+static pixman_image_t *
+get_buffer_image (WakefieldSurface     *surface,
+                  struct wl_shm_buffer *shm_buffer)
+{
+  pixman_format_code_t format =
+    pixman_format_for_wl_shm_format (wl_shm_buffer_get_format (shm_buffer));
+  uint32_t *data = wl_shm_buffer_get_data (shm_buffer);
+  int width = wl_shm_buffer_get_width (shm_buffer);
+  int height = wl_shm_buffer_get_height (shm_buffer);
+  int stride = wl_shm_buffer_get_stride (shm_buffer);
+
+  /* The pool may have been remapped since, so check it still matches */
+  if (surface->buffer_image &&
+      pixman_image_get_data (surface->buffer_image) == data &&
+      pixman_image_get_format (surface->buffer_image) == format &&
+      pixman_image_get_width (surface->buffer_image) == width &&
+      pixman_image_get_height (surface->buffer_image) == height &&
+      pixman_image_get_stride (surface->buffer_image) == stride)
+    return surface->buffer_image;
+
+  g_clear_pointer (&surface->buffer_image, pixman_image_unref);
+  surface->buffer_image = pixman_image_create_bits (format, width, height,
+                                                    data, stride);
+
+  return surface->buffer_image;
+}
+
+/* Composites src with pixman right into the pixels of an image target,
+   one call per clip rectangle, with src placed at bounds in user space.
+   Returns FALSE without drawing anything when a transformation or the
+   target need cairo. GTK only hands out image targets on a Wayland host
+   or with GDK_RENDERING=image, on X11 it paints into an xlib surface by
+   default and this always falls back to cairo there. */
+gboolean
+wakefield_surface_composite_image (cairo_t                     *cr,
+                                   pixman_image_t              *src,
+                                   const cairo_rectangle_int_t *bounds,
+                                   pixman_op_t                  op)
+{
+  cairo_surface_t *target = cairo_get_group_target (cr);
+  cairo_rectangle_list_t *clip;
+  cairo_matrix_t matrix;
+  pixman_format_code_t target_format;
+  pixman_image_t *dest;
+  double offset_x, offset_y, scale_x, scale_y;
+  int dx, dy, i;
+
+  if (cairo_get_operator (cr) != CAIRO_OPERATOR_OVER ||
+      cairo_surface_get_type (target) != CAIRO_SURFACE_TYPE_IMAGE ||
+      cairo_image_surface_get_data (target) == NULL)
+    return FALSE;
+
+  target_format = pixman_format_for_cairo_format (cairo_image_surface_get_format (target));
+  if (target_format == 0)
+    return FALSE;
+
+  /* Only whole pixel translations map user space onto target pixels */
+  cairo_get_matrix (cr, &matrix);
+  cairo_surface_get_device_offset (target, &offset_x, &offset_y);
+  cairo_surface_get_device_scale (target, &scale_x, &scale_y);
+  if (matrix.xx != 1 || matrix.yy != 1 || matrix.xy != 0 || matrix.yx != 0 ||
+      scale_x != 1 || scale_y != 1 ||
+      matrix.x0 + offset_x != (int) (matrix.x0 + offset_x) ||
+      matrix.y0 + offset_y != (int) (matrix.y0 + offset_y))
+    return FALSE;
+
+  dx = matrix.x0 + offset_x;
+  dy = matrix.y0 + offset_y;
+
+  clip = cairo_copy_clip_rectangle_list (cr);
+  if (clip->status != CAIRO_STATUS_SUCCESS)
+    {
+      cairo_rectangle_list_destroy (clip);
+      return FALSE;
+    }
+
+  for (i = 0; i < clip->num_rectangles; i++)
+    {
+      cairo_rectangle_t *r = &clip->rectangles[i];
+
+      if (r->x != (int) r->x || r->y != (int) r->y ||
+          r->width != (int) r->width || r->height != (int) r->height)
+        {
+          cairo_rectangle_list_destroy (clip);
+          return FALSE;
+        }
+    }
+
+  cairo_surface_flush (target);
+  dest = pixman_image_create_bits (target_format,
+                                   cairo_image_surface_get_width (target),
+                                   cairo_image_surface_get_height (target),
+                                   (uint32_t *) cairo_image_surface_get_data (target),
+                                   cairo_image_surface_get_stride (target));
+
+  for (i = 0; i < clip->num_rectangles; i++)
+    {
+      cairo_rectangle_t *r = &clip->rectangles[i];
+      cairo_rectangle_int_t rect = { r->x, r->y, r->width, r->height };
+
+      if (!gdk_rectangle_intersect (&rect, bounds, &rect))
+        continue;
+
+      pixman_image_composite32 (op, src, NULL, dest,
+                                rect.x - bounds->x, rect.y - bounds->y,
+                                0, 0,
+                                rect.x + dx, rect.y + dy,
+                                rect.width, rect.height);
+    }
+
+  pixman_image_unref (dest);
+  cairo_surface_mark_dirty (target);
+  cairo_rectangle_list_destroy (clip);
+
+  return TRUE;
+}
+
+/* Composites the buffer where the surface paints it, see
+   wakefield_surface_composite_image(). Scaled buffers and crops or
+   stretches while a resize is in flight are left to cairo. */
+static gboolean
+wakefield_surface_composite (WakefieldSurface     *surface,
+                             cairo_t              *cr,
+                             struct wl_shm_buffer *shm_buffer,
+                             pixman_op_t           op)
+{
+  cairo_rectangle_int_t bounds = { 0, };
+
+  if (surface->current.scale != 1)
+    return FALSE;
+
+  bounds.width = wl_shm_buffer_get_width (shm_buffer);
+  bounds.height = wl_shm_buffer_get_height (shm_buffer);
+
+  if (surface->xdg_popup)
+    {
+      bounds.x = surface->xdg_popup->absolute_x;
+      bounds.y = surface->xdg_popup->absolute_y;
+    }
+  else if (surface->xdg_toplevel && surface->xdg_surface)
+    {
+      WakefieldXdgSurface *xdg_surface = surface->xdg_surface;
+      GtkAllocation allocation;
+
+      gtk_widget_get_allocation (GTK_WIDGET (surface->compositor), &allocation);
+      if (bounds.width != allocation.width || bounds.height != allocation.height)
+        return FALSE;
+
+      if (xdg_surface->geometry.width > 0 && xdg_surface->geometry.height > 0 &&
+          (xdg_surface->geometry.width != allocation.width ||
+           xdg_surface->geometry.height != allocation.height))
+        return FALSE;
+    }
+
+  return wakefield_surface_composite_image (cr, get_buffer_image (surface, shm_buffer),
+                                            &bounds, op);
+}
+
+/* Trigger frame callbacks, unless the client isn't keeping up with
+   its events, then they wait until it does. */
+static void
+send_frame_callbacks (WakefieldSurface *surface,
+                      struct wl_client *client)
+{
+  struct wl_resource *cr, *next;
+  int64_t now;
+
+  if (wakefield_compositor_client_is_congested (surface->compositor, client))
+    return;
+
+  now = g_get_monotonic_time () / 1000;
+
+  wl_resource_for_each_safe (cr, next, &surface->current.frame_callbacks)
+    {
+      wl_callback_send_done (cr, now);
+      wl_resource_destroy (cr);
+    }
+
+  wl_list_init (&surface->current.frame_callbacks);
+}
+
 void
 wakefield_surface_draw (struct wl_resource *surface_resource,
                         cairo_t                 *cr)
 {
   WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct wl_client *client = wl_resource_get_client (surface_resource);
   struct wl_shm_buffer *shm_buffer;
 
+  /* Don't touch the client buffer or send it anything while it's hung,
+     the snapshot is taken once and reused until it answers again. */
+  if (wakefield_compositor_client_is_unresponsive (surface->compositor, client))
+    {
+      if (surface->unresponsive_snapshot == NULL)
+        surface->unresponsive_snapshot = create_unresponsive_snapshot (surface);
+
+      if (surface->unresponsive_snapshot)
+        wakefield_surface_paint (surface, cr, surface->unresponsive_snapshot);
+
+      return;
+    }
+
+  g_clear_pointer (&surface->unresponsive_snapshot, cairo_surface_destroy);
+
   shm_buffer = wl_shm_buffer_get (surface->current.buffer);
   if (shm_buffer)
     {
       g_autoptr (WlShmBufferLocker) locked = wl_shm_buffer_locker (shm_buffer);
       cairo_surface_t *cr_surface;
 
-      cr_surface = cairo_image_surface_create_for_data (wl_shm_buffer_get_data (shm_buffer),
-                                                        cairo_format_for_wl_shm_format (wl_shm_buffer_get_format (shm_buffer)),
-                                                        wl_shm_buffer_get_width (shm_buffer),
-                                                        wl_shm_buffer_get_height (shm_buffer),
-                                                        wl_shm_buffer_get_stride (shm_buffer));
-      cairo_surface_set_device_scale (cr_surface, surface->current.scale, surface->current.scale);
-
-      if (surface->xdg_popup)
+      if (!wakefield_surface_composite (surface, cr, shm_buffer, PIXMAN_OP_OVER))
         {
-          cairo_rectangle_int_t popup_allocation;
+          cr_surface = cairo_image_surface_create_for_data (wl_shm_buffer_get_data (shm_buffer),
+                                                            cairo_format_for_wl_shm_format (wl_shm_buffer_get_format (shm_buffer)),
+                                                            wl_shm_buffer_get_width (shm_buffer),
+                                                            wl_shm_buffer_get_height (shm_buffer),
+                                                            wl_shm_buffer_get_stride (shm_buffer));
+          cairo_surface_set_device_scale (cr_surface, surface->current.scale, surface->current.scale);
+
+          wakefield_surface_paint (surface, cr, cr_surface);
 
-          wakefield_xdg_popup_get_allocation (surface->xdg_popup->resource,
-                                              &popup_allocation);
-          cairo_translate (cr, popup_allocation.x, popup_allocation.y);
+          cairo_surface_destroy (cr_surface);
         }
+    }
 
-      cairo_set_source_surface (cr, cr_surface, 0, 0);
+  send_frame_callbacks (surface, client);
+}
 
-      /* XXX: Do scaling of our surface to match our allocation. */
-      cairo_paint (cr);
+/* Draws a toplevel that covers the whole widget with an opaque buffer
+   straight to the target: no translation, clip or blending, so only
+   the damaged rows get copied as they are. Returns FALSE without drawing
+   anything if the surface doesn't qualify, the caller then falls back
+   to wakefield_surface_draw(). */
+gboolean
+wakefield_surface_draw_opaque (struct wl_resource *surface_resource,
+                               cairo_t            *cr,
+                               int                 width,
+                               int                 height)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct wl_client *client = wl_resource_get_client (surface_resource);
+  WakefieldXdgSurface *xdg_surface = surface->xdg_surface;
+  struct wl_shm_buffer *shm_buffer;
+  cairo_rectangle_int_t rect = { 0, 0, width, height };
+  cairo_surface_t *cr_surface;
+  cairo_format_t format;
 
-      cairo_surface_destroy (cr_surface);
-    }
+  if (surface->xdg_toplevel == NULL || xdg_surface == NULL || !surface->mapped)
+    return FALSE;
+
+  /* Only a window geometry spanning the whole buffer keeps it aligned */
+  if (xdg_surface->geometry.width > 0 && xdg_surface->geometry.height > 0 &&
+      (xdg_surface->geometry.x != 0 || xdg_surface->geometry.y != 0 ||
+       xdg_surface->geometry.width != width || xdg_surface->geometry.height != height))
+    return FALSE;
+
+  if (wakefield_compositor_client_is_unresponsive (surface->compositor, client))
+    return FALSE;
+
+  shm_buffer = wl_shm_buffer_get (surface->current.buffer);
+  if (shm_buffer == NULL)
+    return FALSE;
 
-  /* Trigger frame callbacks. */
   {
-    struct wl_resource *cr, *next;
-    int64_t now = g_get_monotonic_time () / 1000;
+    g_autoptr (WlShmBufferLocker) locked = wl_shm_buffer_locker (shm_buffer);
+
+    if (wl_shm_buffer_get_width (shm_buffer) != width * surface->current.scale ||
+        wl_shm_buffer_get_height (shm_buffer) != height * surface->current.scale)
+      return FALSE;
+
+    format = cairo_format_for_wl_shm_format (wl_shm_buffer_get_format (shm_buffer));
+    if (format != CAIRO_FORMAT_RGB24 &&
+        (surface->current.opaque_region == NULL ||
+         cairo_region_contains_rectangle (surface->current.opaque_region,
+                                          &rect) != CAIRO_REGION_OVERLAP_IN))
+      return FALSE;
 
-    wl_resource_for_each_safe (cr, next, &surface->current.frame_callbacks)
+    g_clear_pointer (&surface->unresponsive_snapshot, cairo_surface_destroy);
+
+    if (!wakefield_surface_composite (surface, cr, shm_buffer, PIXMAN_OP_SRC))
       {
-        wl_callback_send_done (cr, now);
-        wl_resource_destroy (cr);
+        cr_surface = cairo_image_surface_create_for_data (wl_shm_buffer_get_data (shm_buffer),
+                                                          format,
+                                                          wl_shm_buffer_get_width (shm_buffer),
+                                                          wl_shm_buffer_get_height (shm_buffer),
+                                                          wl_shm_buffer_get_stride (shm_buffer));
+        cairo_surface_set_device_scale (cr_surface, surface->current.scale, surface->current.scale);
+
+        /* GTK already clipped cr to the damage, so this only copies those rows */
+        cairo_save (cr);
+        cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface (cr, cr_surface, 0, 0);
+        cairo_paint (cr);
+        cairo_restore (cr);
+
+        cairo_surface_destroy (cr_surface);
       }
-
-    wl_list_init (&surface->current.frame_callbacks);
   }
+
+  send_frame_callbacks (surface, client);
+
+  return TRUE;
 }
 
 static void
@@ -391,8 +796,10 @@ wl_surface_attach (struct wl_client *client,
 {
   WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
 
-  /* Ignore dx/dy in our case */
+  /* Only DnD icons move with these, the rest are placed by us */
   surface->pending.buffer = buffer_resource;
+  surface->pending.dx = dx;
+  surface->pending.dy = dy;
 }
 
 static void
@@ -425,7 +832,14 @@ wl_surface_set_opaque_region (struct wl_client *client,
                               struct wl_resource *surface_resource,
                               struct wl_resource *region_resource)
 {
-  /* XXX: Do we need this? */
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  /* Only used to pick the single opaque client fast path when drawing */
+  g_clear_pointer (&surface->pending.opaque_region, cairo_region_destroy);
+  if (region_resource)
+    surface->pending.opaque_region = wakefield_region_get_region (region_resource);
+
+  surface->pending.opaque_region_changed = TRUE;
 }
 
 static void
@@ -442,25 +856,81 @@ wl_surface_set_input_region (struct wl_client *client,
 }
 
 static void
-xdg_popup_get_absolute_coordinates (struct wl_resource *xdg_popup_resource,
-                                    GdkPoint           *point)
+wl_surface_apply_commit (WakefieldSurface *surface,
+                         cairo_region_t   *damage)
 {
-  WakefieldXdgPopup *xdg_popup = wl_resource_get_user_data (xdg_popup_resource);
-  cairo_rectangle_int_t allocation;
-
-  wakefield_xdg_popup_get_allocation (xdg_popup_resource, &allocation);
-  point->x = allocation.x;
-  point->y = allocation.y;
+  /* process damage */
 
-  while (xdg_popup->parent_surface &&
-         xdg_popup->parent_surface->role == WAKEFIELD_SURFACE_ROLE_XDG_POPUP)
+  if (surface->xdg_surface)
     {
-      xdg_popup = xdg_popup->parent_surface->xdg_popup;
-      wakefield_xdg_popup_get_allocation (xdg_popup->resource, &allocation);
+      GtkAllocation allocation;
+
+      gtk_widget_get_allocation (GTK_WIDGET (surface->compositor), &allocation);
 
-      point->x += allocation.x;
-      point->y += allocation.y;
+      if (surface->xdg_popup)
+        {
+          WakefieldXdgPopup *xdg_popup = surface->xdg_popup;
+          GdkPoint popup_orig;
+
+          /* The window geometry may have moved within the buffer */
+          xdg_popup_update_position (xdg_popup);
+
+          popup_orig.x = xdg_popup->absolute_x;
+          popup_orig.y = xdg_popup->absolute_y;
+
+          if (!cairo_region_intersect_rectangle (damage, &allocation))
+            {
+              allocation.y += popup_orig.y;
+              allocation.x += popup_orig.x;
+            }
+
+          if (surface->xdg_surface->window)
+            {
+              gdk_window_move (surface->xdg_surface->window,
+                               popup_orig.x, popup_orig.y);
+            }
+        }
+
+      cairo_region_translate (damage, allocation.x, allocation.y);
+      gtk_widget_queue_draw_region (GTK_WIDGET (surface->compositor), damage);
+    }
+
+  if (!surface->mapped)
+    {
+      surface->mapped = TRUE;
+      wakefield_compositor_surface_mapped (surface->compositor, surface->resource);
     }
+
+  g_signal_emit (surface, signals[COMMITTED], 0);
+}
+
+typedef struct
+{
+  WakefieldSurface *surface;
+  cairo_region_t *damage;
+} WakefieldSurfaceCommit;
+
+static void
+surface_commit_free (gpointer user_data)
+{
+  WakefieldSurfaceCommit *commit = user_data;
+
+  g_object_unref (commit->surface);
+  cairo_region_destroy (commit->damage);
+  g_free (commit);
+}
+
+static void
+surface_commit_in_main (WakefieldCompositor *compositor,
+                        gpointer             user_data)
+{
+  WakefieldSurfaceCommit *commit = user_data;
+
+  /* The client may have destroyed the surface in the mean time */
+  if (commit->surface->resource == NULL)
+    return;
+
+  wl_surface_apply_commit (commit->surface, commit->damage);
 }
 
 static void
@@ -505,6 +975,8 @@ wl_surface_commit (struct wl_client *client,
 
       g_clear_pointer (&surface->current.buffer, wl_buffer_send_release);
       surface->current.buffer = g_steal_pointer (&surface->pending.buffer);
+      g_clear_pointer (&surface->unresponsive_snapshot, cairo_surface_destroy);
+      g_clear_pointer (&surface->buffer_image, pixman_image_unref);
     }
 
   /* XXX: Should we reallocate / redraw the entire region if the buffer
@@ -512,6 +984,17 @@ wl_surface_commit (struct wl_client *client,
   if (surface->pending.scale > 0)
     surface->current.scale = surface->pending.scale;
 
+  surface->offset_x += surface->pending.dx;
+  surface->offset_y += surface->pending.dy;
+  surface->pending.dx = surface->pending.dy = 0;
+
+  if (surface->pending.opaque_region_changed)
+    {
+      g_clear_pointer (&surface->current.opaque_region, cairo_region_destroy);
+      surface->current.opaque_region = g_steal_pointer (&surface->pending.opaque_region);
+      surface->pending.opaque_region_changed = FALSE;
+    }
+
   wl_list_insert_list (&surface->current.frame_callbacks,
                        &surface->pending.frame_callbacks);
   wl_list_init (&surface->pending.frame_callbacks);
@@ -522,37 +1005,20 @@ wl_surface_commit (struct wl_client *client,
       cairo_region_destroy (clear_region);
     }
 
-  /* process damage */
-
-  if (surface->xdg_surface)
+  /* Damage, mapping and the committed listeners all end up in GTK */
+  if (wakefield_compositor_is_dispatch_thread (surface->compositor))
     {
-      GtkAllocation allocation;
+      WakefieldSurfaceCommit *commit = g_new0 (WakefieldSurfaceCommit, 1);
 
-      gtk_widget_get_allocation (GTK_WIDGET (surface->compositor), &allocation);
-
-      if (surface->xdg_popup)
-        {
-          GdkPoint popup_orig;
-
-          xdg_popup_compute_allocation (surface->xdg_popup, TRUE);
-          xdg_popup_get_absolute_coordinates (surface->xdg_popup->resource,
-                                              &popup_orig);
-
-          if (!cairo_region_intersect_rectangle (surface->damage, &allocation))
-            {
-              allocation.y += popup_orig.y;
-              allocation.x += popup_orig.x;
-            }
-
-          if (surface->xdg_surface->window)
-            {
-              gdk_window_move (surface->xdg_surface->window,
-                               popup_orig.x, popup_orig.y);
-            }
-        }
-
-      cairo_region_translate (surface->damage, allocation.x, allocation.y);
-      gtk_widget_queue_draw_region (GTK_WIDGET (surface->compositor), surface->damage);
+      commit->surface = g_object_ref (surface);
+      commit->damage = cairo_region_copy (surface->damage);
+      wakefield_compositor_run_in_main (surface->compositor,
+                                        surface_commit_in_main,
+                                        commit, surface_commit_free);
+    }
+  else
+    {
+      wl_surface_apply_commit (surface, surface->damage);
     }
 
   /* ... and then empty it */
@@ -565,14 +1031,6 @@ wl_surface_commit (struct wl_client *client,
   surface->pending.input_region = NULL;
 
   surface->pending.scale = 1;
-
-  if (!surface->mapped)
-    {
-      surface->mapped = TRUE;
-      wakefield_compositor_surface_mapped (surface->compositor, surface->resource);
-    }
-
-  g_signal_emit (surface, signals[COMMITTED], 0);
 }
 
 static void
@@ -599,6 +1057,7 @@ destroy_pending_state (WakefieldSurfacePendingState *state)
   wl_resource_for_each_safe (cr, next, &state->frame_callbacks)
     wl_resource_destroy (cr);
   g_clear_pointer (&state->input_region, cairo_region_destroy);
+  g_clear_pointer (&state->opaque_region, cairo_region_destroy);
 }
 
 /* This needs to be called both from wl_surface and xdg_[surface|popup] finalizer,
@@ -631,9 +1090,12 @@ wl_surface_finalize (struct wl_resource *resource)
     surface->xdg_popup->surface = NULL;
 
   wl_list_remove (wl_resource_get_link (resource));
+  surface->resource = NULL;
 
   destroy_pending_state (&surface->pending);
   destroy_pending_state (&surface->current);
+  g_clear_pointer (&surface->unresponsive_snapshot, cairo_surface_destroy);
+  g_clear_pointer (&surface->buffer_image, pixman_image_unref);
 
   g_object_unref (surface);
 }
@@ -721,6 +1183,24 @@ xdg_surface_destroy (struct wl_client *client,
   wl_resource_destroy (resource);
 }
 
+static void
+xdg_surface_apply_window_geometry (WakefieldCompositor *compositor,
+                                   gpointer             user_data)
+{
+  WakefieldSurface *surface = user_data;
+  WakefieldXdgSurface *xdg_surface = surface->xdg_surface;
+
+  if (surface->resource == NULL || xdg_surface == NULL)
+    return;
+
+  if (xdg_surface->window)
+    gdk_window_move_resize (xdg_surface->window,
+                            xdg_surface->geometry.x,
+                            xdg_surface->geometry.y,
+                            xdg_surface->geometry.width,
+                            xdg_surface->geometry.height);
+}
+
 static void
 xdg_surface_set_window_geometry (struct wl_client *client,
                                  struct wl_resource *resource,
@@ -731,8 +1211,18 @@ xdg_surface_set_window_geometry (struct wl_client *client,
 {
   WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
 
-  if (xdg_surface->window)
-    gdk_window_move_resize (xdg_surface->window, x, y, width, height);
+  xdg_surface->geometry = (cairo_rectangle_int_t) {
+    .x = x,
+    .y = y,
+    .width = width,
+    .height = height,
+  };
+
+  if (xdg_surface->surface)
+    wakefield_compositor_run_in_main (xdg_surface->compositor,
+                                      xdg_surface_apply_window_geometry,
+                                      g_object_ref (xdg_surface->surface),
+                                      g_object_unref);
 }
 
 static void
@@ -740,7 +1230,25 @@ xdg_surface_ack_configure (struct wl_client *client,
                            struct wl_resource *resource,
                            uint32_t serial)
 {
-  // g_print("ACKIng configure %u\n", serial);
+  WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (!xdg_surface->has_configured)
+    {
+      wl_resource_post_error (resource, XDG_SURFACE_ERROR_INVALID_SERIAL,
+                              "No configure event was sent");
+      return;
+    }
+
+  if (!xdg_surface->configure_in_flight || serial != xdg_surface->configure_serial)
+    return;
+
+  xdg_surface->configure_in_flight = FALSE;
+
+  if (xdg_surface->configure_queued)
+    {
+      xdg_surface->configure_queued = FALSE;
+      wakefield_compositor_send_configure (xdg_surface->compositor, resource);
+    }
 }
 
 static const struct xdg_surface_interface xdg_surface_implementation = {
@@ -917,6 +1425,62 @@ xdg_surface_get_toplevel (struct wl_client   *client,
     wakefield_surface_get_compositor (surface), xdg_surface->resource);
 }
 
+/* Whether the last configure sent had this size and mask of states */
+gboolean
+wakefield_xdg_toplevel_is_configured (struct wl_resource *xdg_toplevel_resource,
+                                      int32_t             width,
+                                      int32_t             height,
+                                      uint32_t            states)
+{
+  WakefieldXdgToplevel *xdg_toplevel = wl_resource_get_user_data (xdg_toplevel_resource);
+
+  return xdg_toplevel->configured &&
+         xdg_toplevel->configured_width == width &&
+         xdg_toplevel->configured_height == height &&
+         xdg_toplevel->configured_states == states;
+}
+
+void
+wakefield_xdg_toplevel_set_configured (struct wl_resource *xdg_toplevel_resource,
+                                       int32_t             width,
+                                       int32_t             height,
+                                       uint32_t            states)
+{
+  WakefieldXdgToplevel *xdg_toplevel = wl_resource_get_user_data (xdg_toplevel_resource);
+
+  xdg_toplevel->configured = TRUE;
+  xdg_toplevel->configured_width = width;
+  xdg_toplevel->configured_height = height;
+  xdg_toplevel->configured_states = states;
+}
+
+/* Returns TRUE, and remembers to configure later, while the client
+   still has to ack the last toplevel configure */
+gboolean
+wakefield_xdg_surface_configure_throttled (struct wl_resource *xdg_surface_resource)
+{
+  WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (xdg_surface_resource);
+
+  if (!xdg_surface->configure_in_flight)
+    return FALSE;
+
+  xdg_surface->configure_queued = TRUE;
+  return TRUE;
+}
+
+void
+wakefield_xdg_surface_configure_sent (struct wl_resource *xdg_surface_resource,
+                                      uint32_t            serial,
+                                      gboolean            wait_for_ack)
+{
+  WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (xdg_surface_resource);
+
+  xdg_surface->has_configured = TRUE;
+  xdg_surface->configure_serial = serial;
+  xdg_surface->configure_in_flight = wait_for_ack;
+  xdg_surface->configure_queued = FALSE;
+}
+
 WakefieldSurface *
 wakefield_xdg_surface_get_surface (struct wl_resource *xdg_surface_resource)
 {
@@ -966,8 +1530,8 @@ wakefield_xdg_surface_realize (struct wl_resource *xdg_surface_resource,
 
   compositor = surface->compositor;
 
-  wakefield_surface_get_current_size (xdg_surface->surface,
-                                      &width, &height);
+  wakefield_surface_get_size (xdg_surface->surface,
+                              &width, &height);
 
   attributes.x = 0;
   attributes.y = 0;
@@ -981,6 +1545,9 @@ wakefield_xdg_surface_realize (struct wl_resource *xdg_surface_resource,
     GDK_BUTTON_PRESS_MASK |
     GDK_BUTTON_RELEASE_MASK |
     GDK_SCROLL_MASK |
+    GDK_SMOOTH_SCROLL_MASK |
+    GDK_TOUCH_MASK |
+    GDK_TOUCHPAD_GESTURE_MASK |
     GDK_FOCUS_CHANGE_MASK |
     GDK_KEY_PRESS_MASK |
     GDK_KEY_RELEASE_MASK |
@@ -989,29 +1556,38 @@ wakefield_xdg_surface_realize (struct wl_resource *xdg_surface_resource,
 
   xdg_surface->window = gdk_window_new (parent_window, &attributes, attributes_mask);
   gtk_widget_register_window (GTK_WIDGET (compositor), xdg_surface->window);
+  wakefield_compositor_window_realized (compositor, xdg_surface->window,
+                                        xdg_surface_resource);
   gdk_window_show (xdg_surface->window);
 }
 
+static void
+xdg_surface_destroy_window (WakefieldCompositor *compositor,
+                            gpointer             user_data)
+{
+  GdkWindow *window = user_data;
+
+  gtk_widget_unregister_window (GTK_WIDGET (compositor), window);
+  gdk_window_destroy (window);
+}
+
 void
 wakefield_xdg_surface_unrealize (struct wl_resource *xdg_surface_resource)
 {
-  WakefieldCompositor *compositor;
   WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (xdg_surface_resource);
-  WakefieldSurface *surface = xdg_surface->surface;
 
   if (xdg_surface->surface)
     wl_surface_unmap (xdg_surface->surface);
 
   if (xdg_surface->window)
     {
-      if (surface != NULL)
-        {
-          compositor = surface->compositor;
-          gtk_widget_unregister_window (GTK_WIDGET (compositor), xdg_surface->window);
-        }
-
-      gdk_window_destroy (xdg_surface->window);
-      xdg_surface->window = NULL;
+      /* No more events for us, even if the window outlives us a bit */
+      wakefield_compositor_window_unrealized (xdg_surface->compositor,
+                                              xdg_surface->window);
+      wakefield_compositor_run_in_main (xdg_surface->compositor,
+                                        xdg_surface_destroy_window,
+                                        g_steal_pointer (&xdg_surface->window),
+                                        NULL);
     }
 }
 
@@ -1025,6 +1601,7 @@ wakefield_xdg_surface_new (struct wl_client *client,
   WakefieldXdgSurface *xdg_surface;
 
   xdg_surface = g_new0 (WakefieldXdgSurface, 1);
+  xdg_surface->compositor = surface->compositor;
   xdg_surface->surface = surface;
 
   surface->xdg_surface = xdg_surface;
@@ -1042,51 +1619,198 @@ xdg_popup_destroy (struct wl_client *client,
   wl_resource_destroy (resource);
 }
 
-static void
-get_positioner_anchor_point (WakeFieldXdgPositioner *xdg_positioner,
-                             int32_t                *x,
-                             int32_t                *y)
-{
-  cairo_rectangle_int_t *anchor_rect = &xdg_positioner->anchor_rect;
+/* Anchors and gravities, as the edges they point to */
+enum {
+  POSITIONER_EDGE_TOP = 1 << 0,
+  POSITIONER_EDGE_BOTTOM = 1 << 1,
+  POSITIONER_EDGE_LEFT = 1 << 2,
+  POSITIONER_EDGE_RIGHT = 1 << 3,
+};
 
-  switch (xdg_positioner->anchor)
+/* xdg_positioner anchors and gravities have the same values */
+static uint32_t
+positioner_edges (uint32_t anchor_or_gravity)
+{
+  switch (anchor_or_gravity)
     {
-    case XDG_POSITIONER_ANCHOR_NONE:
-      *x = anchor_rect->x + anchor_rect->width / 2;
-      *y = anchor_rect->y + anchor_rect->height / 2;
-      break;
     case XDG_POSITIONER_ANCHOR_TOP:
-      *x = anchor_rect->x + anchor_rect->width / 2;
-      *y = anchor_rect->y;
-      break;
+      return POSITIONER_EDGE_TOP;
     case XDG_POSITIONER_ANCHOR_BOTTOM:
-      *x = anchor_rect->x + anchor_rect->width / 2;
-      *y = anchor_rect->y + anchor_rect->height;
-      break;
+      return POSITIONER_EDGE_BOTTOM;
     case XDG_POSITIONER_ANCHOR_LEFT:
-      *x = anchor_rect->x;
-      *y = anchor_rect->y + anchor_rect->height / 2;
-      break;
+      return POSITIONER_EDGE_LEFT;
     case XDG_POSITIONER_ANCHOR_RIGHT:
-      *x = anchor_rect->x + anchor_rect->width;
-      *y = anchor_rect->y + anchor_rect->height / 2;
-      break;
+      return POSITIONER_EDGE_RIGHT;
     case XDG_POSITIONER_ANCHOR_TOP_LEFT:
-      *x = anchor_rect->x;
-      *y = anchor_rect->y;
-      break;
+      return POSITIONER_EDGE_TOP | POSITIONER_EDGE_LEFT;
     case XDG_POSITIONER_ANCHOR_BOTTOM_LEFT:
-      *x = anchor_rect->x;
-      *y = anchor_rect->y + anchor_rect->height;
-      break;
+      return POSITIONER_EDGE_BOTTOM | POSITIONER_EDGE_LEFT;
     case XDG_POSITIONER_ANCHOR_TOP_RIGHT:
-      *x = anchor_rect->x + anchor_rect->width;
-      *y = anchor_rect->y;
-      break;
+      return POSITIONER_EDGE_TOP | POSITIONER_EDGE_RIGHT;
     case XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT:
-      *x = anchor_rect->x + anchor_rect->width;
-      *y = anchor_rect->y + anchor_rect->height;
-      break;
+      return POSITIONER_EDGE_BOTTOM | POSITIONER_EDGE_RIGHT;
+    case XDG_POSITIONER_ANCHOR_NONE:
+    default:
+      return 0;
+    }
+}
+
+static uint32_t
+flip_edges (uint32_t edges,
+            uint32_t start,
+            uint32_t end)
+{
+  uint32_t flipped = edges & ~(start | end);
+
+  if (edges & start)
+    flipped |= end;
+  if (edges & end)
+    flipped |= start;
+
+  return flipped;
+}
+
+/* One axis of a positioner, in compositor coordinates */
+typedef struct
+{
+  int32_t anchor_start;
+  int32_t anchor_length;
+  int32_t offset;
+  uint32_t anchor_edges;
+  uint32_t gravity_edges;
+  /* The edges of this axis */
+  uint32_t start;
+  uint32_t end;
+} PositionerAxis;
+
+/* Where a popup of @size goes on @axis, flipped or not */
+static int32_t
+place_on_axis (const PositionerAxis *axis,
+               int32_t               size,
+               gboolean              flipped)
+{
+  uint32_t anchor_edges = axis->anchor_edges;
+  uint32_t gravity_edges = axis->gravity_edges;
+  int32_t offset = axis->offset;
+  int32_t anchor, pos;
+
+  if (flipped)
+    {
+      anchor_edges = flip_edges (anchor_edges, axis->start, axis->end);
+      gravity_edges = flip_edges (gravity_edges, axis->start, axis->end);
+      offset = -offset;
+    }
+
+  if (anchor_edges & axis->start)
+    anchor = axis->anchor_start;
+  else if (anchor_edges & axis->end)
+    anchor = axis->anchor_start + axis->anchor_length;
+  else
+    anchor = axis->anchor_start + axis->anchor_length / 2;
+
+  if (gravity_edges & axis->start)
+    pos = anchor - size;
+  else if (gravity_edges & axis->end)
+    pos = anchor;
+  else
+    pos = anchor - size / 2;
+
+  return pos + offset;
+}
+
+static gboolean
+constrained_on_axis (int32_t pos,
+                     int32_t size,
+                     int32_t area_start,
+                     int32_t area_length)
+{
+  return pos < area_start || pos + size > area_start + area_length;
+}
+
+/* First slides towards the gravity, until the other edge fits or the
+   gravity edge hits the area, then the other way around */
+static int32_t
+slide_on_axis (int32_t  pos,
+               int32_t  size,
+               int32_t  area_start,
+               int32_t  area_length,
+               gboolean towards_start)
+{
+  int32_t over_start = area_start - pos;
+  int32_t over_end = pos + size - (area_start + area_length);
+
+  if (towards_start)
+    {
+      if (over_end > 0 && over_start < 0)
+        pos -= MIN (over_end, -over_start);
+
+      over_start = area_start - pos;
+      over_end = pos + size - (area_start + area_length);
+      if (over_start > 0 && over_end < 0)
+        pos += MIN (over_start, -over_end);
+    }
+  else
+    {
+      if (over_start > 0 && over_end < 0)
+        pos += MIN (over_start, -over_end);
+
+      over_start = area_start - pos;
+      over_end = pos + size - (area_start + area_length);
+      if (over_end > 0 && over_start < 0)
+        pos -= MIN (over_end, -over_start);
+    }
+
+  return pos;
+}
+
+/* Places the popup on one axis and applies the allowed adjustments in
+   the order of the spec: flip, then slide, then resize */
+static void
+solve_axis (const PositionerAxis *axis,
+            int32_t               area_start,
+            int32_t               area_length,
+            uint32_t              adjustment,
+            uint32_t              flip,
+            uint32_t              slide,
+            uint32_t              resize,
+            int32_t              *pos,
+            int32_t              *size)
+{
+  int32_t flipped;
+
+  *pos = place_on_axis (axis, *size, FALSE);
+  if (!constrained_on_axis (*pos, *size, area_start, area_length))
+    return;
+
+  if (adjustment & flip)
+    {
+      /* Stays as it was if flipping doesn't help */
+      flipped = place_on_axis (axis, *size, TRUE);
+      if (!constrained_on_axis (flipped, *size, area_start, area_length))
+        {
+          *pos = flipped;
+          return;
+        }
+    }
+
+  if (adjustment & slide)
+    {
+      *pos = slide_on_axis (*pos, *size, area_start, area_length,
+                            (axis->gravity_edges & axis->start) != 0);
+      if (!constrained_on_axis (*pos, *size, area_start, area_length))
+        return;
+    }
+
+  if (adjustment & resize)
+    {
+      int32_t new_pos = MAX (*pos, area_start);
+      int32_t new_end = MIN (*pos + *size, area_start + area_length);
+
+      if (new_end > new_pos)
+        {
+          *pos = new_pos;
+          *size = new_end - new_pos;
+        }
     }
 }
 
@@ -1102,107 +1826,190 @@ get_parent_toplevel (WakefieldSurface *surface)
   return get_parent_toplevel (surface->xdg_popup->parent_surface);
 }
 
+/* Popups have to stay within the compositor, and their toplevel */
 static void
-xdg_popup_compute_allocation (WakefieldXdgPopup *xdg_popup,
-                              gboolean           use_surface_size)
+get_constraint_area (WakefieldXdgPopup     *xdg_popup,
+                     cairo_rectangle_int_t *area)
 {
-  WakefieldCompositor *compositor = xdg_popup->surface->compositor;
-  WakeFieldXdgPositioner *xdg_positioner;
-  int32_t anchor_x, anchor_y;
-  int32_t popup_width, popup_height;
-  int32_t max_width, max_height;
-  int32_t parent_width, parent_height;
-  int surface_width, surface_height;
-  int32_t x_offset, y_offset;
+  GtkWidget *widget = GTK_WIDGET (xdg_popup->surface->compositor);
+  WakefieldSurface *parent_toplevel = get_parent_toplevel (xdg_popup->surface);
 
-  xdg_positioner = &xdg_popup->xdg_positioner;
+  area->x = 0;
+  area->y = 0;
+  area->width = gtk_widget_get_allocated_width (widget);
+  area->height = gtk_widget_get_allocated_height (widget);
 
-  if (use_surface_size &&
-      xdg_popup->parent_surface->role == WAKEFIELD_SURFACE_ROLE_XDG_TOPLEVEL)
+  if (parent_toplevel && parent_toplevel->xdg_surface &&
+      parent_toplevel->xdg_surface->window)
     {
-      wakefield_surface_get_current_size (xdg_popup->surface,
-                                          &surface_width, &surface_height);
+      GdkWindow *window = parent_toplevel->xdg_surface->window;
+      cairo_rectangle_int_t toplevel;
 
-      popup_width = MAX (xdg_positioner->width, surface_width);
-      popup_height = MAX (xdg_positioner->height, surface_height);
+      gdk_window_get_position (window, &toplevel.x, &toplevel.y);
+      toplevel.width = gdk_window_get_width (window);
+      toplevel.height = gdk_window_get_height (window);
 
-      x_offset = MAX (0, popup_width - xdg_positioner->width) / 2;
-      y_offset = MAX (0, popup_height - xdg_positioner->height) / 2;
+      if (!gdk_rectangle_intersect (area, &toplevel, area))
+        area->width = area->height = 0;
     }
-  else
+}
+
+/* Where the window geometry starts within the buffer */
+static void
+get_geometry_offset (WakefieldSurface *surface,
+                     int32_t          *x,
+                     int32_t          *y)
+{
+  WakefieldXdgSurface *xdg_surface = surface->xdg_surface;
+
+  *x = 0;
+  *y = 0;
+
+  if (xdg_surface && xdg_surface->geometry.width > 0 && xdg_surface->geometry.height > 0)
     {
-      x_offset = 0;
-      y_offset = 0;
-      popup_width = xdg_positioner->width;
-      popup_height = xdg_positioner->height;
+      *x = xdg_surface->geometry.x;
+      *y = xdg_surface->geometry.y;
     }
+}
 
-  parent_width = 0;
-  parent_height = 0;
+/* The positioner places the window geometry, the buffer around it
+   goes wherever the client put its shadows */
+static void
+xdg_popup_update_position (WakefieldXdgPopup *xdg_popup)
+{
+  int32_t offset_x, offset_y;
+
+  get_geometry_offset (xdg_popup->surface, &offset_x, &offset_y);
+  xdg_popup->absolute_x = xdg_popup->window_x - offset_x;
+  xdg_popup->absolute_y = xdg_popup->window_y - offset_y;
+}
 
-  if (xdg_positioner->has_parent_size)
+/* Places the popup once, when it's created or repositioned, so clients
+   don't need to reposition it themselves after seeing the configure.
+   This needs GTK for the constraints, so only call it in main. */
+static void
+xdg_popup_compute_allocation (WakefieldXdgPopup *xdg_popup)
+{
+  WakeFieldXdgPositioner *xdg_positioner = &xdg_popup->xdg_positioner;
+  WakefieldSurface *parent = xdg_popup->parent_surface;
+  uint32_t anchor_edges = positioner_edges (xdg_positioner->anchor);
+  uint32_t gravity_edges = positioner_edges (xdg_positioner->gravity);
+  PositionerAxis x_axis, y_axis;
+  cairo_rectangle_int_t area;
+  int32_t parent_x, parent_y;
+  int32_t x, y, width, height;
+
+  width = xdg_positioner->width;
+  height = xdg_positioner->height;
+
+  /* Solve in compositor coordinates, parents are placed already and the
+     anchor rectangle is relative to their window geometry */
+  if (parent->role == WAKEFIELD_SURFACE_ROLE_XDG_POPUP && parent->xdg_popup)
     {
-      parent_width = xdg_positioner->parent_width;
-      parent_height = xdg_positioner->parent_height;
+      parent_x = parent->xdg_popup->window_x;
+      parent_y = parent->xdg_popup->window_y;
     }
   else
     {
-      WakefieldSurface *parent_toplevel =
-        get_parent_toplevel (xdg_popup->surface);
-
-      if (parent_toplevel && parent_toplevel->xdg_surface->window)
-        {
-          parent_width = gdk_window_get_width (
-            parent_toplevel->xdg_surface->window);
-          parent_height = gdk_window_get_height (
-            parent_toplevel->xdg_surface->window);
-        }
+      get_geometry_offset (parent, &parent_x, &parent_y);
     }
 
-  max_width = gtk_widget_get_allocated_width (GTK_WIDGET (compositor));
-  max_height = gtk_widget_get_allocated_height (GTK_WIDGET (compositor));
+  x_axis = (PositionerAxis) {
+    .anchor_start = parent_x + xdg_positioner->anchor_rect.x,
+    .anchor_length = xdg_positioner->anchor_rect.width,
+    .offset = xdg_positioner->offset_x,
+    .anchor_edges = anchor_edges,
+    .gravity_edges = gravity_edges,
+    .start = POSITIONER_EDGE_LEFT,
+    .end = POSITIONER_EDGE_RIGHT,
+  };
+  y_axis = (PositionerAxis) {
+    .anchor_start = parent_y + xdg_positioner->anchor_rect.y,
+    .anchor_length = xdg_positioner->anchor_rect.height,
+    .offset = xdg_positioner->offset_y,
+    .anchor_edges = anchor_edges,
+    .gravity_edges = gravity_edges,
+    .start = POSITIONER_EDGE_TOP,
+    .end = POSITIONER_EDGE_BOTTOM,
+  };
+
+  get_constraint_area (xdg_popup, &area);
+
+  solve_axis (&x_axis, area.x, area.width, xdg_positioner->constraint_adjustment,
+              XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_FLIP_X,
+              XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_X,
+              XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_RESIZE_X,
+              &x, &width);
+  solve_axis (&y_axis, area.y, area.height, xdg_positioner->constraint_adjustment,
+              XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_FLIP_Y,
+              XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_Y,
+              XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_RESIZE_Y,
+              &y, &height);
+
+  xdg_popup->window_x = x;
+  xdg_popup->window_y = y;
+  xdg_popup_update_position (xdg_popup);
 
-  get_positioner_anchor_point (xdg_positioner, &anchor_x, &anchor_y);
-  anchor_x = anchor_x - x_offset;
-  anchor_y = anchor_y - y_offset;
+  xdg_popup->allocation.x = x - parent_x;
+  xdg_popup->allocation.y = y - parent_y;
+  xdg_popup->allocation.width = width;
+  xdg_popup->allocation.height = height;
+}
 
-  /* Try to keep the popup inside the parent */
-  if (anchor_x + popup_width > parent_width &&
-      (xdg_positioner->constraint_adjustment &
-       XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_X))
-    anchor_x = MAX (0, parent_width - popup_width + x_offset);
+typedef struct
+{
+  WakefieldSurface *surface;
+  struct wl_resource *resource;
+  gboolean repositioned;
+  uint32_t token;
+} XdgPopupPlacement;
 
-  if (anchor_y + popup_height > parent_height &&
-      xdg_positioner->constraint_adjustment &
-        XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_Y)
-    anchor_y = MAX (0, parent_height - popup_height + y_offset);
+static void
+xdg_popup_placement_free (gpointer user_data)
+{
+  XdgPopupPlacement *placement = user_data;
 
-  /* Try to keep the popup inside the compositor area */
-  if (anchor_x + popup_width > max_width &&
-      (xdg_positioner->constraint_adjustment &
-       XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_X))
-    anchor_x = MAX (0, max_width - popup_width + x_offset);
+  g_object_unref (placement->surface);
+  g_free (placement);
+}
 
-  if (anchor_y + popup_height > max_height &&
-      xdg_positioner->constraint_adjustment &
-        XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_SLIDE_Y)
-    anchor_y = MAX (0, max_height - popup_height + y_offset);
+static void
+place_popup_in_main (WakefieldCompositor *compositor,
+                     gpointer             user_data)
+{
+  XdgPopupPlacement *placement = user_data;
+  WakefieldSurface *surface = placement->surface;
+  WakefieldXdgPopup *xdg_popup = surface->xdg_popup;
+
+  /* The popup may be gone by now */
+  if (surface->resource == NULL || xdg_popup == NULL || surface->xdg_surface == NULL ||
+      xdg_popup->resource != placement->resource)
+    return;
 
-  /* Resize the popup if nothing else was possible */
-  if (anchor_x + popup_width > max_width &&
-      (xdg_positioner->constraint_adjustment &
-       XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_RESIZE_X))
-    popup_width = MAX (0, max_width - anchor_x);
+  xdg_popup_compute_allocation (xdg_popup);
 
-  if (anchor_y + popup_height > max_height &&
-      xdg_positioner->constraint_adjustment &
-        XDG_POSITIONER_CONSTRAINT_ADJUSTMENT_RESIZE_Y)
-    popup_height = MAX (0, max_height - anchor_y);
+  if (placement->repositioned)
+    xdg_popup_send_repositioned (xdg_popup->resource, placement->token);
 
-  xdg_popup->allocation.x = MAX (0, anchor_x + xdg_positioner->offset_x);
-  xdg_popup->allocation.y = MAX (0, anchor_y + xdg_positioner->offset_y);
-  xdg_popup->allocation.width = popup_width;
-  xdg_popup->allocation.height = popup_height;
+  wakefield_compositor_send_configure (compositor, surface->xdg_surface->resource);
+}
+
+/* Solves the positioner in main, then configures the popup */
+static void
+xdg_popup_place (WakefieldXdgPopup *xdg_popup,
+                 gboolean           repositioned,
+                 uint32_t           token)
+{
+  XdgPopupPlacement *placement = g_new0 (XdgPopupPlacement, 1);
+
+  placement->surface = g_object_ref (xdg_popup->surface);
+  placement->resource = xdg_popup->resource;
+  placement->repositioned = repositioned;
+  placement->token = token;
+
+  wakefield_compositor_run_in_main (xdg_popup->surface->compositor,
+                                    place_popup_in_main,
+                                    placement, xdg_popup_placement_free);
 }
 
 static void
@@ -1228,14 +2035,12 @@ xdg_popup_reposition (struct wl_client *client,
 {
   WakefieldXdgPopup *xdg_popup = wl_resource_get_user_data (resource);
   WakeFieldXdgPositioner *xdg_positioner = wl_resource_get_user_data (positioner);
-  WakefieldSurface *surface = xdg_popup->surface;
 
-  xdg_popup->xdg_positioner = *xdg_positioner;
-  xdg_popup_compute_allocation (xdg_popup, FALSE);
-  xdg_popup_send_repositioned (resource, token);
+  if (xdg_popup->surface == NULL)
+    return;
 
-  wakefield_compositor_send_configure (
-    wakefield_surface_get_compositor (surface), surface->xdg_surface->resource);
+  xdg_popup->xdg_positioner = *xdg_positioner;
+  xdg_popup_place (xdg_popup, TRUE, token);
 }
 
 static const struct xdg_popup_interface xdg_popup_implementation = {
@@ -1334,10 +2139,7 @@ xdg_surface_get_popup (struct wl_client *client,
                                   &xdg_popup_implementation, xdg_popup,
                                   xdg_popup_finalize);
 
-  xdg_popup_compute_allocation (xdg_popup, FALSE);
-
-  wakefield_compositor_send_configure (
-    wakefield_surface_get_compositor (surface), xdg_surface->resource);
+  xdg_popup_place (xdg_popup, FALSE, 0);
 }
 
 void
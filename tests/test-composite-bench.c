@@ -0,0 +1,122 @@
+#include <gtk/gtk.h>
+#include <pixman.h>
+#include <stdlib.h>
+#include "wakefield-private.h"
+
+/* Compares the cairo path surfaces used to be drawn with against the
+   pixman one, on a full HD buffer with a few damaged rectangles. Both
+   draw through a cairo context clipped to the damage like GTK's. */
+
+#define WIDTH 1920
+#define HEIGHT 1080
+
+static const cairo_rectangle_int_t damage[] = {
+  { 0, 0, WIDTH, 32 },
+  { 100, 200, 640, 480 },
+  { 1200, 700, 300, 300 },
+};
+
+static void
+fill_buffer (guint32 *data, gboolean opaque)
+{
+  int i;
+
+  for (i = 0; i < WIDTH * HEIGHT; i++)
+    data[i] = (opaque ? 0xff000000 : 0x80000000) | (i & 0x00ffffff);
+}
+
+static double
+run_cairo (guint32 *data, cairo_surface_t *target, cairo_format_t format,
+           cairo_operator_t op, int iterations)
+{
+  gint64 start = g_get_monotonic_time ();
+  int i, j;
+
+  for (i = 0; i < iterations; i++)
+    {
+      cairo_surface_t *cr_surface;
+      cairo_t *cr = cairo_create (target);
+
+      for (j = 0; j < (int) G_N_ELEMENTS (damage); j++)
+        cairo_rectangle (cr, damage[j].x, damage[j].y, damage[j].width, damage[j].height);
+      cairo_clip (cr);
+
+      cr_surface = cairo_image_surface_create_for_data ((unsigned char *) data, format,
+                                                        WIDTH, HEIGHT, WIDTH * 4);
+      cairo_set_operator (cr, op);
+      cairo_set_source_surface (cr, cr_surface, 0, 0);
+      cairo_paint (cr);
+
+      cairo_surface_destroy (cr_surface);
+      cairo_destroy (cr);
+    }
+
+  cairo_surface_flush (target);
+
+  return (g_get_monotonic_time () - start) / 1000.0 / iterations;
+}
+
+static double
+run_pixman (guint32 *data, cairo_surface_t *target, pixman_format_code_t format,
+            pixman_op_t op, int iterations)
+{
+  const cairo_rectangle_int_t bounds = { 0, 0, WIDTH, HEIGHT };
+  gint64 start = g_get_monotonic_time ();
+  pixman_image_t *src;
+  int i, j;
+
+  /* Like the buffer image, the source is kept for every frame */
+  src = pixman_image_create_bits (format, WIDTH, HEIGHT, data, WIDTH * 4);
+
+  for (i = 0; i < iterations; i++)
+    {
+      cairo_t *cr = cairo_create (target);
+
+      for (j = 0; j < (int) G_N_ELEMENTS (damage); j++)
+        cairo_rectangle (cr, damage[j].x, damage[j].y, damage[j].width, damage[j].height);
+      cairo_clip (cr);
+
+      if (!wakefield_surface_composite_image (cr, src, &bounds, op))
+        g_error ("The pixman path rejected the target");
+
+      cairo_destroy (cr);
+    }
+
+  cairo_surface_flush (target);
+  pixman_image_unref (src);
+
+  return (g_get_monotonic_time () - start) / 1000.0 / iterations;
+}
+
+int
+main (int argc, char **argv)
+{
+  cairo_surface_t *target;
+  guint32 *data;
+  int iterations = 200;
+
+  if (argc >= 2)
+    iterations = MAX (1, atoi (argv[1]));
+
+  data = g_new (guint32, WIDTH * HEIGHT);
+  target = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, WIDTH, HEIGHT);
+
+  fill_buffer (data, FALSE);
+  g_print ("ARGB over:    cairo %.3f ms, pixman %.3f ms\n",
+           run_cairo (data, target, CAIRO_FORMAT_ARGB32, CAIRO_OPERATOR_OVER, iterations),
+           run_pixman (data, target, PIXMAN_a8r8g8b8, PIXMAN_OP_OVER, iterations));
+
+  fill_buffer (data, TRUE);
+  g_print ("XRGB over:    cairo %.3f ms, pixman %.3f ms\n",
+           run_cairo (data, target, CAIRO_FORMAT_RGB24, CAIRO_OPERATOR_OVER, iterations),
+           run_pixman (data, target, PIXMAN_x8r8g8b8, PIXMAN_OP_OVER, iterations));
+
+  g_print ("XRGB source:  cairo %.3f ms, pixman %.3f ms\n",
+           run_cairo (data, target, CAIRO_FORMAT_RGB24, CAIRO_OPERATOR_SOURCE, iterations),
+           run_pixman (data, target, PIXMAN_x8r8g8b8, PIXMAN_OP_SRC, iterations));
+
+  cairo_surface_destroy (target);
+  g_free (data);
+
+  return 0;
+}
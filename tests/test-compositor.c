@@ -1,6 +1,26 @@
 #include <gtk/gtk.h>
 #include "wakefield-compositor.h"
 
+static gboolean threaded = FALSE;
+static gboolean coalesce_motion = FALSE;
+static int dispatch_budget_us = -1;
+static int client_request_budget = -1;
+static int congestion_threshold = -1;
+
+static GOptionEntry entries[] = {
+  { "threaded", 't', 0, G_OPTION_ARG_NONE, &threaded,
+    "Dispatch clients in their own thread", NULL },
+  { "coalesce-motion", 'm', 0, G_OPTION_ARG_NONE, &coalesce_motion,
+    "Send pointer motion once per frame", NULL },
+  { "dispatch-budget", 0, 0, G_OPTION_ARG_INT, &dispatch_budget_us,
+    "Microseconds spent dispatching before yielding", "USEC" },
+  { "request-budget", 0, 0, G_OPTION_ARG_INT, &client_request_budget,
+    "Requests dispatched per client before yielding", "N" },
+  { "congestion-threshold", 0, 0, G_OPTION_ARG_INT, &congestion_threshold,
+    "Queued bytes after which a client is congested, 0 to disable", "BYTES" },
+  { NULL }
+};
+
 int
 main (int argc, char **argv)
 {
@@ -10,11 +30,26 @@ main (int argc, char **argv)
   GError *error = NULL;
   GtkWidget *vbox;
 
-  gtk_init (&argc, &argv);
+  if (!gtk_init_with_args (&argc, &argv, "[DISPLAY-NAME]", entries, NULL, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
 
   window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
   compositor = wakefield_compositor_new ();
 
+  if (dispatch_budget_us >= 0 || client_request_budget >= 0)
+    wakefield_compositor_set_dispatch_budget (compositor,
+                                              dispatch_budget_us >= 0 ? dispatch_budget_us : 4000,
+                                              client_request_budget >= 0 ? client_request_budget : 256);
+  if (congestion_threshold >= 0)
+    wakefield_compositor_set_congestion_threshold (compositor, congestion_threshold);
+  if (coalesce_motion)
+    wakefield_compositor_set_motion_mode (compositor, WAKEFIELD_MOTION_COALESCE);
+  if (threaded)
+    wakefield_compositor_set_threaded_dispatch (compositor, TRUE);
+
   if (argc >= 2)
     {
       name = argv[1];
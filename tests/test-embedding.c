@@ -2,6 +2,21 @@
 #include "wakefield-compositor.h"
 
 int child_count = 0;
+WakefieldCompositor *first_compositor = NULL;
+
+static gboolean threaded = FALSE;
+static gboolean coalesce_motion = FALSE;
+static int congestion_threshold = -1;
+
+static GOptionEntry entries[] = {
+  { "threaded", 't', 0, G_OPTION_ARG_NONE, &threaded,
+    "Dispatch clients in their own thread", NULL },
+  { "coalesce-motion", 'm', 0, G_OPTION_ARG_NONE, &coalesce_motion,
+    "Send pointer motion once per frame", NULL },
+  { "congestion-threshold", 0, 0, G_OPTION_ARG_INT, &congestion_threshold,
+    "Queued bytes after which a client is congested, 0 to disable", "BYTES" },
+  { NULL }
+};
 
 static void
 button_clicked (GtkButton *button,
@@ -15,7 +30,26 @@ button_clicked (GtkButton *button,
   GError *error = NULL;
   char *argv[] = { "./test-embedded", NULL };
 
-  compositor = wakefield_compositor_new ();
+  /* All the tabs share a single wayland display */
+  if (first_compositor)
+    {
+      compositor = wakefield_compositor_new_shared (first_compositor);
+    }
+  else
+    {
+      compositor = wakefield_compositor_new ();
+      first_compositor = compositor;
+      g_object_add_weak_pointer (G_OBJECT (compositor), (gpointer *) &first_compositor);
+
+      /* These are per display, so shared by all the tabs */
+      if (congestion_threshold >= 0)
+        wakefield_compositor_set_congestion_threshold (compositor, congestion_threshold);
+      if (threaded)
+        wakefield_compositor_set_threaded_dispatch (compositor, TRUE);
+    }
+
+  if (coalesce_motion)
+    wakefield_compositor_set_motion_mode (compositor, WAKEFIELD_MOTION_COALESCE);
 
   gtk_widget_set_size_request (GTK_WIDGET (compositor), 400, 400);
 
@@ -58,8 +92,13 @@ main (int argc, char **argv)
 {
   GtkWidget *window;
   GtkWidget *vbox, *hbox, *button, *stack, *switcher;
+  GError *error = NULL;
 
-  gtk_init (&argc, &argv);
+  if (!gtk_init_with_args (&argc, &argv, NULL, entries, NULL, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
 
   window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
 